@@ -0,0 +1,226 @@
+#include "adaptivelimit.h"
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Gate hands out slots up to a limit that update() moves with each sample.
+class Gate {
+	public:
+		Gate(uint32_t initial, uint32_t minLimit, uint32_t maxLimit) :
+			min_(max<uint32_t>(minLimit, 1)),
+			max_(max(maxLimit, min_)),
+			limit_(clamp(initial)),
+			inflight_(0) {}
+		virtual ~Gate() {}
+
+		bool Acquire(int64_t timeout) {
+			unique_lock<mutex> lck(mtx_);
+			auto free = [this] { return inflight_ < slots(); };
+			if (timeout == 0) {
+				if (!free()) {
+					return false;
+				}
+			} else if (timeout < 0) {
+				cv_.wait(lck, free);
+			} else if (!cv_.wait_for(lck, milliseconds(timeout), free)) {
+				return false;
+			}
+			++inflight_;
+			return true;
+		}
+
+		void Release(microseconds latency) {
+			lock_guard<mutex> lck(mtx_);
+			// The sample is taken with the load the task saw.
+			uint32_t inflight = inflight_--;
+			auto before = slots();
+			limit_ = clamp(update(static_cast<double>(latency.count()), inflight));
+			if (slots() > before) {
+				cv_.notify_all();
+			} else {
+				cv_.notify_one();
+			}
+		}
+
+		void Cancel() {
+			lock_guard<mutex> lck(mtx_);
+			--inflight_;
+			cv_.notify_one();
+		}
+
+		uint32_t Limit() {
+			lock_guard<mutex> lck(mtx_);
+			return slots();
+		}
+
+		uint32_t InFlight() {
+			lock_guard<mutex> lck(mtx_);
+			return inflight_;
+		}
+
+	protected:
+		// update returns the new limit for a sample. It is called with the
+		// lock held.
+		virtual double update(double latency, uint32_t inflight) = 0;
+
+		double limit() const {
+			return limit_;
+		}
+
+	private:
+		const uint32_t min_;
+		const uint32_t max_;
+		double limit_; // fractional, so that small steps add up
+		uint32_t inflight_;
+		mutex mtx_;
+		condition_variable cv_;
+
+		double clamp(double l) const {
+			return std::min<double>(std::max<double>(l, min_), max_);
+		}
+
+		uint32_t slots() const {
+			return static_cast<uint32_t>(limit_);
+		}
+};
+
+} // namespace
+
+
+class Gradient2Limiter::Impl : public Gate {
+	public:
+		Impl(uint32_t initial, uint32_t minLimit, uint32_t maxLimit, double tolerance, double smoothing, uint32_t window) :
+			Gate(initial, minLimit, maxLimit),
+			tolerance_(max(tolerance, 1.0)),
+			smoothing_(min(max(smoothing, 0.01), 1.0)),
+			window_(max<uint32_t>(window, kWarmup)),
+			samples_(0),
+			shortRtt_(0),
+			longRtt_(0) {}
+
+	protected:
+		virtual double update(double rtt, uint32_t inflight) override {
+			rtt = max(rtt, 1.0);
+			++samples_;
+			if (samples_ <= kWarmup) {
+				// Plain averages until the first samples are in.
+				shortRtt_ += (rtt - shortRtt_) / samples_;
+				longRtt_ += (rtt - longRtt_) / samples_;
+				return limit();
+			}
+			shortRtt_ += (rtt - shortRtt_) / kShortWindow;
+			longRtt_ += (rtt - longRtt_) / window_;
+			// After a load peak the long-term average lags behind; let it
+			// catch up, so that it does not hold the limit high.
+			if (longRtt_ / shortRtt_ > 2) {
+				longRtt_ *= 0.95;
+			}
+			if (inflight < limit() / 2) {
+				return limit(); // not enough load to tell
+			}
+			double gradient = max(0.5, min(1.0, tolerance_ * longRtt_ / shortRtt_));
+			double queue = sqrt(limit());
+			double target = limit() * gradient + queue;
+			return limit() * (1 - smoothing_) + target * smoothing_;
+		}
+
+	private:
+		static const uint32_t kWarmup = 10;
+		static const uint32_t kShortWindow = 10;
+
+		const double tolerance_;
+		const double smoothing_;
+		const uint32_t window_;
+		uint64_t samples_;
+		double shortRtt_; // average latency of the last samples, in us
+		double longRtt_;  // average latency over the window, in us
+};
+
+const uint32_t Gradient2Limiter::Impl::kWarmup;
+const uint32_t Gradient2Limiter::Impl::kShortWindow;
+
+Gradient2Limiter::Gradient2Limiter(uint32_t initial, uint32_t minLimit, uint32_t maxLimit,
+		double tolerance, double smoothing, uint32_t window) {
+	impl_ = std::make_unique<Impl>(initial, minLimit, maxLimit, tolerance, smoothing, window);
+}
+
+Gradient2Limiter::~Gradient2Limiter() {}
+
+bool Gradient2Limiter::Acquire(int64_t timeout) {
+	return impl_->Acquire(timeout);
+}
+
+void Gradient2Limiter::Release(microseconds latency) {
+	impl_->Release(latency);
+}
+
+void Gradient2Limiter::Cancel() {
+	impl_->Cancel();
+}
+
+uint32_t Gradient2Limiter::Limit() {
+	return impl_->Limit();
+}
+
+uint32_t Gradient2Limiter::InFlight() {
+	return impl_->InFlight();
+}
+
+
+class AimdLimiter::Impl : public Gate {
+	public:
+		Impl(int64_t threshold, uint32_t initial, uint32_t minLimit, uint32_t maxLimit, double backoff) :
+			Gate(initial, minLimit, maxLimit),
+			threshold_(duration_cast<microseconds>(milliseconds(threshold)).count()),
+			backoff_(min(max(backoff, 0.1), 0.99)) {}
+
+	protected:
+		virtual double update(double latency, uint32_t inflight) override {
+			if (latency > threshold_) {
+				return limit() * backoff_;
+			}
+			if (inflight * 2 >= limit()) {
+				return limit() + 1;
+			}
+			return limit();
+		}
+
+	private:
+		const double threshold_; // us
+		const double backoff_;
+};
+
+AimdLimiter::AimdLimiter(int64_t threshold, uint32_t initial, uint32_t minLimit, 
+		uint32_t maxLimit, double backoff) {
+	impl_ = std::make_unique<Impl>(threshold, initial, minLimit, maxLimit, backoff);
+}
+
+AimdLimiter::~AimdLimiter() {}
+
+bool AimdLimiter::Acquire(int64_t timeout) {
+	return impl_->Acquire(timeout);
+}
+
+void AimdLimiter::Release(microseconds latency) {
+	impl_->Release(latency);
+}
+
+void AimdLimiter::Cancel() {
+	impl_->Cancel();
+}
+
+uint32_t AimdLimiter::Limit() {
+	return impl_->Limit();
+}
+
+uint32_t AimdLimiter::InFlight() {
+	return impl_->InFlight();
+}
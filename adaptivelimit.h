@@ -0,0 +1,58 @@
+#ifndef __ADAPTIVELIMIT_H_
+#define __ADAPTIVELIMIT_H_
+
+#include "concurrencylimiter.h"
+
+#include <memory>
+
+// Gradient2Limiter adjusts the limit by the ratio of the long-term to the
+// short-term average latency, after the Gradient2 algorithm of Netflix's
+// concurrency-limits: while latency stays near its long-term level the limit
+// grows by a queue allowance, as latency rises above tolerance times that
+// level the limit shrinks, by at most half per sample. Each new limit is
+// blended into the old one with weight smoothing. The long-term average
+// drifts down after a load peak, so that the limit recovers. The limit does
+// not grow while less than half of it is used.
+class Gradient2Limiter : public ConcurrencyLimiter {
+	public:
+		Gradient2Limiter(uint32_t initial = 20, uint32_t minLimit = 1, uint32_t maxLimit = 200,
+				double tolerance = 1.5, double smoothing = 0.2, uint32_t window = 600);
+		Gradient2Limiter(const Gradient2Limiter&) = delete;
+		Gradient2Limiter& operator=(const Gradient2Limiter&) = delete;
+		~Gradient2Limiter();
+
+		virtual bool Acquire(int64_t timeout) override;
+		virtual void Release(std::chrono::microseconds latency) override;
+		virtual void Cancel() override;
+		virtual uint32_t Limit() override;
+		virtual uint32_t InFlight() override;
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl> impl_;
+};
+
+// AimdLimiter grows the limit by one for each sample within threshold, while
+// at least half of the limit is used, and multiplies it by backoff for each
+// sample beyond.
+class AimdLimiter : public ConcurrencyLimiter {
+	public:
+		// threshold is in milliseconds.
+		AimdLimiter(int64_t threshold, uint32_t initial = 20, uint32_t minLimit = 1, 
+				uint32_t maxLimit = 200, double backoff = 0.9);
+		AimdLimiter(const AimdLimiter&) = delete;
+		AimdLimiter& operator=(const AimdLimiter&) = delete;
+		~AimdLimiter();
+
+		virtual bool Acquire(int64_t timeout) override;
+		virtual void Release(std::chrono::microseconds latency) override;
+		virtual void Cancel() override;
+		virtual uint32_t Limit() override;
+		virtual uint32_t InFlight() override;
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl> impl_;
+};
+
+#endif // __ADAPTIVELIMIT_H_
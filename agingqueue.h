@@ -0,0 +1,165 @@
+//
+// Implement a priority queue whose items gain priority while they wait.
+//
+
+#ifndef __AGINGQUEUE_H_
+#define __AGINGQUEUE_H_
+
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+
+#include "channel.h"
+
+// AgingPriQueue orders items by effective priority, not thread-safe:
+//
+//   effective = T::GetPriority() + min(maxBoost, waited / step)
+//
+// so that low priority items cannot starve under a steady stream of high
+// priority ones. Ties go to the item queued first. Items of the same
+// priority wait in one FIFO level and age at the same rate, so the head of a
+// level always has the highest effective priority of the level: pop() only
+// compares the level heads, and never re-sorts the queue. Levels more than
+// maxBoost below the best head found are not even looked at.
+//
+// Items with a key (see ChannelTraits<T>::Key()) can be moved to another
+// level while queued with reprioritize(), or removed with erase().
+template<class T>
+class AgingPriQueue {
+	using Clock = std::chrono::steady_clock;
+	public:
+		AgingPriQueue() : size_(0), seq_(0), step_(kDefaultStep), maxBoost_(kDefaultMaxBoost) {}
+		explicit AgingPriQueue(uint32_t sz) : AgingPriQueue() {}
+
+		void push(const T &t) {
+			int p = t.GetPriority();
+			auto &level = levels_[p];
+			level.push_back(Entry{t, Clock::now(), seq_++});
+			auto key = ChannelTraits<T>::Key(t);
+			if (key != nullptr) {
+				index_[key] = Position{p, std::prev(level.end())};
+			}
+			++size_;
+		}
+
+		T pop() {
+			auto now = Clock::now();
+			auto best = levels_.end();
+			int64_t bestEff = 0;
+			for (auto it = levels_.end(); it != levels_.begin(); ) {
+				--it;
+				if (best != levels_.end() && it->first + maxBoost_ < bestEff) {
+					break; // cannot catch up any more
+				}
+				auto &head = it->second.front();
+				int64_t eff = it->first + boost(now - head.enqueued);
+				if (best == levels_.end() || eff > bestEff || 
+						(eff == bestEff && head.seq < best->second.front().seq)) {
+					best = it;
+					bestEff = eff;
+				}
+			}
+			auto item = best->second.front().item;
+			best->second.pop_front();
+			if (best->second.empty()) {
+				levels_.erase(best);
+			}
+			auto key = ChannelTraits<T>::Key(item);
+			if (key != nullptr) {
+				index_.erase(key);
+			}
+			--size_;
+			return item;
+		}
+
+		size_t size() {
+			return size_;
+		}
+
+		// setAging sets the wait that raises the effective priority of an
+		// item by one, and the highest raise. step == 0 disables aging.
+		void setAging(std::chrono::milliseconds step, int maxBoost) {
+			step_ = step;
+			maxBoost_ = std::max(maxBoost, 0);
+		}
+
+		// erase removes the queued item with the given key. It returns false
+		// if no such item is queued.
+		bool erase(const void *key) {
+			auto it = index_.find(key);
+			if (it == index_.end()) {
+				return false;
+			}
+			auto level = levels_.find(it->second.level);
+			level->second.erase(it->second.entry);
+			if (level->second.empty()) {
+				levels_.erase(level);
+			}
+			index_.erase(it);
+			--size_;
+			return true;
+		}
+
+		// reprioritize moves the queued item with the given key to level
+		// priority, keeping the time it has waited. It returns false if no
+		// such item is queued.
+		bool reprioritize(const void *key, int priority) {
+			auto it = index_.find(key);
+			if (it == index_.end()) {
+				return false;
+			}
+			auto &pos = it->second;
+			if (pos.level == priority) {
+				return true;
+			}
+			auto from = levels_.find(pos.level);
+			auto &to = levels_[priority];
+			// Keep the level in queueing order, so its head stays the oldest.
+			auto at = to.end();
+			while (at != to.begin() && std::prev(at)->seq > pos.entry->seq) {
+				--at;
+			}
+			to.splice(at, from->second, pos.entry);
+			if (from->second.empty()) {
+				levels_.erase(from);
+			}
+			pos.level = priority;
+			return true;
+		}
+
+	private:
+		static constexpr std::chrono::milliseconds kDefaultStep{100};
+		static const int kDefaultMaxBoost = 10;
+
+		struct Entry {
+			T item;
+			Clock::time_point enqueued;
+			uint64_t seq;
+		};
+		using Level = std::list<Entry>;
+		struct Position {
+			int level;
+			typename Level::iterator entry;
+		};
+
+		size_t size_;
+		uint64_t seq_;
+		std::chrono::milliseconds step_;
+		int64_t maxBoost_;
+		std::map<int, Level> levels_;
+		std::unordered_map<const void*, Position> index_;
+
+		int64_t boost(Clock::duration waited) {
+			if (step_.count() <= 0) {
+				return 0;
+			}
+			return std::min<int64_t>(maxBoost_, waited / step_);
+		}
+};
+
+template<class T>
+constexpr std::chrono::milliseconds AgingPriQueue<T>::kDefaultStep;
+
+#endif // __AGINGQUEUE_H_
@@ -0,0 +1,76 @@
+// 
+// Implementation of Arena.
+//
+
+#include "arena.h"
+
+#include <algorithm>
+
+using namespace std;
+
+Arena::Arena(size_t blockSize) :
+	blockSize_(blockSize > 0 ? blockSize : kDefaultBlock),
+	trim_(0),
+	block_(0),
+	begin_(0),
+	cur_(0),
+	end_(0),
+	used_(0),
+	reserved_(0) {
+	// Blocks are allocated on first use, so idle workers cost nothing.
+}
+
+Arena::~Arena() {
+	for (auto &b : blocks_) {
+		::operator delete(b.data);
+	}
+}
+
+void Arena::enter(size_t i) {
+	block_ = i;
+	begin_ = reinterpret_cast<uintptr_t>(blocks_[i].data);
+	cur_ = begin_;
+	end_ = begin_ + blocks_[i].size;
+}
+
+// allocateSlow moves on to the next block that fits, or adds one.
+void* Arena::allocateSlow(size_t n, size_t align) {
+	size_t need = n + align - 1;
+	if (!blocks_.empty()) {
+		used_ += cur_ - begin_;
+		for (size_t i = block_ + 1; i < blocks_.size(); ++i) {
+			if (blocks_[i].size >= need) {
+				enter(i);
+				return Allocate(n, align);
+			}
+			used_ += blocks_[i].size; // skipped
+		}
+	}
+	size_t size = max(blockSize_, need);
+	blocks_.push_back(Block{static_cast<char*>(::operator new(size)), size});
+	reserved_ += size;
+	enter(blocks_.size() - 1);
+	return Allocate(n, align);
+}
+
+void Arena::resetSlow() {
+	used_ = 0;
+	if (trim_ > 0) {
+		// Keep the first blocks up to the high-water mark.
+		size_t kept = 0, i = 0;
+		for (; i < blocks_.size() && kept + blocks_[i].size <= trim_; ++i) {
+			kept += blocks_[i].size;
+		}
+		for (size_t j = i; j < blocks_.size(); ++j) {
+			::operator delete(blocks_[j].data);
+		}
+		blocks_.resize(i);
+		reserved_ = kept;
+	}
+	if (blocks_.empty()) {
+		block_ = 0;
+		begin_ = cur_ = end_ = 0;
+		return;
+	}
+	enter(0);
+}
@@ -0,0 +1,180 @@
+//
+// arena.h
+//
+// Define Arena, a bump allocator for the scratch memory of running tasks.
+//
+
+#ifndef __ARENA_H_
+#define __ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <new>
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
+// Arena hands out memory by bumping a pointer through blocks it keeps. Memory
+// is not freed one allocation at a time: Reset() releases everything at once
+// and keeps the blocks for reuse. A worker resets its arena after each task,
+// so allocations from it must not outlive the task. Not thread-safe.
+class Arena {
+	public:
+		static const size_t kDefaultBlock = 64 * 1024;
+
+		// blockSize is the size of the blocks the arena grows by; larger
+		// allocations get a block of their own.
+		explicit Arena(size_t blockSize = kDefaultBlock);
+		Arena(const Arena&) = delete;
+		Arena& operator=(const Arena&) = delete;
+		~Arena();
+
+		// Allocate returns n bytes aligned to align, a power of two. It never
+		// returns nullptr, not even for n == 0.
+		void* Allocate(size_t n, size_t align = alignof(std::max_align_t)) {
+			uintptr_t p = (cur_ + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+			// p + n <= end_, except that without a block (p == 0) even
+			// n == 0 takes the slow path.
+			if (p + n - 1 < end_) {
+				cur_ = p + n;
+				return reinterpret_cast<void*>(p);
+			}
+			return allocateSlow(n, align);
+		}
+
+		// Reset releases all allocations. Blocks beyond the trim size are
+		// freed, the others are kept for the next task.
+		void Reset() {
+			if (used_ == 0 && cur_ == begin_) {
+				return; // nothing allocated since the last reset
+			}
+			resetSlow();
+		}
+
+		// SetBlockSize sets the size of the blocks allocated from now on.
+		void SetBlockSize(size_t blockSize) {
+			blockSize_ = blockSize > 0 ? blockSize : kDefaultBlock;
+		}
+
+		// SetTrim sets the number of bytes of blocks Reset() keeps; 0 keeps
+		// them all.
+		void SetTrim(size_t bytes) {
+			trim_ = bytes;
+		}
+
+		// Used returns the bytes allocated since the last reset, including
+		// alignment padding.
+		size_t Used() const {
+			return used_ + (cur_ - begin_);
+		}
+
+		// Reserved returns the bytes of blocks held.
+		size_t Reserved() const {
+			return reserved_;
+		}
+
+	private:
+		struct Block {
+			char *data;
+			size_t size;
+		};
+
+		size_t blockSize_;
+		size_t trim_;
+		std::vector<Block> blocks_;
+		size_t block_;     // index of the current block
+		uintptr_t begin_;  // start, bump pointer and end of the current block
+		uintptr_t cur_;
+		uintptr_t end_;
+		size_t used_;      // bytes used in the blocks before the current one
+		size_t reserved_;
+
+		void* allocateSlow(size_t n, size_t align);
+		void resetSlow();
+		void enter(size_t i);
+};
+
+// CurrentWorker gives task code access to the state of the worker running it.
+class CurrentWorker {
+	public:
+		// Arena returns the scratch arena of the calling worker, reset after
+		// each task, or nullptr if the caller is not a worker.
+		static ::Arena* Arena() {
+			return current();
+		}
+
+		// SetArena is called by the worker thread.
+		static void SetArena(::Arena *a) {
+			current() = a;
+		}
+
+	private:
+		static ::Arena*& current() {
+			static thread_local ::Arena *a = nullptr;
+			return a;
+		}
+};
+
+// ArenaAllocator adapts an Arena to the standard allocator interface, e.g.
+//
+//   std::vector<int, ArenaAllocator<int>> v(ArenaAllocator<int>(CurrentWorker::Arena()));
+//
+// deallocate() is a no-op; memory comes back with Arena::Reset().
+template<class T>
+class ArenaAllocator {
+	public:
+		using value_type = T;
+
+		explicit ArenaAllocator(Arena *a) : arena_(a) {}
+		template<class U>
+		ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena()) {}
+
+		T* allocate(size_t n) {
+			return static_cast<T*>(arena_->Allocate(n * sizeof(T), alignof(T)));
+		}
+		void deallocate(T *p, size_t n) {}
+
+		Arena* arena() const {
+			return arena_;
+		}
+
+	private:
+		Arena *arena_;
+};
+
+template<class T, class U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+	return a.arena() == b.arena();
+}
+
+template<class T, class U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+	return !(a == b);
+}
+
+#if __cplusplus >= 201703L
+// ArenaResource adapts an Arena to std::pmr, e.g. (C++17 only; see the
+// arena17_test target)
+//
+//   ArenaResource r(CurrentWorker::Arena());
+//   std::pmr::vector<int> v(&r);
+class ArenaResource : public std::pmr::memory_resource {
+	public:
+		explicit ArenaResource(Arena *a) : arena_(a) {}
+
+	private:
+		Arena *arena_;
+
+		void* do_allocate(size_t n, size_t align) override {
+			return arena_->Allocate(n, align);
+		}
+		void do_deallocate(void *p, size_t n, size_t align) override {}
+		bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+			auto r = dynamic_cast<const ArenaResource*>(&other);
+			return r != nullptr && r->arena_ == arena_;
+		}
+};
+#endif
+
+#endif // __ARENA_H_
@@ -0,0 +1,74 @@
+//
+// Mark regions of a task that block, so that the pool can compensate.
+//
+
+#ifndef __BLOCKING_H_
+#define __BLOCKING_H_
+
+#include <memory>
+
+#include "runnable.h"
+
+// BlockingHook is told when the task running on the current thread enters or
+// leaves a blocking region. A pool installs its hook on each worker thread.
+class BlockingHook {
+	public:
+		virtual ~BlockingHook() {}
+		virtual void BeginBlocking() = 0;
+		virtual void EndBlocking() = 0;
+
+		// Current returns the hook of the calling thread, nullptr outside a
+		// worker.
+		static BlockingHook*& Current() {
+			static thread_local BlockingHook *hook = nullptr;
+			return hook;
+		}
+};
+
+// BlockingScope marks the enclosing region of Run() as blocking, e.g. around
+// disk I/O or a foreign lock:
+//
+//   {
+//       BlockingScope blocking;
+//       read(fd, buf, n);
+//   }
+//
+// Nested scopes count once. Outside a worker the scope does nothing.
+class BlockingScope {
+	public:
+		BlockingScope() : hook_(BlockingHook::Current()) {
+			if (hook_ != nullptr && depth()++ == 0) {
+				hook_->BeginBlocking();
+			}
+		}
+		~BlockingScope() {
+			if (hook_ != nullptr && --depth() == 0) {
+				hook_->EndBlocking();
+			}
+		}
+		BlockingScope(const BlockingScope&) = delete;
+		BlockingScope& operator=(const BlockingScope&) = delete;
+
+	private:
+		BlockingHook *hook_;
+
+		static int& depth() {
+			static thread_local int d = 0;
+			return d;
+		}
+};
+
+// BlockingRunnable runs a task inside a BlockingScope.
+class BlockingRunnable : public Runnable {
+	public:
+		explicit BlockingRunnable(const std::shared_ptr<Runnable> &task) : task_(task) {}
+		virtual void Run() override {
+			BlockingScope blocking;
+			task_->Run();
+		}
+
+	private:
+		std::shared_ptr<Runnable> task_;
+};
+
+#endif // __BLOCKING_H_
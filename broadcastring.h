@@ -0,0 +1,341 @@
+//
+// Implement a ring buffer that delivers every event to every consumer.
+//
+
+#ifndef __BROADCASTRING_H_
+#define __BROADCASTRING_H_
+
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <stdint.h>
+
+#include "def.h"
+#include "runnable.h"
+
+// Sequence is a counter of events, padded so that the sequences of different
+// producers and consumers do not share cache lines.
+class Sequence {
+	public:
+		explicit Sequence(int64_t v = -1) : value_(v) {}
+		Sequence(const Sequence&) = delete;
+		Sequence& operator=(const Sequence&) = delete;
+
+		// Both are sequentially consistent: a thread that moves a sequence
+		// and then looks for blocked waiters must not miss one that counted
+		// itself and then looked at the sequence.
+		int64_t Get() const {
+			return value_.load();
+		}
+		void Set(int64_t v) {
+			value_.store(v);
+		}
+
+	private:
+		char pad0_[CACHELINE_SIZE];
+		std::atomic<int64_t> value_;
+		char pad1_[CACHELINE_SIZE];
+};
+
+// BroadcastRing is a Disruptor-style ring buffer: events are written once
+// into preallocated slots and read in place by all consumers, each of which
+// tracks its own cursor. A consumer may depend on the cursors of others,
+// e.g. an auditor that only sees events after the indexer did, forming a
+// dependency graph; producers wait for the slowest consumer (the gating
+// sequences) before they reuse a slot.
+//
+// Events are numbered from 0. Waiting threads spin briefly, then block; the
+// threads that move a sequence only take the lock if someone is blocked.
+template<class T>
+class BroadcastRing {
+	public:
+		// size is rounded up to a power of two.
+		explicit BroadcastRing(uint32_t size) :
+			claimed_(-1),
+			gatingMin_(-1),
+			waiters_(0),
+			closed_(false) {
+			uint32_t cap = 1;
+			while (cap < size) {
+				cap <<= 1;
+			}
+			mask_ = cap - 1;
+			slots_.resize(cap);
+		}
+		BroadcastRing(const BroadcastRing&) = delete;
+		BroadcastRing& operator=(const BroadcastRing&) = delete;
+
+		// Claim reserves the next slot for the caller to fill in place
+		// through At(), then Publish(seq). It waits while the slot is still
+		// read by a gating consumer; timeout has the same meaning as for
+		// Channel::Put(). It returns false on timeout or once the ring is
+		// closed.
+		bool Claim(int64_t &seq, int64_t timeout = -1) {
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+			bool ok = false;
+			waitFor([&] {
+				if (closed_) {
+					return true;
+				}
+				ok = tryClaim(seq);
+				return ok;
+			}, timeout, deadline);
+			return ok;
+		}
+
+		// At gives access to the slot of event seq.
+		T& At(int64_t seq) {
+			return slots_[seq & mask_];
+		}
+
+		// Publish makes a claimed event visible to consumers. Producers
+		// publish in the order they claimed.
+		void Publish(int64_t seq) {
+			while (cursor_.Get() != seq - 1) {
+				std::this_thread::yield(); // an earlier claim is being filled
+			}
+			cursor_.Set(seq);
+			signal();
+		}
+
+		// Publish copies item into the next slot.
+		bool Publish(const T &item, int64_t timeout = -1) {
+			int64_t seq = -1;
+			if (!Claim(seq, timeout)) {
+				return false;
+			}
+			At(seq) = item;
+			Publish(seq);
+			return true;
+		}
+
+		// Close stops producers; consumers return once they have read every
+		// published event. Events claimed but not yet published when the
+		// ring is closed may be missed, so close after the producers are done.
+		void Close() {
+			std::lock_guard<std::mutex> lck(mtx_);
+			closed_ = true;
+			cv_.notify_all();
+		}
+
+		bool Closed() const {
+			return closed_;
+		}
+
+		// Cursor returns the sequence of the last published event.
+		int64_t Cursor() const {
+			return cursor_.Get();
+		}
+
+		const Sequence& CursorSequence() const {
+			return cursor_;
+		}
+
+		uint32_t Size() const {
+			return mask_ + 1;
+		}
+
+		// AddGating makes producers wait for s before reusing a slot.
+		void AddGating(const Sequence *s) {
+			std::lock_guard<std::mutex> lck(gatingMtx_);
+			gating_.push_back(s);
+		}
+
+		void RemoveGating(const Sequence *s) {
+			{
+				std::lock_guard<std::mutex> lck(gatingMtx_);
+				gating_.erase(std::remove(gating_.begin(), gating_.end(), s), gating_.end());
+			}
+			signal();
+		}
+
+		// Barrier tells a consumer up to which event it may read: the events
+		// published and seen by all the consumers it depends on.
+		class Barrier {
+			public:
+				Barrier(BroadcastRing &ring, std::vector<const Sequence*> deps) :
+					ring_(ring),
+					deps_(deps) {
+					if (deps_.empty()) {
+						deps_.push_back(&ring.cursor_);
+					}
+				}
+
+				// WaitFor returns the highest available sequence, at least
+				// seq, waiting as needed. It returns seq - 1 once the ring
+				// is closed and seq will never be published.
+				int64_t WaitFor(int64_t seq) {
+					int64_t avail = seq - 1;
+					ring_.waitFor([&] {
+						avail = available();
+						return avail >= seq || (ring_.closed_ && seq > ring_.Cursor());
+					}, -1, std::chrono::steady_clock::time_point());
+					return avail >= seq ? avail : seq - 1;
+				}
+
+			private:
+				BroadcastRing &ring_;
+				std::vector<const Sequence*> deps_;
+
+				int64_t available() const {
+					int64_t m = std::numeric_limits<int64_t>::max();
+					for (auto d : deps_) {
+						m = std::min(m, d->Get());
+					}
+					return m;
+				}
+		};
+
+	private:
+		static const int kSpins = 100;
+
+		std::vector<T> slots_;
+		uint32_t mask_;
+		Sequence cursor_;                // last published event
+		char pad0_[CACHELINE_SIZE];
+		std::atomic<int64_t> claimed_;   // last claimed event
+		std::atomic<int64_t> gatingMin_; // cached slowest gating sequence
+		char pad1_[CACHELINE_SIZE];
+		std::mutex gatingMtx_;
+		std::vector<const Sequence*> gating_;
+		std::mutex mtx_;                 // only taken to block and to wake
+		std::condition_variable cv_;
+		std::atomic<uint32_t> waiters_;
+		std::atomic<bool> closed_;
+
+		int64_t minGating() {
+			std::lock_guard<std::mutex> lck(gatingMtx_);
+			int64_t m = cursor_.Get(); // without consumers, slots are free once published
+			for (auto s : gating_) {
+				m = std::min(m, s->Get());
+			}
+			return m;
+		}
+
+		// tryClaim takes the next sequence if its slot has been read by all
+		// gating consumers. The slowest gating sequence is only recomputed
+		// when the cached one says the ring is full.
+		bool tryClaim(int64_t &seq) {
+			int64_t cur = claimed_.load(std::memory_order_relaxed);
+			while (true) {
+				int64_t wrap = cur + 1 - static_cast<int64_t>(mask_ + 1);
+				if (wrap > gatingMin_.load(std::memory_order_relaxed)) {
+					int64_t m = minGating();
+					gatingMin_.store(m, std::memory_order_relaxed);
+					if (wrap > m) {
+						return false;
+					}
+				}
+				if (claimed_.compare_exchange_weak(cur, cur + 1, std::memory_order_acq_rel)) {
+					seq = cur + 1;
+					return true;
+				}
+			}
+		}
+
+		// waitFor spins, then blocks until ready() returns true or the
+		// deadline passes. It returns ready().
+		template<class F>
+		bool waitFor(F ready, int64_t timeout, std::chrono::steady_clock::time_point deadline) {
+			for (int i = 0; i < kSpins; ++i) {
+				if (ready()) {
+					return true;
+				}
+			}
+			if (timeout == 0) {
+				return false;
+			}
+			std::unique_lock<std::mutex> lck(mtx_);
+			++waiters_;
+			bool ok = true;
+			while (!ready()) {
+				if (timeout < 0) {
+					cv_.wait(lck);
+				} else if (cv_.wait_until(lck, deadline) == std::cv_status::timeout) {
+					ok = ready();
+					break;
+				}
+			}
+			--waiters_;
+			return ok;
+		}
+
+		// signal wakes blocked threads after a sequence has moved.
+		void signal() {
+			if (waiters_.load(std::memory_order_seq_cst) > 0) {
+				std::lock_guard<std::mutex> lck(mtx_);
+				cv_.notify_all();
+			}
+		}
+
+		template<class>
+		friend class BatchConsumer;
+};
+
+// BatchConsumer is a long-lived Runnable that hands each event of a
+// BroadcastRing to handler, in order. It runs for the life of the ring, so
+// post it with ThreadPool::PostBlocking, or run it on a Thread. A consumer
+// that fell behind catches up with all available events in one batch;
+// endOfBatch tells the handler when the batch ends, e.g. to flush. The
+// cursor of the consumer only moves after the batch, so that producers and
+// dependent consumers are told once per batch.
+//
+// The consumer starts with the events published after its construction and
+// gates the producers as long as it exists. Run() returns once the ring is
+// closed and every event has been handled.
+template<class T>
+class BatchConsumer : public Runnable {
+	public:
+		using Handler = std::function<void(T &event, int64_t seq, bool endOfBatch)>;
+
+		// deps are the cursors of the consumers that must see an event
+		// first; by default the consumer reads published events.
+		BatchConsumer(BroadcastRing<T> &ring, Handler handler, std::vector<const Sequence*> deps = {}) :
+			ring_(ring),
+			handler_(handler),
+			barrier_(ring, deps),
+			cursor_(ring.Cursor()) {
+			ring_.AddGating(&cursor_);
+		}
+		BatchConsumer(const BatchConsumer&) = delete;
+		BatchConsumer& operator=(const BatchConsumer&) = delete;
+		~BatchConsumer() {
+			ring_.RemoveGating(&cursor_);
+		}
+
+		// Cursor is the sequence of the last event handled, for consumers
+		// that depend on this one.
+		const Sequence* Cursor() const {
+			return &cursor_;
+		}
+
+		virtual void Run() override {
+			int64_t next = cursor_.Get() + 1;
+			while (true) {
+				int64_t avail = barrier_.WaitFor(next);
+				if (avail < next) {
+					break; // closed
+				}
+				for (int64_t s = next; s <= avail; ++s) {
+					handler_(ring_.At(s), s, s == avail);
+				}
+				cursor_.Set(avail);
+				ring_.signal();
+				next = avail + 1;
+			}
+		}
+
+	private:
+		BroadcastRing<T> &ring_;
+		Handler handler_;
+		typename BroadcastRing<T>::Barrier barrier_;
+		Sequence cursor_;
+};
+
+#endif // __BROADCASTRING_H_
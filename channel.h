@@ -13,20 +13,67 @@
 #include <mutex>
 #include <condition_variable>
 #include <chrono>
+#include <atomic>
 #include <memory.h>
 #include <iostream>
 #include <typeinfo>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <algorithm>
 
+#include "def.h"
 #include "fifoqueue.h"
+#include "ringqueue.h"
+
+// ChannelTraits lets an item type take part in queue-level removal. The
+// default does nothing; specialize it for items that can be discarded while
+// still in the queue (see Channel::Discard()). Both hooks are called with
+// the channel lock held.
+template<class T>
+struct ChannelTraits {
+	// Bind is called when the item is enqueued; owner identifies the channel.
+	static void Bind(const T &t, const void *owner) {}
+	// Claim is called when the item is dequeued. Returning false means the
+	// item has been discarded already, and it is skipped.
+	static bool Claim(T &t) { return true; }
+	// Key identifies a queued item to containers that can look items up,
+	// e.g. AgingPriQueue; nullptr if the item cannot be looked up.
+	static const void* Key(const T &t) { return nullptr; }
+};
+
+// NeedsFeedback tells whether Container schedules items by the work they
+// cause, in which case it provides complete(item, cost) and the consumer
+// must report the cost of every item through Channel::Complete().
+template<class Container>
+struct NeedsFeedback : std::false_type {};
+
+// HasErase tells whether Container can remove a queued item by its key, in
+// which case it provides erase(key), returning false if no queued item has
+// the key.
+template<class Container, class = void>
+struct HasErase : std::false_type {};
+template<class Container>
+struct HasErase<Container, decltype(void(std::declval<Container&>().erase(static_cast<const void*>(nullptr))))> : 
+	std::true_type {};
 
 // Thread-safe queue. The queue 'policy' is determined by the template
-// parameter Container, which is FifoQueue by default.
+// parameter Container, which is RingQueue by default. Container is
+// constructed with the limit of the channel.
 // The owner of a Channel object must make sure there is no outstanding
 // calls to Get() or Put() upon destruction; else it may lead to SEGFAULT.
-template<class T, class Container = FifoQueue<T>>
+template<class T, class Container = RingQueue<T>>
 class Channel {
 	public:
-		explicit Channel(uint32_t sz) : closed_(false), size_(0), limit_(sz) {}
+		static const bool kFeedback = NeedsFeedback<Container>::value;
+
+		explicit Channel(uint32_t sz) : 
+			searching_(0),
+			producers_(0),
+			closed_(false),
+			limit_(sz),
+			items_(sz),
+			size_(0) {}
 		// Disallow copy or assignment
 		Channel(const Channel&) = delete;
 		Channel(Channel&&) = delete;
@@ -40,10 +87,20 @@ class Channel {
 
 		// Cancel all pending Get or Put.
 		void Close() {
+			std::unique_lock<std::mutex> lck(mtx_);
 			closed_ = true;
-			consume_.notify_all();
+			while (!idle_.empty()) {
+				wake();
+			}
 			produce_.notify_all();
 		}
+
+		// Reopen makes a closed channel accept items again. Items left in
+		// the channel are kept.
+		void Reopen() {
+			std::lock_guard<std::mutex> lck(mtx_);
+			closed_ = false;
+		}
 		
 		// Get can be blocking or nonblocking, depending on the parameter  timeout.
 		// If timeout == 0, it returns either one item or fails immediately without blocking.
@@ -52,112 +109,213 @@ class Channel {
 		// Successful calls will have an item returned; failed calls (e.g. time out) will
 		// have a default-constructed T returned. 
 		T Get(int64_t timeout) {
-#ifdef VERBOSE
-			//std::cout << "FIFO get" << std::endl;
-#endif
+			T item;
+			Get(item, timeout);
+			return item;
+		}
 
+		// Same as Get(timeout), but reports success explicitly so that callers
+		// do not have to rely on a default-constructed T to detect failures.
+		// item is left untouched if no item could be returned.
+		//
+		// A consumer that has to wait parks on its own slot. Parked consumers
+		// form a LIFO stack, so the consumer that went idle last, whose cache
+		// is the warmest, is woken first. A Put only wakes a consumer if none
+		// is searching already, i.e. woken and not yet back in the queue; a
+		// searching consumer that leaves items behind wakes the next one.
+		bool Get(T &item, int64_t timeout) {
 			std::unique_lock<std::mutex> lck(mtx_);
 			if (hasItem()) {
-				auto item = removeItem();
-				produce_.notify_one();
-				return item;
-			}
-			// return if timed out or closed
-			if (timeout == 0) {
-				produce_.notify_one();
-				return T();
+				take(item);
+				return true;
 			}
-			if (closed_) {
-				return T();
+			if (timeout == 0 || closed_) {
+				return false;
 			}
 
-			if (timeout < 0) {
-				consume_.wait(lck, [=] {
-						return closed_ || hasItem();
-						});
-			} else {
-				if (!consume_.wait_for(lck, 
-						std::chrono::milliseconds(timeout), 
-						[=] {
-						return closed_ || hasItem();
-						})) {
-					// Timed out
-					produce_.notify_one();
-					return T();
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+			Waiter w;
+			while (true) {
+				w.woken = false;
+				idle_.push_back(&w);
+				if (timeout < 0) {
+					w.cv.wait(lck, [&w] { return w.woken; });
+				} else {
+					w.cv.wait_until(lck, deadline, [&w] { return w.woken; });
 				}
+				if (w.woken) {
+					--searching_;
+				} else {
+					// Timed out, still on the stack.
+					idle_.erase(std::find(idle_.begin(), idle_.end(), &w));
+				}
+				// A closed channel is still drained.
+				if (hasItem()) {
+					take(item);
+					return true;
+				}
+				if (closed_ || !w.woken) {
+					return false;
+				}
+				// Another consumer got there first.
 			}
-
-			// must not touch the queue if woken up by cancel().	
-			if (closed_) {
-				return T();
-			}
-
-			auto item = removeItem();
-			produce_.notify_one();
-			
-			return item;
 		}
 
 		// Put can be blocking or nonblocking, depending on timeout.
 		// If timeout == 0, it either puts the item in the queue if there's space and fails immediately.
 		// If timeout < 0, it blocks indefinitely unitl the item is enqueued.
 		// If timeout > 0, it blocks until the item is enqueued or times out after timeout milliseconds.
-		// It returns true if the item is enqueued, false otherwise. 
+		// It returns true if the item is enqueued, false otherwise; a closed
+		// channel accepts no item.
 		bool Put(const T &t, int64_t timeout) {
-#ifdef VERBOSE
-			//std::cout << "FIFO put" << std::endl;
-#endif
-
 			std::unique_lock<std::mutex> lck(mtx_);
+			if (closed_) {
+				return false;
+			}
 			if (hasSpace()) {
 				addItem(t);
-				consume_.notify_one();
+				wakeConsumer();
 				return true;
 			}
-			// return if timed out or closed
 			if (timeout == 0) {
-				consume_.notify_one();
-				return false;
-			}
-			if (closed_) {
 				return false;
 			}
 
+			++producers_;
 			if (timeout < 0) {
 				produce_.wait(lck, [=]{
 						return closed_ || hasSpace();
 						});
 			} else {
-				if (!produce_.wait_for(lck, 
+				produce_.wait_for(lck, 
 						std::chrono::milliseconds(timeout), 
 						[=]{
 						return closed_ || hasSpace();
-						})) {
-					// Timed out
-					consume_.notify_one();
-					return false;
-				}
+						});
 			}
-			// must not touch the queue if woken up by cancel().	
-			if (closed_) {
+			--producers_;
+			// must not touch the queue if woken up by Close().	
+			if (closed_ || !hasSpace()) {
 				return false;
 			}
 			
 			addItem(t);
-			consume_.notify_one();
+			wakeConsumer();
+			return true;
+		}
 
+		// Discard removes an item that is still in the queue but has been
+		// invalidated by claim(), freeing its slot immediately. claim() is
+		// called with the lock held and must make ChannelTraits<T>::Claim()
+		// fail for the item. owner is the value passed to
+		// ChannelTraits<T>::Bind(), and key the value returned by
+		// ChannelTraits<T>::Key() for the item. If Container cannot erase the
+		// item by key, it is left in the queue and dropped when it reaches
+		// the head. It returns false if the item is not in this channel, else
+		// the result of claim().
+		template<class F>
+		bool Discard(const void *owner, const void *key, F claim) {
+			if (owner != this) {
+				return false;
+			}
+			std::unique_lock<std::mutex> lck(mtx_);
+			if (!claim()) {
+				return false;
+			}
+			if (key != nullptr) {
+				erase(key, HasErase<Container>());
+			}
+			--size_;
+			wakeProducer();
 			return true;
 		}
+
+		// Complete reports the cost of an item taken from the queue back to the
+		// container. It is a no-op unless the container needs feedback.
+		void Complete(const T &item, int64_t cost) {
+			complete(item, cost, NeedsFeedback<Container>());
+		}
+
+		// Visit calls f(container) with the lock held, e.g. to configure it.
+		template<class F>
+		void Visit(F f) {
+			std::unique_lock<std::mutex> lck(mtx_);
+			f(items_);
+		}
+
+		// Size returns the number of items in the queue. It does not take the
+		// lock, so the value is only a hint by the time the caller sees it.
+		uint32_t Size() const {
+			return size_.load(std::memory_order_relaxed);
+		}
 	private:
+		// Waiter is the parking slot of a consumer blocked in Get().
+		struct Waiter {
+			std::condition_variable cv;
+			bool woken;
+		};
+
+		// Fields below are only touched with the lock held.
 		std::mutex mtx_;
-		std::condition_variable consume_;
+		std::vector<Waiter*> idle_; // parked consumers, the last parked on top
+		uint32_t searching_;        // consumers woken but not back yet
 		std::condition_variable produce_;
+		uint32_t producers_;        // blocked producers
 		bool closed_;
-
-		uint32_t size_;
 		const uint32_t limit_;
 		Container items_; 
 
+		// size_ is polled without the lock through Size(); keep it off the
+		// cache lines of the lock and the container, so that pollers do not
+		// steal them from the lock holder.
+		char pad0_[CACHELINE_SIZE];
+		std::atomic<uint32_t> size_;
+		char pad1_[CACHELINE_SIZE];
+
+		bool erase(const void *key, std::false_type) {
+			return false;
+		}
+		bool erase(const void *key, std::true_type) {
+			return items_.erase(key);
+		}
+
+		void complete(const T &item, int64_t cost, std::false_type) {}
+		void complete(const T &item, int64_t cost, std::true_type) {
+			std::unique_lock<std::mutex> lck(mtx_);
+			items_.complete(item, cost);
+		}
+
+		// take removes an item and passes the wake-up on. The caller holds
+		// the lock.
+		inline void take(T &item) {
+			item = removeItem();
+			wakeProducer();
+			if (hasItem()) {
+				wakeConsumer();
+			}
+		}
+
+		// wake unparks the consumer on top of the stack.
+		inline void wake() {
+			auto w = idle_.back();
+			idle_.pop_back();
+			w->woken = true;
+			++searching_;
+			w->cv.notify_one(); // under the lock: w lives on the waiter's stack
+		}
+
+		inline void wakeConsumer() {
+			if (searching_ == 0 && !idle_.empty()) {
+				wake();
+			}
+		}
+
+		inline void wakeProducer() {
+			if (producers_ > 0) {
+				produce_.notify_one();
+			}
+		}
+
 		inline bool hasSpace() {
 			//std::cout << "check space @ " << size_ << std::endl;
 			return size_ < limit_;
@@ -168,13 +326,19 @@ class Channel {
 		}
 		inline void addItem(const T &t) {
 			//std::cout << "push item @ " << size_ << std::endl;
+			ChannelTraits<T>::Bind(t, this);
 			items_.push(t);
 			++size_;
 		}
 		inline T removeItem() {
 			//auto item = items_.front();
 			//items_.pop();
+			// size_ only counts live items, so this always terminates even if
+			// discarded items could not be erased.
 			auto item = items_.pop();
+			while (!ChannelTraits<T>::Claim(item)) {
+				item = items_.pop();
+			}
 			//std::cout << "remove item @ " << size_ << std::endl;
 			--size_;
 			return item;
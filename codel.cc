@@ -0,0 +1,146 @@
+#include "codel.h"
+
+#include <mutex>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+using namespace std::chrono;
+
+class CoDel::Impl {
+	public:
+		Impl(int64_t target, int64_t interval, Mode mode);
+		bool OnDequeue(microseconds sojourn, uint32_t remaining);
+		bool Admit();
+		uint64_t Dropped();
+		bool Dropping();
+
+	private:
+		using Clock = steady_clock;
+
+		const microseconds target_;
+		const microseconds interval_;
+		const Mode mode_;
+
+		mutex mtx_;
+		Clock::time_point firstAbove_; // when sojourn went above target, plus interval
+		Clock::time_point dropNext_;   // next drop time while dropping
+		uint32_t count_;               // drops since entering the dropping state
+		uint32_t lastCount_;
+		bool dropping_;
+		bool okToDrop_;                // sojourn above target for a whole interval
+		uint64_t dropped_;
+
+		bool drop(Clock::time_point now);
+		inline Clock::time_point controlLaw(Clock::time_point t) {
+			return t + duration_cast<microseconds>(interval_ / sqrt(static_cast<double>(count_)));
+		}
+};
+
+CoDel::Impl::Impl(int64_t target, int64_t interval, Mode mode) :
+	target_(milliseconds(target)),
+	interval_(milliseconds(interval)),
+	mode_(mode),
+	count_(0),
+	lastCount_(0),
+	dropping_(false),
+	okToDrop_(false),
+	dropped_(0) {
+}
+
+bool CoDel::Impl::OnDequeue(microseconds sojourn, uint32_t remaining) {
+	auto now = Clock::now();
+	lock_guard<mutex> lck(mtx_);
+	if (sojourn < target_ || remaining == 0) {
+		// Went below target, or the queue drained: the standing queue is gone.
+		firstAbove_ = Clock::time_point();
+		okToDrop_ = false;
+	} else if (firstAbove_ == Clock::time_point()) {
+		firstAbove_ = now + interval_;
+		okToDrop_ = false;
+	} else if (now >= firstAbove_) {
+		okToDrop_ = true;
+	}
+	if (mode_ == Mode::POST) {
+		if (!okToDrop_) {
+			dropping_ = false;
+		}
+		return false;
+	}
+	return drop(now);
+}
+
+bool CoDel::Impl::Admit() {
+	if (mode_ != Mode::POST) {
+		return true;
+	}
+	auto now = Clock::now();
+	lock_guard<mutex> lck(mtx_);
+	return !drop(now);
+}
+
+// drop applies the control law; the caller holds mtx_.
+bool CoDel::Impl::drop(Clock::time_point now) {
+	if (dropping_) {
+		if (!okToDrop_) {
+			dropping_ = false;
+			return false;
+		}
+		if (now < dropNext_) {
+			return false;
+		}
+		++count_;
+		++dropped_;
+		dropNext_ = controlLaw(dropNext_);
+		return true;
+	}
+	if (!okToDrop_) {
+		return false;
+	}
+	// Enter the dropping state. If we were dropping recently, resume close
+	// to the previous rate rather than starting all over.
+	dropping_ = true;
+	uint32_t delta = count_ - lastCount_;
+	if (delta > 1 && now - dropNext_ < interval_ * 16) {
+		count_ = delta;
+	} else {
+		count_ = 1;
+	}
+	lastCount_ = count_;
+	dropNext_ = controlLaw(now);
+	++dropped_;
+	return true;
+}
+
+uint64_t CoDel::Impl::Dropped() {
+	lock_guard<mutex> lck(mtx_);
+	return dropped_;
+}
+
+bool CoDel::Impl::Dropping() {
+	lock_guard<mutex> lck(mtx_);
+	return dropping_;
+}
+
+
+CoDel::CoDel(int64_t target, int64_t interval, Mode mode) {
+	impl_ = std::make_unique<Impl>(target, interval, mode);
+}
+
+CoDel::~CoDel() {}
+
+bool CoDel::OnDequeue(microseconds sojourn, uint32_t remaining) {
+	return impl_->OnDequeue(sojourn, remaining);
+}
+
+bool CoDel::Admit() {
+	return impl_->Admit();
+}
+
+uint64_t CoDel::Dropped() {
+	return impl_->Dropped();
+}
+
+bool CoDel::Dropping() {
+	return impl_->Dropping();
+}
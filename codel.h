@@ -0,0 +1,39 @@
+#ifndef __CODEL_H_
+#define __CODEL_H_
+
+#include "queuemanager.h"
+
+#include <memory>
+
+// CoDel implements the Controlled Delay algorithm (RFC 8289) according to the
+// QueueManager interface. Once the minimum sojourn time has stayed above
+// target for a whole interval, tasks are shed at a rate that increases with
+// the square root of the number of drops, until the sojourn time falls below
+// target again.
+class CoDel : public QueueManager {
+	public:
+		// Where load is shed: HEAD drops tasks as they are dequeued, POST
+		// rejects new tasks instead, leaving queued tasks untouched.
+		enum class Mode {HEAD, POST};
+
+		// target and interval are in milliseconds.
+		CoDel(int64_t target = 5, int64_t interval = 100, Mode mode = Mode::HEAD);
+		CoDel(const CoDel&) = delete;
+		CoDel(CoDel&&) = delete;
+		CoDel& operator=(const CoDel&) = delete;
+		CoDel& operator=(CoDel&&) = delete;
+		~CoDel();
+
+		virtual bool OnDequeue(std::chrono::microseconds sojourn, uint32_t remaining) override;
+		virtual bool Admit() override;
+		virtual uint64_t Dropped() override;
+
+		// Dropping returns true while CoDel is shedding load.
+		bool Dropping();
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl> impl_;
+};
+
+#endif // __CODEL_H_
@@ -0,0 +1,28 @@
+#ifndef __CONCURRENCYLIMITER_H_
+#define __CONCURRENCYLIMITER_H_
+
+#include <stdint.h>
+#include <chrono>
+
+// ConcurrencyLimiter caps how many tasks of a thread pool run at once,
+// independently of the number of workers. Adaptive limiters move the cap
+// with the latency of the tasks. Implementations must be thread-safe.
+class ConcurrencyLimiter {
+	public:
+		virtual ~ConcurrencyLimiter() {}
+		// Acquire takes a slot for a task about to run, waiting while all
+		// slots are taken. timeout has the same meaning as for
+		// Channel::Get(). It returns false if no slot could be taken.
+		virtual bool Acquire(int64_t timeout) = 0;
+		// Release returns the slot of a task that ran for latency.
+		virtual void Release(std::chrono::microseconds latency) = 0;
+		// Cancel returns a slot that was not used, e.g. because no task
+		// came, without a latency sample.
+		virtual void Cancel() = 0;
+		// Limit returns the current number of slots.
+		virtual uint32_t Limit() = 0;
+		// InFlight returns the number of slots taken.
+		virtual uint32_t InFlight() = 0;
+};
+
+#endif // __CONCURRENCYLIMITER_H_
@@ -0,0 +1,528 @@
+// 
+// Implementation of CoreExecutor.
+//
+
+#include "coreexecutor.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "runnable.h"
+#include "channel.h"
+#include "spscring.h"
+#include "semaphore.h"
+#include "taskhandle.h"
+#include "threadpool_impl.h"
+
+using namespace std;
+
+// The core loop the calling thread runs, if any.
+static thread_local const void *currentExecutor = nullptr;
+static thread_local int currentCore = -1;
+
+// CoreTask is the item of the queues of the cores. Unlike the Task of the
+// pools it has no priority, whose constructor takes a process-wide lock, and
+// only reads the clock if it expires.
+class CoreTask {
+	public:
+		CoreTask() {}
+		CoreTask(const shared_ptr<Runnable> &t, int64_t expiration, 
+				const shared_ptr<TaskHandle> &h = nullptr) :
+			task_(t),
+			handle_(h) {
+			if (expiration > 0) {
+				deadline_ = chrono::steady_clock::now() + chrono::milliseconds(expiration);
+			}
+		}
+
+		void Run() {
+			task_->Run();
+		}
+
+		bool IsExpired() const {
+			return deadline_.time_since_epoch().count() != 0 && 
+				chrono::steady_clock::now() >= deadline_;
+		}
+
+		// Finish moves the handle, if any, from RUNNING to its final state.
+		void Finish(TaskHandle::Status s) {
+			if (handle_ != nullptr) {
+				handle_->Transit(TaskHandle::Status::RUNNING, s);
+			}
+		}
+
+	private:
+		shared_ptr<Runnable> task_;
+		chrono::steady_clock::time_point deadline_; // epoch if it never expires
+		shared_ptr<TaskHandle> handle_;
+		friend ChannelTraits<CoreTask>;
+};
+
+template<>
+struct ChannelTraits<CoreTask> {
+	static void Bind(const CoreTask &t, const void *owner) {
+		if (t.handle_ != nullptr) {
+			t.handle_->SetOwner(owner);
+		}
+	}
+	static bool Claim(CoreTask &t) {
+		return t.handle_ == nullptr || 
+			t.handle_->Transit(TaskHandle::Status::PENDING, TaskHandle::Status::RUNNING);
+	}
+	static const void* Key(const CoreTask &t) {
+		return t.handle_.get();
+	}
+};
+
+class CoreExecutor::Impl {
+	public:
+		Impl(shared_ptr<ThreadFactory> factory, uint32_t cores, uint32_t maxTasks, bool pin);
+		~Impl();
+		void Start();
+		void Stop(bool now);
+		bool Post(uint32_t core, const CoreTask &t, int64_t timeout);
+		bool PostAny(const CoreTask &t, int64_t timeout);
+		shared_ptr<TaskHandle> Submit(const shared_ptr<Runnable> &task, int64_t timeout, 
+				int64_t expiration, int priority, uint64_t group);
+		size_t CancelGroup(uint64_t group);
+		uint32_t Cores() const;
+		bool Accepting() const;
+
+	private:
+		// Core is the state and the loop of one core. Only the thread of the
+		// core touches local and pops from the mailboxes.
+		class Core : public Runnable {
+			public:
+				Core(Impl *ex, uint32_t id, uint32_t cores, uint32_t maxTasks);
+				virtual void Run() override;
+				void Wake();
+
+				Impl *ex_;
+				const uint32_t id_;
+				deque<CoreTask> local_;                       // posted by the core itself
+				vector<unique_ptr<SpscRing<CoreTask>>> in_;   // in_[src]: mailbox from core src
+				Channel<CoreTask> inbox_;                     // posted from outside
+				Semaphore done_;
+
+				// The tasks in flight are counted on the cache lines of the
+				// cores, see inflight(). The core alone writes the first two.
+				alignas(CACHELINE_SIZE) atomic<uint64_t> posted_;   // by the core
+				atomic<uint64_t> finished_;                         // on the core
+				alignas(CACHELINE_SIZE) atomic<uint64_t> received_; // from outside, for the core
+				atomic<uint64_t> returned_; // rejected, discarded or cancelled by others
+
+				void cancelPending();
+
+			private:
+				alignas(CACHELINE_SIZE) atomic<bool> sleeping_;
+				mutex mtx_;
+				condition_variable cv_;
+				bool wake_;
+
+				size_t drain();
+				void execute(CoreTask &t);
+				bool hasWork();
+				void park();
+				void pin();
+		};
+
+		enum class Status {STOPPED, RUNNING, STOPPING};
+
+		shared_ptr<ThreadFactory> factory_;
+		const bool pin_;
+		vector<unique_ptr<Core>> cores_;
+		vector<unique_ptr<Thread>> threads_;
+		shared_ptr<TaskRegistry> registry_;
+		alignas(CACHELINE_SIZE) atomic<Status> status_;
+		atomic<bool> stopNow_;
+		alignas(CACHELINE_SIZE) atomic<uint64_t> next_;    // round-robin cursor
+
+		// inflight returns the number of tasks posted and not finished. It is
+		// only needed while stopping, so the hot path never touches a shared
+		// counter. The finishes are read before the posts: as a task is
+		// counted as posted before it is run, the sum is never below the true
+		// count, and 0 means nothing was in flight once the finishes had been
+		// read.
+		int64_t inflight() {
+			int64_t n = 0;
+			for (auto &c : cores_) {
+				n -= c->finished_ + c->returned_;
+			}
+			for (auto &c : cores_) {
+				n += c->posted_ + c->received_;
+			}
+			return n;
+		}
+		bool finished() {
+			return status_ == Status::STOPPING && inflight() == 0;
+		}
+		// posted counts a task posted by the calling thread to core.
+		void posted(uint32_t core) {
+			if (currentExecutor == this) {
+				++cores_[currentCore]->posted_;
+			} else {
+				++cores_[core]->received_;
+			}
+		}
+		// done counts a task of core as finished, or not accepted after all.
+		void done(uint32_t core) {
+			if (currentExecutor == this) {
+				++cores_[currentCore]->finished_;
+			} else {
+				++cores_[core]->returned_;
+			}
+			if (status_ == Status::STOPPING && inflight() == 0) {
+				for (auto &c : cores_) {
+					c->Wake();
+				}
+			}
+		}
+};
+
+const uint32_t kBatch = 64;   // tasks taken from one source in a row
+const uint32_t kSpin = 100;   // empty polls before a core goes to sleep
+
+CoreExecutor::Impl::Core::Core(Impl *ex, uint32_t id, uint32_t cores, uint32_t maxTasks) :
+	ex_(ex),
+	id_(id),
+	in_(cores),
+	inbox_(maxTasks),
+	done_(0),
+	posted_(0),
+	finished_(0),
+	received_(0),
+	returned_(0),
+	sleeping_(false),
+	wake_(false) {
+	for (uint32_t i = 0; i < cores; ++i) {
+		if (i != id) {
+			in_[i] = make_unique<SpscRing<CoreTask>>(maxTasks);
+		}
+	}
+}
+
+void CoreExecutor::Impl::Core::Run() {
+	currentExecutor = ex_;
+	currentCore = id_;
+	if (ex_->pin_) {
+		pin();
+	}
+	uint32_t idle = 0;
+	while (!ex_->stopNow_) {
+		if (drain() > 0) {
+			idle = 0;
+			continue;
+		}
+		if (ex_->finished()) {
+			break;
+		}
+		if (++idle < kSpin) {
+			this_thread::yield();
+			continue;
+		}
+		park();
+		idle = 0;
+	}
+	currentExecutor = nullptr;
+	currentCore = -1;
+	done_.Notify();
+}
+
+void CoreExecutor::Impl::Core::pin() {
+	uint32_t cpus = thread::hardware_concurrency();
+	if (cpus == 0) {
+		return;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(id_ % cpus, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// drain runs a batch of tasks from every source and returns how many.
+size_t CoreExecutor::Impl::Core::drain() {
+	size_t n = 0;
+	CoreTask t;
+	for (uint32_t i = 0; i < kBatch && !ex_->stopNow_ && inbox_.Size() > 0 && inbox_.Get(t, 0); ++i, ++n) {
+		execute(t); // claimed by the channel already
+	}
+	for (auto &ring : in_) {
+		for (uint32_t i = 0; ring != nullptr && i < kBatch && !ex_->stopNow_ && ring->pop(t); ++i, ++n) {
+			if (ChannelTraits<CoreTask>::Claim(t)) {
+				execute(t);
+			} else {
+				ex_->done(id_); // cancelled
+			}
+		}
+	}
+	for (uint32_t i = 0; i < kBatch && !ex_->stopNow_ && !local_.empty(); ++i, ++n) {
+		t = local_.front();
+		local_.pop_front();
+		if (ChannelTraits<CoreTask>::Claim(t)) {
+			execute(t);
+		} else {
+			ex_->done(id_);
+		}
+	}
+	return n;
+}
+
+void CoreExecutor::Impl::Core::execute(CoreTask &t) {
+	if (t.IsExpired()) {
+		t.Finish(TaskHandle::Status::EXPIRED);
+	} else {
+		t.Run();
+		t.Finish(TaskHandle::Status::DONE);
+	}
+	ex_->done(id_);
+}
+
+// cancelPending drops the tasks StopNow() left in the queues of the core, so
+// that no handle is left waiting. The thread of the core has exited.
+void CoreExecutor::Impl::Core::cancelPending() {
+	CoreTask t;
+	while (inbox_.Get(t, 0)) {
+		t.Finish(TaskHandle::Status::CANCELLED); // claimed by the channel
+		ex_->done(id_);
+	}
+	auto cancel = [this](CoreTask &t) {
+		if (ChannelTraits<CoreTask>::Claim(t)) {
+			t.Finish(TaskHandle::Status::CANCELLED);
+		}
+		ex_->done(id_);
+	};
+	for (auto &ring : in_) {
+		while (ring != nullptr && ring->pop(t)) {
+			cancel(t);
+		}
+	}
+	while (!local_.empty()) {
+		t = local_.front();
+		local_.pop_front();
+		cancel(t);
+	}
+}
+
+bool CoreExecutor::Impl::Core::hasWork() {
+	if (!local_.empty() || inbox_.Size() > 0) {
+		return true;
+	}
+	for (auto &ring : in_) {
+		if (ring != nullptr && !ring->empty()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// park puts the core to sleep until Wake() is called. Producers check
+// sleeping_ after publishing their task, and the core checks for tasks
+// after setting sleeping_, so one of them always sees the other.
+void CoreExecutor::Impl::Core::park() {
+	unique_lock<mutex> lck(mtx_);
+	sleeping_.store(true);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!hasWork() && !ex_->finished() && !ex_->stopNow_) {
+		cv_.wait(lck, [this] { return wake_; });
+	}
+	wake_ = false;
+	sleeping_.store(false);
+}
+
+void CoreExecutor::Impl::Core::Wake() {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (sleeping_.load()) {
+		lock_guard<mutex> lck(mtx_);
+		wake_ = true;
+		cv_.notify_one();
+	}
+}
+
+
+CoreExecutor::Impl::Impl(shared_ptr<ThreadFactory> factory, uint32_t cores, uint32_t maxTasks, bool pin) :
+	factory_(factory),
+	pin_(pin),
+	status_(Status::STOPPED),
+	stopNow_(false),
+	next_(0) {
+	if (cores == 0) {
+		cores = 1;
+	}
+	if (cores > MAX_THREADS) {
+		throw kWrongCntEcp;
+	}
+	for (uint32_t i = 0; i < cores; ++i) {
+		cores_.push_back(make_unique<Core>(this, i, cores, maxTasks));
+	}
+	// Only tasks in an inbox need the channel to forget them; tasks in the
+	// mailboxes are skipped when popped.
+	registry_ = make_shared<TaskRegistry>(
+		[this](TaskHandle *h, const function<bool()> &claim) {
+			for (auto &c : cores_) {
+				if (&c->inbox_ == h->Owner()) {
+					bool ok = c->inbox_.Discard(h->Owner(), h, claim);
+					if (ok) {
+						done(c->id_);
+					}
+					return ok;
+				}
+			}
+			return claim();
+		});
+}
+
+CoreExecutor::Impl::~Impl() {
+	Stop(false);
+	registry_->Detach();
+}
+
+void CoreExecutor::Impl::Start() {
+	if (status_ != Status::STOPPED) {
+		return;
+	}
+	stopNow_ = false;
+	status_ = Status::RUNNING;
+	threads_.clear();
+	for (auto &c : cores_) {
+		threads_.push_back(factory_->NewThread());
+		// The executor owns the cores; hand out a non-owning pointer.
+		threads_.back()->Run(shared_ptr<Runnable>(shared_ptr<Runnable>(), c.get()));
+	}
+}
+
+void CoreExecutor::Impl::Stop(bool now) {
+	Status s = Status::RUNNING;
+	if (!status_.compare_exchange_strong(s, Status::STOPPING)) {
+		return;
+	}
+	if (now) {
+		stopNow_ = true;
+	}
+	for (auto &c : cores_) {
+		c->Wake();
+	}
+	for (auto &c : cores_) {
+		c->done_.Wait();
+	}
+	threads_.clear(); // join
+	if (now) {
+		for (auto &c : cores_) {
+			c->cancelPending();
+		}
+	}
+	status_ = Status::STOPPED;
+}
+
+// While stopping, the cores may still post the follow-up work of the tasks
+// they drain.
+bool CoreExecutor::Impl::Accepting() const {
+	auto s = status_.load();
+	return s == Status::RUNNING || 
+		(s == Status::STOPPING && currentExecutor == this && !stopNow_);
+}
+
+uint32_t CoreExecutor::Impl::Cores() const {
+	return cores_.size();
+}
+
+// Post counts the task in flight before it checks that the executor accepts
+// it: either Stop() sees the task in flight and the cores wait for it, or the
+// task sees the executor stopping and is rejected.
+bool CoreExecutor::Impl::Post(uint32_t core, const CoreTask &t, int64_t timeout) {
+	auto &target = cores_[core];
+	posted(core);
+	if (!Accepting()) {
+		done(core);
+		return false;
+	}
+	bool ok;
+	if (currentExecutor != this) {
+		ok = target->inbox_.Put(t, timeout);
+	} else if (currentCore == (int)core) {
+		target->local_.push_back(t);
+		return true; // we are awake
+	} else {
+		// Never block a core on another one; the inbox is the overflow.
+		ok = target->in_[currentCore]->push(t) || target->inbox_.Put(t, 0);
+	}
+	if (!ok) {
+		done(core);
+		return false;
+	}
+	target->Wake();
+	return true;
+}
+
+// PostAny keeps work on the calling core, or spreads work coming from
+// outside round-robin.
+bool CoreExecutor::Impl::PostAny(const CoreTask &t, int64_t timeout) {
+	if (currentExecutor == this) {
+		return Post(currentCore, t, timeout);
+	}
+	return Post(next_++ % cores_.size(), t, timeout);
+}
+
+shared_ptr<TaskHandle> CoreExecutor::Impl::Submit(const shared_ptr<Runnable> &task, int64_t timeout, 
+		int64_t expiration, int priority, uint64_t group) {
+	auto h = make_shared<TaskHandle>(registry_, group);
+	if (!PostAny(CoreTask(task, expiration, h), timeout)) {
+		return nullptr;
+	}
+	registry_->Add(h);
+	return h;
+}
+
+size_t CoreExecutor::Impl::CancelGroup(uint64_t group) {
+	return registry_->CancelGroup(group);
+}
+
+
+CoreExecutor::CoreExecutor(shared_ptr<ThreadFactory> factory, uint32_t cores, uint32_t maxTasks, bool pin) {
+	impl_ = make_unique<Impl>(factory, cores, maxTasks, pin);
+}
+
+CoreExecutor::~CoreExecutor() {}
+
+void CoreExecutor::Start() {
+	impl_->Start();
+}
+
+void CoreExecutor::Stop() {
+	impl_->Stop(false);
+}
+
+void CoreExecutor::StopNow() {
+	impl_->Stop(true);
+}
+
+bool CoreExecutor::Post(const shared_ptr<Runnable> &task, int64_t timeout, int64_t expiration, int priority) {
+	return impl_->PostAny(CoreTask(task, expiration), timeout);
+}
+
+shared_ptr<TaskHandle> CoreExecutor::Submit(const shared_ptr<Runnable> &task, int64_t timeout, 
+		int64_t expiration, int priority, uint64_t group) {
+	return impl_->Submit(task, timeout, expiration, priority, group);
+}
+
+size_t CoreExecutor::CancelGroup(uint64_t group) {
+	return impl_->CancelGroup(group);
+}
+
+bool CoreExecutor::PostTo(uint64_t key, const shared_ptr<Runnable> &task, int64_t timeout, int64_t expiration) {
+	return impl_->Post(key % impl_->Cores(), CoreTask(task, expiration), timeout);
+}
+
+uint32_t CoreExecutor::Cores() const {
+	return impl_->Cores();
+}
+
+int CoreExecutor::CurrentCore() {
+	return currentCore;
+}
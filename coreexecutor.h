@@ -0,0 +1,94 @@
+//
+// coreexecutor.h
+//
+// Define CoreExecutor, a thread-per-core, shared-nothing ThreadPool.
+//
+
+#ifndef __COREEXECUTOR_H_
+#define __COREEXECUTOR_H_
+
+#include <memory>
+#include <vector>
+
+#include "def.h"
+#include "thread.h"
+#include "threadpool.h"
+
+// CoreExecutor runs one single-threaded loop per core, optionally pinned to
+// its CPU, each with a private queue. There is no shared task queue: a core
+// posting to another core goes through a single-producer single-consumer
+// mailbox dedicated to that pair of cores, and only threads outside the
+// executor use a locked inbox. Tasks are spread round-robin by Post(), or
+// routed by key with PostTo() so that related work stays on one core.
+class CoreExecutor : public ThreadPool {
+	public:
+		// maxTasks bounds the inbox and each mailbox of every core. As every
+		// pair of cores has its own mailbox, the executor preallocates
+		// cores * cores * maxTasks task slots: keep maxTasks small on
+		// machines with many cores.
+		CoreExecutor(std::shared_ptr<ThreadFactory> factory, uint32_t cores, uint32_t maxTasks, bool pin = true);
+		CoreExecutor(const CoreExecutor&) = delete;
+		CoreExecutor(CoreExecutor&&) = delete;
+		CoreExecutor& operator=(const CoreExecutor&) = delete;
+		CoreExecutor& operator=(CoreExecutor&&) = delete;
+		virtual ~CoreExecutor();
+
+		virtual void Start() override;
+		virtual void Stop() override;
+		virtual void StopNow() override;
+		// timeout only applies when posting from outside the executor; a full
+		// mailbox between cores falls back to the inbox of the target core.
+		// priority is ignored: each core runs its tasks in arrival order.
+		virtual bool Post(const std::shared_ptr<Runnable> &task, 
+				int64_t timeout=-1, int64_t expiration=0, int priority=0) override;
+		virtual std::shared_ptr<TaskHandle> Submit(const std::shared_ptr<Runnable> &task, 
+				int64_t timeout=-1, int64_t expiration=0, int priority=0, uint64_t group=0) override;
+		virtual size_t CancelGroup(uint64_t group) override;
+
+		// PostTo runs the task on core key % Cores().
+		bool PostTo(uint64_t key, const std::shared_ptr<Runnable> &task, 
+				int64_t timeout=-1, int64_t expiration=0);
+
+		uint32_t Cores() const;
+
+		// CurrentCore returns the index of the core the calling thread runs
+		// on, or -1 if it is not a core loop.
+		static int CurrentCore();
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl> impl_;
+};
+
+// CoreLocal holds one T per core. Get() must be called from a core loop and
+// needs no synchronization, as each core only touches its own slot.
+template<class T>
+class CoreLocal {
+	public:
+		explicit CoreLocal(uint32_t cores) : slots_(cores) {}
+
+		T& Get() {
+			return slots_[CoreExecutor::CurrentCore()].value;
+		}
+
+		// At gives access to the slot of any core, e.g. to aggregate them
+		// once the executor is stopped.
+		T& At(uint32_t core) {
+			return slots_[core].value;
+		}
+
+		uint32_t Size() const {
+			return slots_.size();
+		}
+
+	private:
+		// Padding keeps the values of neighbouring cores off each other's
+		// cache lines.
+		struct Slot {
+			T value;
+			char pad[CACHELINE_SIZE];
+		};
+		std::vector<Slot> slots_;
+};
+
+#endif // __COREEXECUTOR_H_
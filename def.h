@@ -1,8 +1,22 @@
 #ifndef __DEF_H_
 #define __DEF_H_
 
+#include <cstdint>
+#include <thread>
+
 #ifndef NUMCORES
 #define NUMCORES 1
 #endif
 
+// NumCores returns the number of cores the machine reports at run time, or
+// NUMCORES if it does not tell.
+inline uint32_t NumCores() {
+	static const uint32_t n = std::thread::hardware_concurrency();
+	return n > 0 ? n : NUMCORES;
+}
+
+#ifndef CACHELINE_SIZE
+#define CACHELINE_SIZE 64
+#endif
+
 #endif
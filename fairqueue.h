@@ -0,0 +1,185 @@
+//
+// Implement a weighted fair queue.
+//
+
+#ifndef __FAIRQUEUE_H_
+#define __FAIRQUEUE_H_
+
+#include <deque>
+#include <unordered_map>
+#include <type_traits>
+#include <algorithm>
+
+#include "channel.h"
+
+// FairQueue keeps one FIFO sub-queue per class and serves the classes by
+// deficit round robin, not thread-safe. The class of an item is given by
+// T::GetPriority(). Unlike classic DRR the cost of an item is only known
+// after it has run: pop() charges the running average cost of the class, and
+// complete() corrects the charge with the measured cost, so that classes get
+// a share of the work done in proportion to their weights.
+// Only classes with queued items are visited; idle classes cost nothing.
+template<class T>
+class FairQueue {
+	public:
+		FairQueue() : size_(0), quantum_(kDefaultQuantum) {}
+		explicit FairQueue(uint32_t sz) : FairQueue() {}
+
+		void push(const T &t) {
+			int c = t.GetPriority();
+			auto &f = flows_[c];
+			f.items.push_back(t);
+			if (!f.active) {
+				f.active = true;
+				active_.push_back(c);
+			}
+			++size_;
+		}
+
+		T pop() {
+			while (true) {
+				int c = active_.front();
+				auto &f = flows_[c];
+				if (f.deficit <= 0) {
+					refill();
+					continue;
+				}
+				auto item = f.items.front();
+				f.items.pop_front();
+				--size_;
+				f.deficit -= f.cost;
+				if (f.items.empty()) {
+					active_.pop_front();
+					deactivate(c);
+				} else if (f.deficit <= 0) {
+					active_.pop_front();
+					active_.push_back(c);
+				}
+				return item;
+			}
+		}
+
+		size_t size() {
+			return size_;
+		}
+
+		// erase removes the queued item with the given key (see
+		// ChannelTraits<T>::Key()) without charging its class, and returns
+		// false if there is none. It takes time linear in the queue length.
+		bool erase(const void *key) {
+			for (auto a = active_.begin(); a != active_.end(); ++a) {
+				int c = *a;
+				auto &items = flows_[c].items;
+				auto it = std::find_if(items.begin(), items.end(), [key](const T &t) {
+					return ChannelTraits<T>::Key(t) == key;
+				});
+				if (it == items.end()) {
+					continue;
+				}
+				items.erase(it);
+				--size_;
+				if (items.empty()) {
+					active_.erase(a);
+					deactivate(c);
+				}
+				return true;
+			}
+			return false;
+		}
+
+		// complete replaces the estimated cost charged by pop() with the
+		// measured cost of the item.
+		void complete(const T &t, int64_t cost) {
+			int c = t.GetPriority();
+			auto it = flows_.find(c);
+			if (it == flows_.end()) {
+				if (cost <= kDefaultCost) {
+					return; // idle class and no debt: nothing to remember
+				}
+				it = flows_.emplace(c, Flow()).first;
+			}
+			auto &f = it->second;
+			f.deficit -= cost - f.cost;
+			// running average with weight 1/8
+			f.cost += (cost - f.cost) / 8;
+			if (f.cost < 1) {
+				f.cost = 1;
+			}
+			if (!f.active && f.deficit >= 0) {
+				flows_.erase(it);
+			}
+		}
+
+		// setWeight sets the share of class c relative to other classes;
+		// classes default to weight 1.
+		void setWeight(int c, uint32_t w) {
+			weights_[c] = std::max<uint32_t>(w, 1);
+		}
+
+		// setQuantum sets the credit, in units of cost, a class of weight 1
+		// receives per round.
+		void setQuantum(int64_t q) {
+			quantum_ = std::max<int64_t>(q, 1);
+		}
+
+	private:
+		static const int64_t kDefaultQuantum = 1000;
+		static const int64_t kDefaultCost = 100;
+
+		struct Flow {
+			Flow() : deficit(0), cost(kDefaultCost), active(false) {}
+			std::deque<T> items;
+			int64_t deficit;
+			int64_t cost; // running average cost of an item
+			bool active;
+		};
+
+		size_t size_;
+		int64_t quantum_;
+		std::unordered_map<int, Flow> flows_;
+		std::unordered_map<int, uint32_t> weights_;
+		std::deque<int> active_; // classes with queued items, in round-robin order
+
+		uint32_t weight(int c) {
+			auto it = weights_.find(c);
+			return it == weights_.end() ? 1 : it->second;
+		}
+
+		// deactivate is called when class c, already out of active_, has no
+		// queued items left. It forgets unused credit, but not debt.
+		void deactivate(int c) {
+			auto &f = flows_[c];
+			f.active = false;
+			f.deficit = std::min<int64_t>(f.deficit, 0);
+			if (f.deficit == 0) {
+				flows_.erase(c);
+			}
+		}
+
+		// refill advances as many rounds at once as it takes for at least
+		// one active class to get positive credit.
+		void refill() {
+			int64_t rounds = -1;
+			for (int c : active_) {
+				auto &f = flows_[c];
+				int64_t q = quantum_ * weight(c);
+				int64_t r = (q - f.deficit) / q;
+				if (rounds < 0 || r < rounds) {
+					rounds = r;
+				}
+			}
+			for (int c : active_) {
+				flows_[c].deficit += rounds * quantum_ * weight(c);
+			}
+			// Keep round-robin order, but start with a class that may run.
+			while (flows_[active_.front()].deficit <= 0) {
+				active_.push_back(active_.front());
+				active_.pop_front();
+			}
+		}
+};
+
+template<class T>
+struct NeedsFeedback<FairQueue<T>> : std::true_type {};
+
+#endif // __FAIRQUEUE_H_
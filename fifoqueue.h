@@ -9,20 +9,26 @@
 #ifndef __FIFOQUEUE_H_
 #define __FIFOQUEUE_H_
 
-#include <queue>
+#include <deque>
+#include <algorithm>
+
+template<class T>
+struct ChannelTraits;
 
 // FIFO queue, not thread-safe.
 template<class T>
 class FifoQueue {
 	public:
+		FifoQueue() = default;
+		explicit FifoQueue(uint32_t sz) {}
 
 		void push(const T &t) {
-			items_.push(t);
+			items_.push_back(t);
 		}
 
 		T pop() {
 			auto item = items_.front();
-			items_.pop();
+			items_.pop_front();
 			return item;
 		}
 
@@ -30,8 +36,20 @@ class FifoQueue {
 			return items_.size();
 		}
 
+		// See RingQueue::erase().
+		bool erase(const void *key) {
+			auto it = std::find_if(items_.begin(), items_.end(), [key](const T &t) {
+				return ChannelTraits<T>::Key(t) == key;
+			});
+			if (it == items_.end()) {
+				return false;
+			}
+			items_.erase(it);
+			return true;
+		}
+
 	private:
-		std::queue<T> items_; 
+		std::deque<T> items_; 
 
 };
 
@@ -0,0 +1,148 @@
+//
+// Define the policies that configure a ThreadPoolImpl at compile time.
+//
+// A worker only pays for the features its policies enable: the checks of a
+// disabled policy are constant false and compile away.
+//
+
+#ifndef __POLICIES_H_
+#define __POLICIES_H_
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+
+// Expiry policies decide whether a dequeued task has expired, i.e. whether
+// the expiration passed to Post is honoured.
+struct CheckExpiry {
+	static const bool kEnabled = true;
+	template<class T>
+	static bool Expired(T &t) {
+		return t.IsExpired();
+	}
+};
+
+struct NoExpiry {
+	static const bool kEnabled = false;
+	template<class T>
+	static bool Expired(T &t) {
+		return false;
+	}
+};
+
+// Rate limit policies tell whether workers take tokens from the RateLimiter
+// of the pool. A pool without rate limiting cannot be given a RateLimiter.
+struct UseRateLimit {
+	static const bool kEnabled = true;
+};
+
+struct NoRateLimit {
+	static const bool kEnabled = false;
+};
+
+// Stats policies are told the outcome of every task a worker takes. kTimed
+// tells whether OnRun needs the run time, which costs two clock reads.
+struct NoStats {
+	static const bool kEnabled = false;
+	static const bool kTimed = false;
+	void OnRun(std::chrono::nanoseconds d) {}
+	void OnExpired() {}
+	void OnDropped() {}
+	void OnCancelled() {}
+};
+
+// CountStats counts tasks by outcome and sums their run time.
+struct CountStats {
+	static const bool kEnabled = true;
+	static const bool kTimed = true;
+	CountStats() : run(0), expired(0), dropped(0), cancelled(0), busyNs(0) {}
+	void OnRun(std::chrono::nanoseconds d) {
+		run.fetch_add(1, std::memory_order_relaxed);
+		busyNs.fetch_add(d.count(), std::memory_order_relaxed);
+	}
+	void OnExpired() {
+		expired.fetch_add(1, std::memory_order_relaxed);
+	}
+	void OnDropped() {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+	void OnCancelled() {
+		cancelled.fetch_add(1, std::memory_order_relaxed);
+	}
+	std::atomic<uint64_t> run;
+	std::atomic<uint64_t> expired;
+	std::atomic<uint64_t> dropped;   // shed by the QueueManager
+	std::atomic<uint64_t> cancelled; // no token, or the pool stopped
+	std::atomic<int64_t> busyNs;
+};
+
+// Log policies receive the events of workers.
+struct NoLog {
+	static void Event(const char *msg) {}
+};
+
+struct StdoutLog {
+	static void Event(const char *msg) {
+		std::cout << msg << "\n";
+	}
+};
+
+#ifdef VERBOSE
+using DefaultLog = StdoutLog;
+#else
+using DefaultLog = NoLog;
+#endif
+
+// Profile policies are told when a worker begins and ends a task, with the
+// tag the task was posted with and the time it waited for a rate limiter
+// token; see TaskProfiler in profiler.h.
+struct NoProfile {
+	static const bool kEnabled = false;
+	void Begin() {}
+	void End(const char *tag, std::chrono::nanoseconds throttled) {}
+};
+
+// Feature policies tell which of the per-task services of a pool are built
+// in. A pool without a feature cannot be asked for it.
+//   kInFlight:  count tasks in flight, for WaitIdle().
+//   kAdmission: consult a QueueManager and a ConcurrencyLimiter.
+//   kArena:     give each worker a scratch arena, reset after each task.
+//   kStamp:     stamp tasks with their post time, for expiry, rate limiting
+//               and queue management, and number them, so that tasks of
+//               equal priority leave a PriQueue in posting order.
+struct AllFeatures {
+	static const bool kInFlight = true;
+	static const bool kAdmission = true;
+	static const bool kArena = true;
+	static const bool kStamp = true;
+};
+
+struct NoFeatures {
+	static const bool kInFlight = false;
+	static const bool kAdmission = false;
+	static const bool kArena = false;
+	static const bool kStamp = false;
+};
+
+// PoolPolicies bundles the policies of a pool. The queue policy is the
+// Container parameter of the pool itself.
+template<class Expiry = CheckExpiry, class RateLimit = UseRateLimit, 
+	class Stats = NoStats, class Log = DefaultLog, class Profile = NoProfile,
+	class Features = AllFeatures>
+struct PoolPolicies {
+	using ExpiryPolicy = Expiry;
+	using RateLimitPolicy = RateLimit;
+	using StatsPolicy = Stats;
+	using LogPolicy = Log;
+	using ProfilePolicy = Profile;
+	using FeaturePolicy = Features;
+	static_assert(Features::kStamp || (!Expiry::kEnabled && !RateLimit::kEnabled && !Features::kAdmission),
+			"expiry, rate limiting and queue management need stamped tasks");
+};
+
+// DefaultPolicies keep the features every pool used to have.
+using DefaultPolicies = PoolPolicies<>;
+// LeanPolicies only run tasks.
+using LeanPolicies = PoolPolicies<NoExpiry, NoRateLimit, NoStats, NoLog, NoProfile, NoFeatures>;
+
+#endif // __POLICIES_H_
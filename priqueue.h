@@ -11,6 +11,10 @@
 
 #include <queue>
 #include <mutex>
+#include <algorithm>
+
+template<class T>
+struct ChannelTraits;
 
 // A thin wrapper of std::priority_queue.
 template<class T>
@@ -29,8 +33,33 @@ class PriQueue {
 			items_.pop();
 			return t;
 		}
+
+		size_t size() {
+			return items_.size();
+		}
+
+		// erase removes the item with the given key (see
+		// ChannelTraits<T>::Key()) and returns false if there is none. It
+		// takes time linear in the queue length.
+		bool erase(const void *key) {
+			auto &c = items_.c;
+			auto it = std::find_if(c.begin(), c.end(), [key](const T &t) {
+				return ChannelTraits<T>::Key(t) == key;
+			});
+			if (it == c.end()) {
+				return false;
+			}
+			c.erase(it);
+			std::make_heap(c.begin(), c.end(), items_.comp);
+			return true;
+		}
 	private:
-		std::priority_queue<T> items_; 
+		// Heap exposes the container of std::priority_queue to erase().
+		struct Heap : std::priority_queue<T> {
+			using std::priority_queue<T>::c;
+			using std::priority_queue<T>::comp;
+		};
+		Heap items_; 
 
 };
 
@@ -48,8 +77,15 @@ class Priority {
 			id_ = counter;
 			++counter;
 		}
+		// An unnumbered priority does not take the global lock; ties among
+		// unnumbered priorities are not broken.
+		Priority(int priority, bool numbered) : priority_(priority), id_(0) {
+			if (numbered) {
+				*this = Priority(priority);
+			}
+		}
 
-		int GetPriority() {
+		int GetPriority() const {
 			return priority_;
 		}
 
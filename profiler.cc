@@ -0,0 +1,301 @@
+// 
+// Implementation of TaskProfiler.
+//
+
+#include "profiler.h"
+
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Counters of the calling thread, opened on first use.
+struct Counters {
+	Counters() : opened(false), cycles(-1), instructions(-1) {}
+	~Counters() {
+		if (cycles >= 0) {
+			close(cycles);
+		}
+		if (instructions >= 0) {
+			close(instructions);
+		}
+	}
+
+	static int open(uint64_t config) {
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		// this thread, any CPU
+		return syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	}
+
+	void init() {
+		if (opened) {
+			return;
+		}
+		opened = true;
+		cycles = open(PERF_COUNT_HW_CPU_CYCLES);
+		instructions = open(PERF_COUNT_HW_INSTRUCTIONS);
+	}
+
+	static uint64_t read(int fd) {
+		uint64_t v = 0;
+		if (fd < 0 || ::read(fd, &v, sizeof(v)) != sizeof(v)) {
+			return 0;
+		}
+		return v;
+	}
+
+	bool opened;
+	int cycles;
+	int instructions;
+};
+
+struct Sample {
+	steady_clock::time_point wall;
+	nanoseconds cpu;
+	uint64_t voluntary;
+	uint64_t involuntary;
+	uint64_t cycles;
+	uint64_t instructions;
+	bool counting; // whether the sample has counter values
+};
+
+// Usage is what a task used between two samples.
+struct Usage {
+	Usage() : cpu(0), wall(0), voluntary(0), involuntary(0), cycles(0), instructions(0) {}
+	Usage(const Sample &start, const Sample &end) :
+		cpu(end.cpu - start.cpu),
+		wall(duration_cast<nanoseconds>(end.wall - start.wall)),
+		voluntary(end.voluntary - start.voluntary),
+		involuntary(end.involuntary - start.involuntary),
+		cycles(start.counting ? end.cycles - start.cycles : 0),
+		instructions(start.counting ? end.instructions - start.instructions : 0) {}
+
+	Usage& operator+=(const Usage &u) {
+		cpu += u.cpu;
+		wall += u.wall;
+		voluntary += u.voluntary;
+		involuntary += u.involuntary;
+		cycles += u.cycles;
+		instructions += u.instructions;
+		return *this;
+	}
+	Usage& operator-=(const Usage &u) {
+		cpu -= u.cpu;
+		wall -= u.wall;
+		voluntary -= u.voluntary;
+		involuntary -= u.involuntary;
+		cycles -= u.cycles;
+		instructions -= u.instructions;
+		return *this;
+	}
+
+	nanoseconds cpu;
+	nanoseconds wall;
+	uint64_t voluntary;
+	uint64_t involuntary;
+	uint64_t cycles;
+	uint64_t instructions;
+};
+
+// Frame is a task begun on the thread and not ended yet.
+struct Frame {
+	Sample start;
+	Usage nested; // used by the tasks run inside this one
+};
+
+// Tasks may nest, e.g. when a waiting task runs others. Each task is charged
+// its exclusive usage: what the inner tasks used is subtracted from the outer
+// one, so that nothing is counted twice.
+struct ThreadState {
+	Counters counters;
+	vector<Frame> started;
+};
+
+thread_local ThreadState state;
+
+nanoseconds threadCpu() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return seconds(ts.tv_sec) + nanoseconds(ts.tv_nsec);
+}
+
+void sample(Sample &s, bool counting) {
+	s.counting = counting;
+	rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	s.voluntary = ru.ru_nvcsw;
+	s.involuntary = ru.ru_nivcsw;
+	if (counting) {
+		s.cycles = Counters::read(state.counters.cycles);
+		s.instructions = Counters::read(state.counters.instructions);
+	}
+	s.cpu = threadCpu();
+	s.wall = steady_clock::now();
+}
+
+const char *kUntagged = "(untagged)";
+
+} // namespace
+
+// Profiles are summed by tag pointer under a lock, and merged by tag string
+// when reported.
+class TaskProfiler::Impl {
+	public:
+		Impl() : counters_(false) {}
+
+		void EnableCounters(bool on) {
+			counters_ = on;
+		}
+
+		void Begin() {
+			// Inner tasks count like the outer one, so their counter values
+			// can be subtracted from it.
+			bool counting = state.started.empty() ?
+				counters_.load(memory_order_relaxed) : state.started.back().start.counting;
+			if (counting) {
+				state.counters.init();
+			}
+			state.started.emplace_back();
+			sample(state.started.back().start, counting);
+		}
+
+		void End(const char *tag, nanoseconds throttled) {
+			auto frame = state.started.back();
+			state.started.pop_back();
+			Sample end;
+			sample(end, frame.start.counting);
+			Usage used(frame.start, end);
+			if (!state.started.empty()) {
+				state.started.back().nested += used;
+			}
+			used -= frame.nested;
+			lock_guard<mutex> lck(mtx_);
+			auto &p = profiles_[tag != nullptr ? tag : kUntagged];
+			p.tasks++;
+			p.cpu += used.cpu;
+			p.wall += used.wall;
+			p.throttled += throttled;
+			p.voluntary += used.voluntary;
+			p.involuntary += used.involuntary;
+			p.cycles += used.cycles;
+			p.instructions += used.instructions;
+		}
+
+		vector<TaskProfile> Top(size_t n, Order order) {
+			map<string, TaskProfile> merged;
+			{
+				lock_guard<mutex> lck(mtx_);
+				for (auto &kv : profiles_) {
+					auto it = merged.find(kv.first);
+					if (it == merged.end()) {
+						it = merged.emplace(kv.first, kv.second).first;
+						it->second.tag = kv.first;
+						continue;
+					}
+					add(it->second, kv.second);
+				}
+			}
+			vector<TaskProfile> top;
+			for (auto &kv : merged) {
+				top.push_back(kv.second);
+			}
+			auto key = [order](const TaskProfile &p) {
+				return order == Order::CPU ? p.cpu : p.Wait();
+			};
+			sort(top.begin(), top.end(), [&](const TaskProfile &a, const TaskProfile &b) {
+				return key(a) > key(b);
+			});
+			if (top.size() > n) {
+				top.resize(n);
+			}
+			return top;
+		}
+
+		void Clear() {
+			lock_guard<mutex> lck(mtx_);
+			profiles_.clear();
+		}
+
+	private:
+		atomic<bool> counters_;
+		mutex mtx_;
+		unordered_map<const char*, TaskProfile> profiles_;
+
+		static void add(TaskProfile &a, const TaskProfile &b) {
+			a.tasks += b.tasks;
+			a.cpu += b.cpu;
+			a.wall += b.wall;
+			a.throttled += b.throttled;
+			a.voluntary += b.voluntary;
+			a.involuntary += b.involuntary;
+			a.cycles += b.cycles;
+			a.instructions += b.instructions;
+		}
+};
+
+
+TaskProfiler::TaskProfiler() {
+	impl_ = std::make_unique<Impl>();
+}
+
+TaskProfiler::~TaskProfiler() {}
+
+void TaskProfiler::EnableCounters(bool on) {
+	impl_->EnableCounters(on);
+}
+
+void TaskProfiler::Begin() {
+	impl_->Begin();
+}
+
+void TaskProfiler::End(const char *tag, nanoseconds throttled) {
+	impl_->End(tag, throttled);
+}
+
+vector<TaskProfile> TaskProfiler::Top(size_t n, Order order) {
+	return impl_->Top(n, order);
+}
+
+string TaskProfiler::Report(size_t n, Order order) {
+	auto ms = [](nanoseconds d) { return duration<double, milli>(d).count(); };
+	ostringstream out;
+	out << left << setw(20) << "tag" << right
+		<< setw(10) << "tasks" << setw(12) << "cpu ms" << setw(12) << "wall ms"
+		<< setw(12) << "wait ms" << setw(12) << "throttle ms"
+		<< setw(10) << "vcsw" << setw(10) << "ivcsw"
+		<< setw(14) << "cycles" << setw(14) << "instr" << "\n";
+	out << fixed << setprecision(1);
+	for (auto &p : Top(n, order)) {
+		out << left << setw(20) << p.tag << right
+			<< setw(10) << p.tasks << setw(12) << ms(p.cpu) << setw(12) << ms(p.wall)
+			<< setw(12) << ms(p.Wait()) << setw(12) << ms(p.throttled)
+			<< setw(10) << p.voluntary << setw(10) << p.involuntary
+			<< setw(14) << p.cycles << setw(14) << p.instructions << "\n";
+	}
+	return out.str();
+}
+
+void TaskProfiler::Clear() {
+	impl_->Clear();
+}
@@ -0,0 +1,81 @@
+//
+// profiler.h
+//
+// Define TaskProfiler, which accounts the resources used by tasks by type.
+//
+
+#ifndef __PROFILER_H_
+#define __PROFILER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+
+// TaskProfile is the resource usage of all tasks of one type.
+struct TaskProfile {
+	std::string tag;
+	uint64_t tasks;
+	std::chrono::nanoseconds cpu;       // thread CPU time
+	std::chrono::nanoseconds wall;      // run time
+	std::chrono::nanoseconds throttled; // time waiting for a rate limiter token
+	uint64_t voluntary;   // context switches, mostly blocking
+	uint64_t involuntary; // context switches, preemption
+	uint64_t cycles;      // hardware counters, 0 if not available
+	uint64_t instructions;
+
+	// Wait returns the time the tasks spent off CPU, in the rate limiter
+	// or blocked while running.
+	std::chrono::nanoseconds Wait() const {
+		auto offCpu = wall > cpu ? wall - cpu : std::chrono::nanoseconds(0);
+		return offCpu + throttled;
+	}
+};
+
+// TaskProfiler is the profile policy of a pool (see policies.h) that
+// measures every task a worker runs: the thread CPU time, the wall time, the
+// context switches and, if enabled and permitted, the CPU cycles and
+// instructions from perf_event_open(2). Measurements are summed by the tag
+// the task was posted with (see ThreadPoolImpl::PostTagged).
+//
+// Begin() and End() are called by the worker thread around each task and
+// cost a few system calls, more with hardware counters. A task that runs
+// other tasks while it waits, see TaskGroup, is not charged for them: each
+// task is accounted its exclusive usage.
+class TaskProfiler {
+	public:
+		static const bool kEnabled = true;
+
+		// Order of Top(): by CPU time, or by time spent off CPU.
+		enum class Order {CPU, WAIT};
+
+		TaskProfiler();
+		TaskProfiler(const TaskProfiler&) = delete;
+		TaskProfiler& operator=(const TaskProfiler&) = delete;
+		~TaskProfiler();
+
+		// EnableCounters turns hardware counters on or off for the tasks
+		// that begin from now on. Threads that cannot open the counters,
+		// e.g. for lack of permission, go without.
+		void EnableCounters(bool on);
+
+		void Begin();
+		// End accounts the task begun last on the calling thread to tag,
+		// which must outlive the profiler; nullptr stands for untagged tasks.
+		void End(const char *tag, std::chrono::nanoseconds throttled);
+
+		// Top returns the n task types using the most CPU time, or spending
+		// the most time off CPU.
+		std::vector<TaskProfile> Top(size_t n, Order order = Order::CPU);
+
+		// Report formats Top(n, order) as a table.
+		std::string Report(size_t n, Order order = Order::CPU);
+
+		void Clear();
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl> impl_;
+};
+
+#endif // __PROFILER_H_
@@ -0,0 +1,24 @@
+#ifndef __QUEUEMANAGER_H_
+#define __QUEUEMANAGER_H_
+
+#include <stdint.h>
+#include <chrono>
+
+// QueueManager decides when a thread pool should shed load, based on how
+// long tasks have been waiting in its queue (active queue management).
+// Implementations must be thread-safe.
+class QueueManager {
+	public:
+		virtual ~QueueManager() {}
+		// OnDequeue is called for each task taken off the queue, with the time
+		// it spent in the queue and the number of tasks left behind. It
+		// returns true if the task should be dropped instead of run.
+		virtual bool OnDequeue(std::chrono::microseconds sojourn, uint32_t remaining) = 0;
+		// Admit is called for each task before it is queued. It returns false
+		// if the task should be rejected.
+		virtual bool Admit() = 0;
+		// Dropped returns the number of tasks dropped or rejected so far.
+		virtual uint64_t Dropped() = 0;
+};
+
+#endif // __QUEUEMANAGER_H_
@@ -6,6 +6,11 @@
 class RateLimiter {
 	public:
 		virtual bool GetToken(int64_t timeout) = 0;
+		// GetToken with a priority lets limiters that support it serve callers
+		// of higher priority first; others ignore the priority.
+		virtual bool GetToken(int64_t timeout, int priority) {
+			return GetToken(timeout);
+		}
 		virtual uint32_t GetRate() = 0; // In terms of tokens per second.
 		virtual void Start() = 0;
 		virtual void Stop() = 0;
@@ -0,0 +1,510 @@
+// 
+// Implementation of Reactor.
+//
+
+#include "reactor.h"
+#include "blocking.h"
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <system_error>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "runnable.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+struct Handler {
+	Handler(int f, uint32_t e, Reactor::Callback c) : fd(f), events(e), cb(c), disarmed(false) {}
+	const int fd;
+	uint32_t events;
+	const Reactor::Callback cb;
+	bool disarmed; // harvested, and not re-armed yet
+};
+
+struct Timer {
+	Timer(uint64_t i, int64_t p, Reactor::TimerCallback c) : id(i), period(p), cb(c) {}
+	const uint64_t id;
+	const int64_t period;
+	const Reactor::TimerCallback cb;
+};
+
+// Ready is a callback to run: either a ready descriptor or a due timer.
+struct Ready {
+	shared_ptr<Handler> handler;
+	uint32_t events;
+	shared_ptr<Timer> timer;
+};
+
+const int kMaxEvents = 64;     // events taken by one epoll_wait
+const size_t kBatch = 8;       // callbacks per task posted in DISPATCH mode
+const int kPollSlice = 10;     // ms a follower waits before yielding its worker
+
+}
+
+class Reactor::Impl {
+	public:
+		Impl(shared_ptr<ThreadFactory> factory, shared_ptr<ThreadPool> pool, Mode mode, uint32_t followers);
+		~Impl();
+		void Start();
+		void Stop();
+		bool Add(int fd, uint32_t events, Callback cb);
+		bool Modify(int fd, uint32_t events);
+		bool Remove(int fd);
+		uint64_t AddTimer(int64_t delay, TimerCallback cb, int64_t period);
+		bool CancelTimer(uint64_t id);
+
+	private:
+		using Clock = steady_clock; // CLOCK_MONOTONIC, as the timerfd
+
+		// Loop is the reactor thread in DISPATCH mode.
+		class Loop : public Runnable {
+			public:
+				explicit Loop(Impl *r) : r_(r) {}
+				virtual void Run() override;
+			private:
+				Impl *r_;
+		};
+
+		// Batch runs a batch of callbacks on a worker in DISPATCH mode. If
+		// the pool discards it without running it, e.g. on StopNow() or when
+		// its queue manager sheds it, the callbacks are skipped, but their
+		// descriptors are re-armed all the same.
+		class Batch : public Runnable {
+			public:
+				Batch(Impl *r, vector<Ready> &&ready) : r_(r), ready_(move(ready)), pending_(true) {}
+				~Batch();
+				virtual void Run() override;
+			private:
+				Impl *r_;
+				vector<Ready> ready_;
+				bool pending_; // not run yet
+		};
+
+		// Poller is one of the followers in LEADER_FOLLOWERS mode. A poller
+		// the pool discards is replaced if the pool takes a new one at once.
+		class Poller : public Runnable, public enable_shared_from_this<Poller> {
+			public:
+				explicit Poller(Impl *r) : r_(r), pending_(false) {}
+				~Poller();
+				virtual void Run() override;
+				// post posts the poller, or counts it done if the pool does
+				// not take it.
+				void post(int64_t timeout);
+			private:
+				Impl *r_;
+				bool pending_; // posted, not run yet
+		};
+
+		shared_ptr<ThreadFactory> factory_;
+		shared_ptr<ThreadPool> pool_;
+		const Mode mode_;
+		const uint32_t followers_;
+		int epfd_;
+		int eventfd_;
+		int timerfd_;
+
+		mutex mtx_; // guards handlers_ and timers
+		unordered_map<int, shared_ptr<Handler>> handlers_;
+		multimap<Clock::time_point, shared_ptr<Timer>> timers_;
+		unordered_map<uint64_t, multimap<Clock::time_point, shared_ptr<Timer>>::iterator> timerIndex_;
+		uint64_t nextTimer_;
+
+		mutex leader_; // held by the thread waiting on epfd_
+		atomic<bool> stop_;
+		bool running_;
+		unique_ptr<Thread> thread_;
+
+		// Tasks posted to the pool and not returned yet.
+		mutex tasksMtx_;
+		condition_variable tasksCv_;
+		uint32_t tasks_;
+
+		void harvest(int timeout, vector<Ready> &ready);
+		void fire(const Ready &r);
+		void rearm(const shared_ptr<Handler> &h);
+		bool registered(const shared_ptr<Handler> &h);
+		bool registeredLocked(const shared_ptr<Handler> &h);
+		void dispatch(vector<Ready> &ready);
+		void rearmTimer(); // the caller holds mtx_
+		void taskStarted();
+		void taskDone();
+};
+
+
+Reactor::Impl::Impl(shared_ptr<ThreadFactory> factory, shared_ptr<ThreadPool> pool, Mode mode, uint32_t followers) :
+	factory_(factory),
+	pool_(pool),
+	mode_(mode),
+	followers_(followers > 0 ? followers : 1),
+	epfd_(-1),
+	eventfd_(-1),
+	timerfd_(-1),
+	nextTimer_(1),
+	stop_(false),
+	running_(false),
+	tasks_(0) {
+	epfd_ = epoll_create1(EPOLL_CLOEXEC);
+	eventfd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	timerfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (epfd_ < 0 || eventfd_ < 0 || timerfd_ < 0) {
+		int err = errno;
+		for (int fd : {epfd_, eventfd_, timerfd_}) {
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+		throw system_error(err, generic_category(), "reactor");
+	}
+	// Both stay level-triggered: the eventfd is never read while stopping,
+	// so that every waiter sees it.
+	for (int fd : {eventfd_, timerfd_}) {
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+Reactor::Impl::~Impl() {
+	Stop();
+	for (int fd : {epfd_, eventfd_, timerfd_}) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+void Reactor::Impl::Start() {
+	if (running_) {
+		return;
+	}
+	uint64_t n;
+	while (read(eventfd_, &n, sizeof(n)) > 0) {} // clear a previous Stop
+	stop_ = false;
+	running_ = true;
+	if (mode_ == Mode::DISPATCH) {
+		thread_ = factory_->NewThread();
+		thread_->Run(make_shared<Loop>(this));
+		return;
+	}
+	for (uint32_t i = 0; i < followers_; ++i) {
+		taskStarted();
+		make_shared<Poller>(this)->post(-1);
+	}
+}
+
+void Reactor::Impl::Stop() {
+	if (!running_) {
+		return;
+	}
+	stop_ = true;
+	uint64_t one = 1;
+	if (write(eventfd_, &one, sizeof(one)) < 0) {
+		// the counter is non-zero already
+	}
+	thread_.reset(); // join
+	unique_lock<mutex> lck(tasksMtx_);
+	tasksCv_.wait(lck, [this] { return tasks_ == 0; });
+	running_ = false;
+}
+
+bool Reactor::Impl::Add(int fd, uint32_t events, Callback cb) {
+	lock_guard<mutex> lck(mtx_);
+	if (handlers_.count(fd) > 0) {
+		return false;
+	}
+	epoll_event ev = {};
+	ev.events = events | EPOLLONESHOT;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		return false;
+	}
+	handlers_[fd] = make_shared<Handler>(fd, events, cb);
+	return true;
+}
+
+bool Reactor::Impl::Modify(int fd, uint32_t events) {
+	lock_guard<mutex> lck(mtx_);
+	auto it = handlers_.find(fd);
+	if (it == handlers_.end()) {
+		return false;
+	}
+	it->second->events = events;
+	if (it->second->disarmed) {
+		return true; // re-armed with the new events once its callback returns
+	}
+	epoll_event ev = {};
+	ev.events = events | EPOLLONESHOT;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+bool Reactor::Impl::Remove(int fd) {
+	lock_guard<mutex> lck(mtx_);
+	if (handlers_.erase(fd) == 0) {
+		return false;
+	}
+	epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+	return true;
+}
+
+uint64_t Reactor::Impl::AddTimer(int64_t delay, TimerCallback cb, int64_t period) {
+	lock_guard<mutex> lck(mtx_);
+	auto t = make_shared<Timer>(nextTimer_++, period, cb);
+	auto when = Clock::now() + milliseconds(delay > 0 ? delay : 0);
+	timerIndex_[t->id] = timers_.emplace(when, t);
+	rearmTimer();
+	return t->id;
+}
+
+bool Reactor::Impl::CancelTimer(uint64_t id) {
+	lock_guard<mutex> lck(mtx_);
+	auto it = timerIndex_.find(id);
+	if (it == timerIndex_.end()) {
+		return false;
+	}
+	timers_.erase(it->second);
+	timerIndex_.erase(it);
+	rearmTimer();
+	return true;
+}
+
+// rearmTimer sets the timerfd to the earliest timer, or disarms it.
+void Reactor::Impl::rearmTimer() {
+	itimerspec spec = {};
+	if (!timers_.empty()) {
+		auto left = duration_cast<nanoseconds>(timers_.begin()->first - Clock::now()).count();
+		if (left < 1) {
+			left = 1; // zero would disarm it
+		}
+		spec.it_value.tv_sec = left / 1000000000;
+		spec.it_value.tv_nsec = left % 1000000000;
+	}
+	timerfd_settime(timerfd_, 0, &spec, nullptr);
+}
+
+// harvest waits for events and collects the callbacks to run. The caller
+// must be the only one waiting on epfd_.
+void Reactor::Impl::harvest(int timeout, vector<Ready> &ready) {
+	epoll_event evs[kMaxEvents];
+	int n = epoll_wait(epfd_, evs, kMaxEvents, timeout);
+	lock_guard<mutex> lck(mtx_);
+	for (int i = 0; i < n; ++i) {
+		int fd = evs[i].data.fd;
+		if (fd == eventfd_) {
+			continue; // stopping
+		}
+		if (fd == timerfd_) {
+			uint64_t expirations;
+			if (read(timerfd_, &expirations, sizeof(expirations)) < 0) {
+				// raced with a rearm; the due timers are collected anyway
+			}
+			auto now = Clock::now();
+			while (!timers_.empty() && timers_.begin()->first <= now) {
+				auto t = timers_.begin()->second;
+				timers_.erase(timers_.begin());
+				if (t->period > 0) {
+					timerIndex_[t->id] = timers_.emplace(now + milliseconds(t->period), t);
+				} else {
+					timerIndex_.erase(t->id);
+				}
+				ready.push_back(Ready{nullptr, 0, t});
+			}
+			rearmTimer();
+			continue;
+		}
+		auto it = handlers_.find(fd);
+		if (it != handlers_.end()) {
+			it->second->disarmed = true;
+			ready.push_back(Ready{it->second, evs[i].events, nullptr});
+		}
+	}
+}
+
+// fire runs one callback, unless its descriptor has been removed since it
+// was harvested, then re-arms the descriptor.
+void Reactor::Impl::fire(const Ready &r) {
+	if (r.timer != nullptr) {
+		r.timer->cb();
+		return;
+	}
+	if (registered(r.handler)) {
+		r.handler->cb(r.events);
+	}
+	rearm(r.handler);
+}
+
+// rearm re-arms the descriptor of a harvested handler, with the events it
+// has now, unless it has been removed meanwhile.
+void Reactor::Impl::rearm(const shared_ptr<Handler> &h) {
+	lock_guard<mutex> lck(mtx_);
+	if (!registeredLocked(h)) {
+		return;
+	}
+	h->disarmed = false;
+	epoll_event ev = {};
+	ev.events = h->events | EPOLLONESHOT;
+	ev.data.fd = h->fd;
+	epoll_ctl(epfd_, EPOLL_CTL_MOD, h->fd, &ev);
+}
+
+// registered tells whether h is still the handler of its descriptor.
+bool Reactor::Impl::registered(const shared_ptr<Handler> &h) {
+	lock_guard<mutex> lck(mtx_);
+	return registeredLocked(h);
+}
+
+// Same as registered(), for a caller that holds mtx_.
+bool Reactor::Impl::registeredLocked(const shared_ptr<Handler> &h) {
+	auto it = handlers_.find(h->fd);
+	return it != handlers_.end() && it->second == h;
+}
+
+// dispatch posts the callbacks to the pool in batches. If the pool does not
+// take a batch, it runs on the reactor thread, so that no descriptor is
+// left disarmed.
+void Reactor::Impl::dispatch(vector<Ready> &ready) {
+	for (size_t i = 0; i < ready.size(); i += kBatch) {
+		auto end = ready.begin() + min(i + kBatch, ready.size());
+		vector<Ready> batch(ready.begin() + i, end);
+		taskStarted();
+		auto task = make_shared<Batch>(this, move(batch));
+		if (!pool_->Post(task)) {
+			task->Run();
+		}
+	}
+	ready.clear();
+}
+
+void Reactor::Impl::taskStarted() {
+	lock_guard<mutex> lck(tasksMtx_);
+	++tasks_;
+}
+
+void Reactor::Impl::taskDone() {
+	lock_guard<mutex> lck(tasksMtx_);
+	if (--tasks_ == 0) {
+		tasksCv_.notify_all();
+	}
+}
+
+void Reactor::Impl::Loop::Run() {
+	vector<Ready> ready;
+	while (!r_->stop_) {
+		r_->harvest(-1, ready);
+		r_->dispatch(ready);
+	}
+}
+
+Reactor::Impl::Batch::~Batch() {
+	if (!pending_) {
+		return;
+	}
+	for (auto &r : ready_) {
+		if (r.handler != nullptr) {
+			r_->rearm(r.handler);
+		}
+	}
+	r_->taskDone();
+}
+
+void Reactor::Impl::Batch::Run() {
+	pending_ = false;
+	for (auto &r : ready_) {
+		r_->fire(r);
+	}
+	r_->taskDone();
+}
+
+Reactor::Impl::Poller::~Poller() {
+	if (!pending_) {
+		return;
+	}
+	// Discarded by the pool. Never block the thread that drops it.
+	if (!r_->stop_) {
+		make_shared<Poller>(r_)->post(0);
+	} else {
+		r_->taskDone();
+	}
+}
+
+void Reactor::Impl::Poller::post(int64_t timeout) {
+	pending_ = true;
+	if (!r_->pool_->Post(shared_from_this(), timeout)) {
+		pending_ = false;
+		r_->taskDone();
+	}
+}
+
+void Reactor::Impl::Poller::Run() {
+	pending_ = false;
+	vector<Ready> ready;
+	{
+		// The followers hold their workers while they wait for the leader;
+		// a pool that compensates for blocking tasks adds workers meanwhile.
+		BlockingScope blocking;
+		lock_guard<mutex> lead(r_->leader_);
+		if (!r_->stop_) {
+			r_->harvest(kPollSlice, ready);
+		}
+	}
+	// Another follower leads while this one runs the callbacks.
+	for (auto &r : ready) {
+		r_->fire(r);
+	}
+	// Re-post to let queued tasks run; a follower only blocks here while
+	// the other workers drain the queue.
+	if (r_->stop_) {
+		r_->taskDone();
+		return;
+	}
+	post(-1);
+}
+
+
+Reactor::Reactor(shared_ptr<ThreadFactory> factory, shared_ptr<ThreadPool> pool, Mode mode, uint32_t followers) {
+	impl_ = make_unique<Impl>(factory, pool, mode, followers);
+}
+
+Reactor::~Reactor() {}
+
+void Reactor::Start() {
+	impl_->Start();
+}
+
+void Reactor::Stop() {
+	impl_->Stop();
+}
+
+bool Reactor::Add(int fd, uint32_t events, Callback cb) {
+	return impl_->Add(fd, events, cb);
+}
+
+bool Reactor::Modify(int fd, uint32_t events) {
+	return impl_->Modify(fd, events);
+}
+
+bool Reactor::Remove(int fd) {
+	return impl_->Remove(fd);
+}
+
+uint64_t Reactor::AddTimer(int64_t delay, TimerCallback cb, int64_t period) {
+	return impl_->AddTimer(delay, cb, period);
+}
+
+bool Reactor::CancelTimer(uint64_t id) {
+	return impl_->CancelTimer(id);
+}
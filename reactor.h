@@ -0,0 +1,81 @@
+//
+// reactor.h
+//
+// Define Reactor, an epoll event loop that runs its callbacks on a ThreadPool.
+//
+
+#ifndef __REACTOR_H_
+#define __REACTOR_H_
+
+#include <memory>
+#include <functional>
+
+#include "thread.h"
+#include "threadpool.h"
+
+// Reactor waits for readiness of file descriptors and for timers with a
+// single epoll instance, and runs the callbacks on the workers of a pool.
+// Descriptors are registered one-shot: a callback never runs twice at once
+// for the same descriptor, and the descriptor is re-armed when it returns.
+// Timers are multiplexed over one timerfd, and an eventfd wakes the loop up
+// on Stop().
+//
+// Two modes are supported:
+//   DISPATCH:         a reactor thread waits for events and posts them to the
+//                     pool in batches.
+//   LEADER_FOLLOWERS: up to 'followers' pool tasks take turns waiting on the
+//                     epoll instance; the leader releases the wait to the next
+//                     one and runs the callbacks itself, saving a thread hop.
+//                     The pollers re-post themselves between waits, so other
+//                     tasks keep their share of the workers. followers must be
+//                     smaller than the number of threads in the pool: the
+//                     followers waiting for the leader block their workers.
+//                     They wait in a BlockingScope, so a pool that compensates
+//                     for blocking tasks adds workers meanwhile; with other
+//                     pools, size the pool for them.
+// In both modes the reactor must be stopped before the pool.
+class Reactor {
+	public:
+		enum class Mode {DISPATCH, LEADER_FOLLOWERS};
+		// Callback receives the ready events, e.g. EPOLLIN.
+		using Callback = std::function<void(uint32_t events)>;
+		using TimerCallback = std::function<void()>;
+
+		// Throws std::system_error if the epoll instance, eventfd or timerfd
+		// cannot be created.
+		Reactor(std::shared_ptr<ThreadFactory> factory, std::shared_ptr<ThreadPool> pool, 
+				Mode mode = Mode::DISPATCH, uint32_t followers = 1);
+		Reactor(const Reactor&) = delete;
+		Reactor(Reactor&&) = delete;
+		Reactor& operator=(const Reactor&) = delete;
+		Reactor& operator=(Reactor&&) = delete;
+		~Reactor();
+
+		void Start();
+		// Stop waits for the running callbacks to return.
+		void Stop();
+
+		// Add registers fd for the given epoll events. It returns false if fd
+		// is registered already or epoll refuses it.
+		bool Add(int fd, uint32_t events, Callback cb);
+		// Modify changes the events of a registered fd, and re-arms it. If a
+		// callback of fd is pending or running, fd is re-armed with the new
+		// events once it returns, so that callbacks still never overlap.
+		bool Modify(int fd, uint32_t events);
+		// Remove unregisters fd. Events harvested but not handled yet are
+		// dropped; a callback already running may still finish.
+		bool Remove(int fd);
+
+		// AddTimer runs cb after delay milliseconds, then every period
+		// milliseconds if period > 0. It returns the id of the timer.
+		uint64_t AddTimer(int64_t delay, TimerCallback cb, int64_t period = 0);
+		// CancelTimer returns false if the timer has fired for the last time
+		// or was cancelled already.
+		bool CancelTimer(uint64_t id);
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl> impl_;
+};
+
+#endif // __REACTOR_H_
@@ -0,0 +1,159 @@
+//
+// Implement a FIFO queue in a preallocated ring buffer.
+//
+
+#ifndef __RINGQUEUE_H_
+#define __RINGQUEUE_H_
+
+#include <new>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+#include <sys/mman.h>
+
+template<class T>
+struct ChannelTraits;
+
+// RingQueue is a FIFO queue of contiguous slots, not thread-safe. The
+// capacity is the size given at construction rounded up to a power of two,
+// so that a slot is found by masking a running index. Storage is allocated
+// once; items are constructed in place by push() and destroyed by pop(), so
+// the queue itself does not allocate in steady state.
+//
+// A Channel sizes the ring from its limit. The ring only grows, doubling,
+// when pushed beyond its capacity; discarded items (see Channel::Discard())
+// are erased, so they do not hold slots.
+//
+// Rings of kHugePage bytes or more are mapped on huge pages when the system
+// has them reserved, else on pages the kernel is advised to back with
+// transparent huge pages.
+template<class T>
+class RingQueue {
+	public:
+		RingQueue() : RingQueue(kDefaultCapacity) {}
+		explicit RingQueue(uint32_t sz) : head_(0), tail_(0), mask_(roundUp(sz) - 1), slots_(nullptr), mapped_(0) {
+			slots_ = allocate(mask_ + 1, mapped_);
+		}
+		RingQueue(const RingQueue&) = delete;
+		RingQueue& operator=(const RingQueue&) = delete;
+		~RingQueue() {
+			while (size() > 0) {
+				pop();
+			}
+			release(slots_, mapped_);
+		}
+
+		void push(const T &t) {
+			if (size() == mask_ + 1) {
+				grow();
+			}
+			new (&slots_[tail_ & mask_]) T(t);
+			++tail_;
+		}
+
+		T pop() {
+			T &slot = slots_[head_ & mask_];
+			T item(std::move(slot));
+			slot.~T();
+			++head_;
+			return item;
+		}
+
+		size_t size() {
+			return tail_ - head_;
+		}
+
+		// erase removes the item with the given key (see
+		// ChannelTraits<T>::Key()), keeping the others in order, and returns
+		// false if there is none. It takes time linear in the queue length.
+		bool erase(const void *key) {
+			for (uint64_t i = head_; i != tail_; ++i) {
+				if (ChannelTraits<T>::Key(slots_[i & mask_]) != key) {
+					continue;
+				}
+				for (uint64_t j = i + 1; j != tail_; ++j) {
+					slots_[(j - 1) & mask_] = std::move(slots_[j & mask_]);
+				}
+				--tail_;
+				slots_[tail_ & mask_].~T();
+				return true;
+			}
+			return false;
+		}
+
+		size_t capacity() {
+			return mask_ + 1;
+		}
+
+	private:
+		static const uint32_t kDefaultCapacity = 64;
+		static const size_t kHugePage = 2 * 1024 * 1024;
+
+		uint64_t head_; // index of the next item to pop
+		uint64_t tail_; // index of the next slot to push to
+		uint64_t mask_;
+		T *slots_;
+		size_t mapped_; // bytes mapped with mmap, 0 if allocated with new
+
+		static uint64_t roundUp(uint32_t sz) {
+			uint64_t n = 1;
+			while (n < sz) {
+				n <<= 1;
+			}
+			return n;
+		}
+
+		// allocate returns room for n items, and sets mapped to the bytes
+		// mapped with mmap, 0 if allocated with new. It throws
+		// std::bad_alloc, leaving mapped as it was, if there is no memory.
+		static T* allocate(uint64_t n, size_t &mapped) {
+			size_t bytes = n * sizeof(T);
+			if (bytes < kHugePage) {
+				T *slots = static_cast<T*>(::operator new(bytes));
+				mapped = 0;
+				return slots;
+			}
+			size_t len = (bytes + kHugePage - 1) / kHugePage * kHugePage;
+			void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, 
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p == MAP_FAILED) {
+				p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (p == MAP_FAILED) {
+					throw std::bad_alloc();
+				}
+				madvise(p, len, MADV_HUGEPAGE);
+			}
+			mapped = len;
+			return static_cast<T*>(p);
+		}
+
+		static void release(T *slots, size_t mapped) {
+			if (mapped > 0) {
+				munmap(slots, mapped);
+			} else {
+				::operator delete(slots);
+			}
+		}
+
+		// grow doubles the ring, moving the items to the front of the new one.
+		// If the allocation fails, the ring is left as it was.
+		void grow() {
+			size_t mapped;
+			T *slots = allocate((mask_ + 1) * 2, mapped);
+			uint64_t n = size();
+			for (uint64_t i = 0; i < n; ++i) {
+				T &slot = slots_[(head_ + i) & mask_];
+				new (&slots[i]) T(std::move(slot));
+				slot.~T();
+			}
+			release(slots_, mapped_);
+			slots_ = slots;
+			mapped_ = mapped;
+			mask_ = mask_ * 2 + 1;
+			head_ = 0;
+			tail_ = n;
+		}
+};
+
+#endif // __RINGQUEUE_H_
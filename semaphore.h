@@ -23,7 +23,7 @@ class basic_semaphore {
 			//cv_.wait(lck, [&]{ return count_ > 0;});
 			--count_;
 		}
-		void TryWait() {
+		bool TryWait() {
 			std::unique_lock<std::mutex> lck(mtx_);
 			if (count_ > 0) {
 				--count_;
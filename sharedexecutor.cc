@@ -0,0 +1,296 @@
+// 
+// Implementation of SharedExecutor.
+//
+
+#include "sharedexecutor.h"
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+
+#include "stdthread.h"
+#include "taskgroup.h"
+
+using namespace std;
+using namespace std::chrono;
+
+class SharedExecutor::Impl {
+	public:
+		Impl(shared_ptr<ThreadFactory> factory, uint32_t threads);
+		~Impl();
+		uint32_t Threads() const;
+		void Attach(Source *s, int priority, uint32_t cap, shared_ptr<RateLimiter> rl);
+		void Detach(Source *s);
+		void Notify(Source *s);
+
+	private:
+		using Clock = steady_clock;
+
+		struct Entry {
+			Source *source;
+			int priority;
+			uint32_t cap;
+			shared_ptr<RateLimiter> ratelimiter;
+			uint32_t running;
+			Clock::time_point throttled; // no token until then
+			bool detaching;
+		};
+
+		// Loop is run by every thread of the executor.
+		class Loop : public Runnable {
+			public:
+				explicit Loop(Impl &ex) : ex_(ex) {}
+				virtual void Run() override {
+					ex_.loop();
+				}
+			private:
+				Impl &ex_;
+		};
+
+		// Helper lets a task waiting in a TaskGroup run other tasks.
+		class Helper : public HelpHook {
+			public:
+				explicit Helper(Impl &ex) : ex_(ex) {}
+				virtual bool RunPending() override {
+					return ex_.runOne();
+				}
+			private:
+				Impl &ex_;
+		};
+
+		mutex mtx_;
+		condition_variable work_;     // for idle threads
+		condition_variable detached_; // for Detach()
+		vector<unique_ptr<Entry>> entries_; // by descending priority
+		uint64_t turn_; // rotates sources of the same priority
+		bool stop_;
+		vector<unique_ptr<Thread>> threads_;
+		Helper helper_;
+
+		// current is the source of the task running on the calling thread.
+		static Entry*& current() {
+			static thread_local Entry *e = nullptr;
+			return e;
+		}
+
+		void loop();
+		bool runOne();
+		Entry* next(unique_lock<mutex> &lck, bool wait, bool helping);
+		void run(Entry &e);
+		void finish(Entry &e);
+		Entry* pick(Clock::time_point now, Clock::time_point &wakeup, bool helping);
+		bool eligible(Entry &e, Clock::time_point now, Clock::time_point &wakeup, bool helping);
+};
+
+
+SharedExecutor::Impl::Impl(shared_ptr<ThreadFactory> factory, uint32_t threads) :
+	turn_(0),
+	stop_(false),
+	helper_(*this) {
+	if (threads == 0) {
+		threads = 1;
+	}
+	auto loop = make_shared<Loop>(*this);
+	for (uint32_t i = 0; i < threads; ++i) {
+		threads_.push_back(factory->NewThread());
+		threads_.back()->Run(loop);
+	}
+}
+
+SharedExecutor::Impl::~Impl() {
+	{
+		lock_guard<mutex> lck(mtx_);
+		stop_ = true;
+		work_.notify_all();
+	}
+	threads_.clear(); // join
+}
+
+uint32_t SharedExecutor::Impl::Threads() const {
+	return threads_.size();
+}
+
+void SharedExecutor::Impl::Attach(Source *s, int priority, uint32_t cap, shared_ptr<RateLimiter> rl) {
+	unique_ptr<Entry> e(new Entry{s, priority, cap > 0 ? cap : Threads(), rl, 0, Clock::time_point(), false});
+	lock_guard<mutex> lck(mtx_);
+	auto pos = find_if(entries_.begin(), entries_.end(), [priority](const unique_ptr<Entry> &x) {
+		return x->priority < priority;
+	});
+	entries_.insert(pos, std::move(e));
+	work_.notify_all(); // the source may have tasks already
+}
+
+void SharedExecutor::Impl::Detach(Source *s) {
+	unique_lock<mutex> lck(mtx_);
+	auto it = find_if(entries_.begin(), entries_.end(), [s](const unique_ptr<Entry> &x) {
+		return x->source == s;
+	});
+	if (it == entries_.end()) {
+		return;
+	}
+	auto e = it->get();
+	e->detaching = true;
+	detached_.wait(lck, [e] { return e->running == 0; });
+	entries_.erase(find_if(entries_.begin(), entries_.end(), [e](const unique_ptr<Entry> &x) {
+		return x.get() == e;
+	}));
+}
+
+void SharedExecutor::Impl::Notify(Source *s) {
+	lock_guard<mutex> lck(mtx_);
+	work_.notify_one();
+}
+
+// eligible tells whether a task of e may run now, claiming the task and
+// taking a token if so; the token is only asked for once a task is claimed.
+// wakeup is moved before the end of the throttling of e. A task waiting in a
+// TaskGroup lends its slot to the tasks of its own source that it helps
+// with, so helping ignores the cap of that source; else a pool at its cap
+// could wait for its own subtasks forever. The caps of other sources hold.
+bool SharedExecutor::Impl::eligible(Entry &e, Clock::time_point now, Clock::time_point &wakeup, bool helping) {
+	bool lent = helping && &e == current();
+	if (e.detaching || (!lent && e.running >= e.cap)) {
+		return false;
+	}
+	if (e.ratelimiter != nullptr && now < e.throttled) {
+		wakeup = min(wakeup, e.throttled);
+		return false;
+	}
+	if (!e.source->Claim()) {
+		return false;
+	}
+	if (e.ratelimiter == nullptr || e.ratelimiter->GetToken(0, e.priority)) {
+		return true;
+	}
+	e.source->Unclaim();
+	// Try again once the next token should be there.
+	auto rate = e.ratelimiter->GetRate();
+	auto wait = rate > 0 ? duration_cast<Clock::duration>(duration<double>(1.0 / rate)) : milliseconds(1);
+	e.throttled = now + max<Clock::duration>(wait, milliseconds(1));
+	wakeup = min(wakeup, e.throttled);
+	return false;
+}
+
+// pick returns the source to run a task of: the first eligible one of the
+// highest priority, starting from a different one of the same priority
+// each time. The caller holds mtx_.
+SharedExecutor::Impl::Entry* SharedExecutor::Impl::pick(Clock::time_point now, Clock::time_point &wakeup, bool helping) {
+	size_t n = entries_.size();
+	for (size_t lo = 0; lo < n;) {
+		size_t hi = lo;
+		while (hi < n && entries_[hi]->priority == entries_[lo]->priority) {
+			++hi;
+		}
+		size_t k = hi - lo;
+		for (size_t i = 0; i < k; ++i) {
+			auto &e = *entries_[lo + (turn_ + i) % k];
+			if (eligible(e, now, wakeup, helping)) {
+				++turn_;
+				return &e;
+			}
+		}
+		lo = hi;
+	}
+	return nullptr;
+}
+
+// next picks the source of the next task and counts the task as running.
+// If wait is true, it waits for one; it returns nullptr once the executor
+// stops, or if there is none and wait is false. helping is true for tasks
+// run by a waiting task. The caller holds mtx_ through lck.
+SharedExecutor::Impl::Entry* SharedExecutor::Impl::next(unique_lock<mutex> &lck, bool wait, bool helping) {
+	while (!stop_) {
+		auto wakeup = Clock::time_point::max();
+		auto e = pick(Clock::now(), wakeup, helping);
+		if (e != nullptr) {
+			++e->running;
+			return e;
+		}
+		if (!wait) {
+			break;
+		}
+		if (wakeup == Clock::time_point::max()) {
+			work_.wait(lck);
+		} else {
+			work_.wait_until(lck, wakeup);
+		}
+	}
+	return nullptr;
+}
+
+// run runs the claimed task of e on the calling thread, without mtx_.
+void SharedExecutor::Impl::run(Entry &e) {
+	auto outer = current(); // the waiting task, if helping
+	current() = &e;
+	e.source->RunOne();
+	current() = outer;
+}
+
+// finish counts the task of e as done. The caller holds mtx_.
+void SharedExecutor::Impl::finish(Entry &e) {
+	if (--e.running == 0 && e.detaching) {
+		detached_.notify_all();
+	}
+	if (e.running + 1 >= e.cap && e.source->Pending() > 0) {
+		work_.notify_one(); // the source was at its cap
+	}
+}
+
+// runOne runs a task of any source for a waiting task. It returns false if
+// there was none.
+bool SharedExecutor::Impl::runOne() {
+	unique_lock<mutex> lck(mtx_);
+	auto e = next(lck, false, true);
+	if (e == nullptr) {
+		return false;
+	}
+	lck.unlock();
+	run(*e);
+	lck.lock();
+	finish(*e);
+	return true;
+}
+
+// loop finishes each task and picks the next one under the same lock, so a
+// thread takes mtx_ once per task.
+void SharedExecutor::Impl::loop() {
+	HelpHook::Current() = &helper_;
+	unique_lock<mutex> lck(mtx_);
+	while (auto e = next(lck, true, false)) {
+		lck.unlock();
+		run(*e);
+		lck.lock();
+		finish(*e);
+	}
+	lck.unlock();
+	HelpHook::Current() = nullptr;
+}
+
+SharedExecutor::SharedExecutor(shared_ptr<ThreadFactory> factory, uint32_t threads) {
+	impl_ = std::make_unique<Impl>(factory, threads);
+}
+
+SharedExecutor::~SharedExecutor() {}
+
+SharedExecutor& SharedExecutor::Global() {
+	static SharedExecutor executor(make_shared<StdThreadFactory>(), NumCores());
+	return executor;
+}
+
+uint32_t SharedExecutor::Threads() const {
+	return impl_->Threads();
+}
+
+void SharedExecutor::Attach(Source *s, int priority, uint32_t cap, shared_ptr<RateLimiter> rl) {
+	impl_->Attach(s, priority, cap, rl);
+}
+
+void SharedExecutor::Detach(Source *s) {
+	impl_->Detach(s);
+}
+
+void SharedExecutor::Notify(Source *s) {
+	impl_->Notify(s);
+}
@@ -0,0 +1,250 @@
+//
+// sharedexecutor.h
+//
+// Define SharedExecutor, a set of threads shared by several logical pools,
+// and LogicalPool, a ThreadPool that runs its tasks on a SharedExecutor.
+//
+
+#ifndef __SHAREDEXECUTOR_H_
+#define __SHAREDEXECUTOR_H_
+
+#include <memory>
+#include <atomic>
+
+#include "def.h"
+#include "thread.h"
+#include "threadpool.h"
+#include "threadpool_impl.h"
+#include "ratelimiter.h"
+
+// SharedExecutor runs the tasks of any number of sources, e.g. LogicalPools,
+// on a fixed set of threads, so that pools owned by different libraries do
+// not each bring their own threads and together oversubscribe the cores.
+//
+// Each thread picks the source to take a task from: sources of higher
+// priority go first, sources of the same priority take turns. A source is
+// skipped while it runs as many tasks as its cap, or while its rate limiter
+// has no token; a waiting source never holds a thread.
+//
+// A task that waits for others in a TaskGroup runs pending tasks of any
+// source meanwhile, so nested fan-out does not need more threads either. Its
+// slot is only lent to its own source: other sources stay within their cap.
+class SharedExecutor {
+	public:
+		// Source is a queue of tasks run by the executor.
+		class Source {
+			public:
+				virtual ~Source() {}
+				// Pending returns the approximate number of queued tasks.
+				virtual uint32_t Pending() const = 0;
+				// Claim sets a queued task aside for a later RunOne, so that
+				// no rate token is spent on a task another thread takes. It
+				// returns false if every queued task is claimed already.
+				virtual bool Claim() = 0;
+				// Unclaim gives back a claim that will not be run.
+				virtual void Unclaim() = 0;
+				// RunOne takes a claimed task and runs it on the calling
+				// thread. It returns false if there was none, e.g. because it
+				// was cancelled.
+				virtual bool RunOne() = 0;
+		};
+
+		// The executor starts threads threads through factory, one per core
+		// by default.
+		explicit SharedExecutor(std::shared_ptr<ThreadFactory> factory, uint32_t threads = NumCores());
+		SharedExecutor(const SharedExecutor&) = delete;
+		SharedExecutor& operator=(const SharedExecutor&) = delete;
+		// All sources must be detached before the executor is destroyed.
+		~SharedExecutor();
+
+		// Global returns the executor of the process, with one thread per
+		// core, created on first use.
+		static SharedExecutor& Global();
+
+		uint32_t Threads() const;
+
+		// Attach makes the executor run the tasks of s. At most cap tasks of
+		// s run at a time, all threads if 0. rl, if set, is asked for a
+		// token before each task.
+		void Attach(Source *s, int priority, uint32_t cap, std::shared_ptr<RateLimiter> rl = nullptr);
+		// Detach stops taking tasks from s and waits for its running tasks.
+		void Detach(Source *s);
+		// Notify tells the executor that s has new tasks.
+		void Notify(Source *s);
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl> impl_;
+};
+
+// LogicalPool is a ThreadPool without threads of its own: it keeps its own
+// queue, priority, rate limiter and concurrency cap, and runs its tasks on a
+// SharedExecutor. The priority ranks the pool against the other pools of
+// the executor; the priority of a task ranks it within the queue of the pool,
+// for queues that order by priority.
+template<class Container = Channel<Task>>
+class LogicalPool : public ThreadPool, public SharedExecutor::Source {
+	public:
+		LogicalPool(SharedExecutor &executor, uint32_t maxTasks, int priority = 0, uint32_t cap = 0,
+				std::shared_ptr<RateLimiter> rl = nullptr) :
+			executor_(executor),
+			tasks_(maxTasks),
+			priority_(priority),
+			cap_(cap),
+			ratelimiter_(rl),
+			claimed_(0),
+			status_(Status::STOPPED) {
+			registry_ = std::make_shared<TaskRegistry>(
+				[this](TaskHandle *h, const std::function<bool()> &claim) {
+					return tasks_.Discard(h->Owner(), h, claim);
+				},
+				[this] { inflight_.Done(); });
+		}
+		LogicalPool(const LogicalPool&) = delete;
+		LogicalPool& operator=(const LogicalPool&) = delete;
+		virtual ~LogicalPool() {
+			Stop();
+			registry_->Detach();
+		}
+
+		virtual void Start() override {
+			auto s = Status::STOPPED;
+			if (!status_.compare_exchange_strong(s, Status::STARTING, std::memory_order_acq_rel)) {
+				return;
+			}
+			tasks_.Reopen();
+			if (ratelimiter_ != nullptr) {
+				ratelimiter_->Start();
+			}
+			executor_.Attach(this, priority_, cap_, ratelimiter_);
+			status_.store(Status::RUNNING, std::memory_order_release);
+		}
+
+		// Stop stops accepting tasks and returns once the queued tasks have
+		// run.
+		virtual void Stop() override {
+			auto s = Status::RUNNING;
+			if (!status_.compare_exchange_strong(s, Status::STOPPING, std::memory_order_acq_rel)) {
+				return;
+			}
+			tasks_.Close();
+			inflight_.Wait(-1);
+			executor_.Detach(this);
+			if (ratelimiter_ != nullptr) {
+				ratelimiter_->Stop();
+			}
+			status_.store(Status::STOPPED, std::memory_order_release);
+		}
+
+		// StopNow waits for the running tasks and cancels the queued ones.
+		virtual void StopNow() override {
+			auto s = Status::RUNNING;
+			if (!status_.compare_exchange_strong(s, Status::STOPPING, std::memory_order_acq_rel)) {
+				return;
+			}
+			tasks_.Close();
+			executor_.Detach(this);
+			if (ratelimiter_ != nullptr) {
+				ratelimiter_->Stop();
+			}
+			Task t;
+			while (tasks_.Get(t, 0)) {
+				t.Finish(TaskHandle::Status::CANCELLED);
+				inflight_.Done();
+			}
+			status_.store(Status::STOPPED, std::memory_order_release);
+		}
+
+		virtual bool Post(const std::shared_ptr<Runnable> &task, int64_t timeout = -1, int64_t expiration = 0, int priority = 0) override {
+			if (status_.load(std::memory_order_acquire) != Status::RUNNING) {
+				return false;
+			}
+			return put(Task(task, expiration, priority), timeout);
+		}
+
+		virtual std::shared_ptr<TaskHandle> Submit(const std::shared_ptr<Runnable> &task, int64_t timeout = -1, int64_t expiration = 0, int priority = 0, uint64_t group = 0) override {
+			if (status_.load(std::memory_order_acquire) != Status::RUNNING) {
+				return nullptr;
+			}
+			auto h = std::make_shared<TaskHandle>(registry_, group);
+			if (!put(Task(task, expiration, priority, h), timeout)) {
+				return nullptr;
+			}
+			registry_->Add(h);
+			return h;
+		}
+
+		virtual size_t CancelGroup(uint64_t group) override {
+			return registry_->CancelGroup(group);
+		}
+
+		// WaitIdle blocks until every task accepted so far has finished; see
+		// ThreadPoolImpl::WaitIdle().
+		bool WaitIdle(int64_t timeout = -1) {
+			return inflight_.Wait(timeout);
+		}
+
+		virtual uint32_t Pending() const override {
+			return tasks_.Size();
+		}
+
+		virtual bool Claim() override {
+			auto c = claimed_.load(std::memory_order_acquire);
+			while (tasks_.Size() > c) {
+				if (claimed_.compare_exchange_weak(c, c + 1, std::memory_order_acq_rel)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		virtual void Unclaim() override {
+			claimed_.fetch_sub(1, std::memory_order_release);
+		}
+
+		virtual bool RunOne() override {
+			Task task;
+			bool got = tasks_.Get(task, 0);
+			Unclaim();
+			if (!got) {
+				return false;
+			}
+			InFlight::Guard done(&inflight_);
+			if (task.IsExpired()) {
+				task.Finish(TaskHandle::Status::EXPIRED);
+				return true;
+			}
+			task.Inner()->Run();
+			task.Finish(TaskHandle::Status::DONE);
+			return true;
+		}
+
+	private:
+		SharedExecutor &executor_;
+		Container tasks_;
+		const int priority_;
+		const uint32_t cap_;
+		std::shared_ptr<RateLimiter> ratelimiter_;
+		std::shared_ptr<TaskRegistry> registry_;
+		InFlight inflight_;
+		std::atomic<uint32_t> claimed_; // queued tasks picked for a RunOne
+
+		// See ThreadPoolImpl.
+		enum class Status { STOPPED, STARTING, RUNNING, STOPPING};
+		std::atomic<Status> status_;
+
+		bool put(const Task &t, int64_t timeout) {
+			inflight_.Add();
+			if (!tasks_.Put(t, timeout)) {
+				inflight_.Done();
+				return false;
+			}
+			executor_.Notify(this);
+			return true;
+		}
+};
+
+using LogicalFifoPool = LogicalPool<Channel<Task>>;
+using LogicalPriPool = LogicalPool<Channel<Task, AgingPriQueue<Task>>>;
+
+#endif // __SHAREDEXECUTOR_H_
@@ -0,0 +1,217 @@
+#include "shmtokenbucket.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <system_error>
+#include <algorithm>
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+		"shared memory atomics must be lock-free to be address-free");
+
+// Layout of the shared memory segment. A new segment is zero-filled, which
+// reads as not ready.
+struct shmBucket {
+	atomic<uint32_t> init;      // kReady once initialized
+	atomic<uint64_t> interval;  // nanoseconds per token
+	atomic<uint64_t> burst;     // in tokens
+	atomic<int64_t> tat;        // theoretical arrival time, CLOCK_MONOTONIC ns
+	atomic<uint32_t> rate;      // tokens per second, as set
+};
+
+const uint32_t kReady = 2;
+
+const int64_t ONE_BILLION = 1000000000;
+
+// CLOCK_MONOTONIC is system-wide, so all processes share the time base.
+inline int64_t monotonicNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * ONE_BILLION + ts.tv_nsec;
+}
+
+class ShmTokenBucket::Impl {
+	public:
+		Impl(const string &name, uint32_t rate, uint32_t burst);
+		~Impl();
+		void Start();
+		void Stop();
+		uint32_t GetRate();
+		void SetRate(uint32_t rate);
+		bool GetTokens(uint32_t n, int64_t timeout);
+
+	private:
+		shmBucket *bucket_;
+		atomic<bool> stop_;
+
+		int initialize(int fd, uint32_t rate, uint32_t burst);
+};
+
+ShmTokenBucket::Impl::Impl(const string &name, uint32_t rate, uint32_t burst) :
+	bucket_(nullptr),
+	stop_(true) {
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		throw system_error(errno, generic_category(), "shm_open " + name);
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || 
+			(st.st_size < (off_t)sizeof(shmBucket) && ftruncate(fd, sizeof(shmBucket)) < 0)) {
+		int err = errno;
+		close(fd);
+		throw system_error(err, generic_category(), "ftruncate " + name);
+	}
+	void *p = mmap(nullptr, sizeof(shmBucket), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		int err = errno;
+		close(fd);
+		throw system_error(err, generic_category(), "mmap " + name);
+	}
+	bucket_ = static_cast<shmBucket*>(p);
+	int err = initialize(fd, rate, burst);
+	close(fd);
+	if (err != 0) {
+		munmap(bucket_, sizeof(shmBucket));
+		throw system_error(err, generic_category(), "flock " + name);
+	}
+}
+
+ShmTokenBucket::Impl::~Impl() {
+	munmap(bucket_, sizeof(shmBucket));
+}
+
+// initialize sets up a new segment, or waits for another process to do so,
+// and returns 0 or an errno. Processes initialize under an flock(2) of the
+// segment, which goes away with its holder: a process that dies while
+// initializing leaves the segment not ready, and the next one starts over.
+int ShmTokenBucket::Impl::initialize(int fd, uint32_t rate, uint32_t burst) {
+	if (bucket_->init.load(memory_order_acquire) == kReady) {
+		return 0;
+	}
+	if (rate == 0) {
+		rate = 1;
+	}
+	if (burst == 0) {
+		burst = rate;
+	}
+	while (flock(fd, LOCK_EX) < 0) {
+		if (errno != EINTR) {
+			return errno;
+		}
+	}
+	if (bucket_->init.load(memory_order_acquire) != kReady) {
+		bucket_->interval.store(ONE_BILLION / rate);
+		bucket_->rate.store(rate);
+		bucket_->burst.store(burst);
+		bucket_->tat.store(monotonicNow());
+		bucket_->init.store(kReady, memory_order_release);
+	}
+	flock(fd, LOCK_UN);
+	return 0;
+}
+
+void ShmTokenBucket::Impl::Start() {
+	stop_ = false;
+}
+
+void ShmTokenBucket::Impl::Stop() {
+	stop_ = true;
+}
+
+// GetRate returns the rate as set. The interval is whole nanoseconds, so
+// the rate enforced may be slightly higher.
+uint32_t ShmTokenBucket::Impl::GetRate() {
+	uint32_t rate = bucket_->rate.load();
+	if (rate == 0) { // made by an older build, which did not keep the rate
+		uint64_t interval = bucket_->interval.load();
+		rate = (ONE_BILLION + interval / 2) / interval;
+	}
+	return rate;
+}
+
+void ShmTokenBucket::Impl::SetRate(uint32_t rate) {
+	rate = max<uint32_t>(rate, 1);
+	bucket_->interval.store(ONE_BILLION / rate);
+	bucket_->rate.store(rate);
+}
+
+// GetTokens implements GCRA: each token pushes the theoretical arrival time
+// (tat) one interval into the future, and a request is allowed as long as
+// the tat stays within one burst of now.
+bool ShmTokenBucket::Impl::GetTokens(uint32_t n, int64_t timeout) {
+	if (stop_) {
+		return false;
+	}
+	int64_t interval = bucket_->interval.load(memory_order_relaxed);
+	int64_t limit = interval * bucket_->burst.load(memory_order_relaxed);
+	int64_t cost = interval * n;
+	if (cost > limit) {
+		return false;
+	}
+	int64_t now = monotonicNow();
+	int64_t deadline = now + timeout * 1000000;
+	int64_t tat = bucket_->tat.load(memory_order_relaxed);
+	while (!stop_) {
+		int64_t next = max(tat, now) + cost;
+		int64_t wait = next - now - limit;
+		if (wait <= 0) {
+			if (bucket_->tat.compare_exchange_weak(tat, next, memory_order_acq_rel)) {
+				return true;
+			}
+			now = monotonicNow();
+			continue; // tat has been reloaded
+		}
+		if (timeout == 0 || (timeout > 0 && now + wait > deadline)) {
+			return false;
+		}
+		this_thread::sleep_for(chrono::nanoseconds(wait));
+		now = monotonicNow();
+		tat = bucket_->tat.load(memory_order_relaxed);
+	}
+	return false;
+}
+
+
+ShmTokenBucket::ShmTokenBucket(const string &name, uint32_t rate, uint32_t burst) {
+	impl_ = std::make_unique<Impl>(name, rate, burst);
+}
+
+ShmTokenBucket::~ShmTokenBucket() {}
+
+void ShmTokenBucket::Start() {
+	impl_->Start();
+}
+
+void ShmTokenBucket::Stop() {
+	impl_->Stop();
+}
+
+uint32_t ShmTokenBucket::GetRate() {
+	return impl_->GetRate();
+}
+
+void ShmTokenBucket::SetRate(uint32_t rate) {
+	impl_->SetRate(rate);
+}
+
+bool ShmTokenBucket::GetToken(int64_t timeout) {
+	return impl_->GetTokens(1, timeout);
+}
+
+bool ShmTokenBucket::GetTokens(uint32_t n, int64_t timeout) {
+	return impl_->GetTokens(n, timeout);
+}
+
+void ShmTokenBucket::Unlink(const string &name) {
+	shm_unlink(name.c_str());
+}
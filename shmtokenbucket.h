@@ -0,0 +1,54 @@
+#ifndef __SHMTOKENBUCKET_H_
+#define __SHMTOKENBUCKET_H_
+
+#include "ratelimiter.h"
+
+#include <memory>
+#include <string>
+
+// ShmTokenBucket implements the RateLimiter interface with a token bucket
+// shared by all processes on a host that open the same name. The state lives
+// in a POSIX shared memory segment and is a single atomic word updated with
+// the generic cell rate algorithm (GCRA), so no lock is held while taking
+// tokens and a process dying at any point cannot leave the bucket
+// inconsistent. Only the first initialization of the segment takes a lock.
+//
+// The first process to open a name sets its rate and burst; later processes
+// join the existing bucket and ignore their own settings, unless they call
+// SetRate(). The bucket starts full. The segment outlives the processes;
+// call Unlink() to remove it.
+class ShmTokenBucket : public RateLimiter {
+	public:
+		// name must start with '/', see shm_open(3). burst == 0 sizes the
+		// bucket to one second worth of tokens. Throws std::system_error if
+		// the segment cannot be opened, mapped or locked.
+		ShmTokenBucket(const std::string &name, uint32_t rate, uint32_t burst = 0);
+		ShmTokenBucket(const ShmTokenBucket&) = delete;
+		ShmTokenBucket(ShmTokenBucket&&) = delete;
+		ShmTokenBucket& operator=(const ShmTokenBucket&) = delete;
+		ShmTokenBucket& operator=(ShmTokenBucket&&) = delete;
+		~ShmTokenBucket();
+
+		virtual void Start() override;
+		virtual void Stop() override;
+		virtual uint32_t GetRate() override;
+
+		// SetRate changes the rate for all processes sharing the bucket.
+		void SetRate(uint32_t rate);
+
+		// See TokenBucket::GetToken().
+		virtual bool GetToken(int64_t timeout = -1) override;
+
+		// GetTokens takes n tokens at once. It fails immediately if n exceeds
+		// the burst size.
+		bool GetTokens(uint32_t n, int64_t timeout = -1);
+
+		// Unlink removes the shared memory segment of the given name.
+		static void Unlink(const std::string &name);
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl> impl_;
+};
+
+#endif // __SHMTOKENBUCKET_H_
@@ -0,0 +1,239 @@
+//
+// Implement a bounded Channel that spills its overflow to disk.
+//
+
+#ifndef __SPILLCHANNEL_H_
+#define __SPILLCHANNEL_H_
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <type_traits>
+#include <cstring>
+
+#include "channel.h"
+#include "spilllog.h"
+
+// SpillTraits converts items to and from the bytes kept on disk. The default
+// copies trivially copyable types; specialize it for other item types.
+template<class T>
+struct SpillTraits {
+	static void Write(const T &t, std::string &out) {
+		static_assert(std::is_trivially_copyable<T>::value,
+				"specialize SpillTraits for items that are not trivially copyable");
+		out.assign(reinterpret_cast<const char*>(&t), sizeof(T));
+	}
+	// Read returns false if data does not hold an item; the record is
+	// dropped.
+	static bool Read(const char *data, uint32_t n, T &t) {
+		if (n != sizeof(T)) {
+			return false;
+		}
+		memcpy(&t, data, n);
+		return true;
+	}
+};
+
+template<>
+struct SpillTraits<std::string> {
+	static void Write(const std::string &t, std::string &out) {
+		out = t;
+	}
+	static bool Read(const char *data, uint32_t n, std::string &t) {
+		t.assign(data, n);
+		return true;
+	}
+};
+
+// SpillChannel is a Channel of sz items in memory that does not turn
+// producers away when it is full: further items are appended to a SpillLog
+// in dir, and paged back in as consumers free space. Items are spilled in
+// order, and once anything is on disk every new item goes there as well, so
+// FIFO order holds across memory and disk. With a priority container the
+// order is that of the container over the items in memory, which the spilled
+// items enter in the order they were spilled.
+//
+// Put() only waits, or fails, if the disk cap set with SetMaxSegments() is
+// reached. Items on disk are not bound to the channel until they are paged
+// in, so Discard() cannot reach them before. If recover is true, the items
+// left on disk by an earlier SpillChannel on dir are taken over; see
+// SpillLog.
+template<class T, class Container = RingQueue<T>>
+class SpillChannel {
+	public:
+		static const bool kFeedback = Channel<T, Container>::kFeedback;
+
+		SpillChannel(uint32_t sz, const std::string &dir, bool recover = false,
+				uint64_t segmentSize = SpillLog::kDefaultSegment) :
+			limit_(sz),
+			mem_(sz),
+			log_(dir, segmentSize, recover),
+			closed_(false),
+			spilled_(log_.Count()) {
+			std::lock_guard<std::mutex> lck(mtx_);
+			pageIn();
+		}
+		// Disallow copy or assignment
+		SpillChannel(const SpillChannel&) = delete;
+		SpillChannel(SpillChannel&&) = delete;
+		SpillChannel& operator=(const SpillChannel&) = delete;
+		SpillChannel& operator=(SpillChannel&&) = delete;
+		~SpillChannel() {}
+
+		// Close rejects further items. Consumers return once both the items
+		// in memory and on disk have been taken.
+		void Close() {
+			std::lock_guard<std::mutex> lck(mtx_);
+			closed_ = true;
+			space_.notify_all();
+			if (spilled_ == 0) {
+				mem_.Close();
+			} // else by pageIn(), once the disk is drained
+		}
+
+		// See Channel::Reopen().
+		void Reopen() {
+			std::lock_guard<std::mutex> lck(mtx_);
+			closed_ = false;
+			mem_.Reopen();
+		}
+
+		// See Channel::Get().
+		T Get(int64_t timeout) {
+			T item;
+			Get(item, timeout);
+			return item;
+		}
+
+		// See Channel::Get(). While items are on disk, memory stays full, so
+		// consumers only block when both are empty.
+		bool Get(T &item, int64_t timeout) {
+			if (!mem_.Get(item, timeout)) {
+				return false;
+			}
+			if (spilled_ > 0) {
+				std::lock_guard<std::mutex> lck(mtx_);
+				pageIn();
+			}
+			return true;
+		}
+
+		// See Channel::Put(). An item that does not fit in memory is written
+		// to disk; timeout only applies while the disk is at its cap.
+		bool Put(const T &t, int64_t timeout) {
+			if (spilled_ == 0 && !closed_ && mem_.Put(t, 0)) {
+				return true;
+			}
+			std::string buf;
+			SpillTraits<T>::Write(t, buf);
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+			std::unique_lock<std::mutex> lck(mtx_);
+			if (!log_.Fits(buf.size())) {
+				return false;
+			}
+			while (!closed_) {
+				if (spilled_ == 0 && mem_.Put(t, 0)) {
+					return true;
+				}
+				if (log_.Append(buf.data(), buf.size())) {
+					++spilled_;
+					pageIn(); // consumers may have made room meanwhile
+					return true;
+				}
+				if (timeout == 0) {
+					break;
+				}
+				if (timeout < 0) {
+					space_.wait(lck);
+				} else if (space_.wait_until(lck, deadline) == std::cv_status::timeout) {
+					timeout = 0; // one last try
+				}
+			}
+			return false;
+		}
+
+		// See Channel::Discard(). Only items in memory can be discarded.
+		template<class F>
+		bool Discard(const void *owner, const void *key, F claim) {
+			if (!mem_.Discard(owner, key, claim)) {
+				return false;
+			}
+			if (spilled_ > 0) {
+				std::lock_guard<std::mutex> lck(mtx_);
+				pageIn();
+			}
+			return true;
+		}
+
+		// See Channel::Complete().
+		void Complete(const T &item, int64_t cost) {
+			mem_.Complete(item, cost);
+		}
+
+		// See Channel::Visit(); f sees the items in memory only.
+		template<class F>
+		void Visit(F f) {
+			mem_.Visit(f);
+		}
+
+		// Size returns the approximate number of items in memory and on disk.
+		uint32_t Size() const {
+			return mem_.Size() + static_cast<uint32_t>(spilled_.load(std::memory_order_relaxed));
+		}
+
+		// Spilled returns the number of items on disk.
+		uint64_t Spilled() const {
+			return spilled_.load(std::memory_order_relaxed);
+		}
+
+		// See SpillLog::SetMaxSegments().
+		void SetMaxSegments(uint32_t n) {
+			std::lock_guard<std::mutex> lck(mtx_);
+			log_.SetMaxSegments(n);
+		}
+
+		// See SpillLog::SetWindow().
+		void SetWindow(uint64_t bytes) {
+			std::lock_guard<std::mutex> lck(mtx_);
+			log_.SetWindow(bytes);
+		}
+
+	private:
+		const uint32_t limit_;
+		Channel<T, Container> mem_;
+		std::mutex mtx_; // serializes the disk side, taken before mem_'s lock
+		std::condition_variable space_; // producers waiting for the disk cap
+		SpillLog log_;
+		std::atomic<bool> closed_;
+		std::atomic<uint64_t> spilled_;
+
+		// pageIn moves items from disk to memory while there is room. The
+		// caller holds mtx_.
+		void pageIn() {
+			bool popped = false;
+			while (spilled_ > 0 && mem_.Size() < limit_) {
+				const char *data;
+				uint32_t n;
+				if (!log_.Front(data, n)) {
+					break;
+				}
+				T item;
+				if (SpillTraits<T>::Read(data, n, item) && !mem_.Put(item, 0)) {
+					break; // full after all, or closed
+				}
+				log_.Pop();
+				--spilled_;
+				popped = true;
+			}
+			if (popped) {
+				space_.notify_all();
+			}
+			if (closed_ && spilled_ == 0) {
+				mem_.Close();
+			}
+		}
+};
+
+#endif // __SPILLCHANNEL_H_
@@ -0,0 +1,512 @@
+#include "spilllog.h"
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <system_error>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// A segment file starts with a segmentHeader, padded to kHeaderSize, and is
+// followed by records, each a recordHeader and the data, padded to kAlign.
+// A zero length marks the end of the records; it is written after every
+// record, so that stale bytes of a reused segment are never read as records.
+struct segmentHeader {
+	uint64_t magic;
+	uint64_t seq;
+	uint64_t readOff; // offset of the first unread record
+};
+
+struct recordHeader {
+	uint32_t len;
+	uint32_t sum;
+};
+
+const uint64_t kMagic = 0x31474f4c4c495053ULL; // "SPILLOG1"
+const uint64_t kHeaderSize = 64;
+const uint64_t kAlign = 8;
+const uint64_t kDefaultWindow = 1024 * 1024;
+
+inline uint64_t alignUp(uint64_t n, uint64_t a) {
+	return (n + a - 1) & ~(a - 1);
+}
+
+inline uint64_t alignDown(uint64_t n, uint64_t a) {
+	return n & ~(a - 1);
+}
+
+// checksum is FNV-1a over the data, to tell records cut short by a crash.
+inline uint32_t checksum(const char *p, uint32_t n) {
+	uint32_t h = 2166136261u;
+	for (uint32_t i = 0; i < n; ++i) {
+		h = (h ^ static_cast<uint8_t>(p[i])) * 16777619u;
+	}
+	return h;
+}
+
+class SpillLog::Impl {
+	public:
+		Impl(const string &dir, uint64_t segmentSize, bool recover);
+		~Impl();
+		bool Append(const void *data, uint32_t n);
+		bool Fits(uint32_t n) const;
+		bool Front(const char *&data, uint32_t &n);
+		void Pop();
+		uint64_t Count() const {
+			return count_;
+		}
+		uint32_t Segments() const {
+			return segs_.size();
+		}
+		void SetMaxSegments(uint32_t n) {
+			maxSegments_ = n;
+		}
+		void SetKeepFree(uint32_t n);
+		void SetWindow(uint64_t bytes) {
+			window_ = max<uint64_t>(alignUp(bytes, page_), page_);
+		}
+
+	private:
+		struct segment {
+			uint64_t seq;
+			int fd;
+			char *base; // nullptr unless mapped
+		};
+
+		string dir_;
+		uint64_t size_;
+		uint64_t page_;
+		uint64_t window_;
+		uint32_t maxSegments_;
+		uint32_t keepFree_;
+		deque<segment> segs_;  // the reader is on the front, the writer on the back
+		vector<segment> free_; // read segments kept for reuse, not mapped
+		uint64_t nextSeq_;
+		uint64_t count_;
+		uint64_t readOff_;     // in the front segment
+		uint64_t writeOff_;    // in the back segment
+		uint64_t advised_;     // end of the pages prefetched for the reader
+		uint64_t readDropped_; // pages before are released by the reader
+		uint64_t writeDropped_;
+
+		string path(uint64_t seq) const;
+		void map(segment &s);
+		void unmap(segment &s);
+		void release(segment &s);
+		bool addSegment();
+		void rewind();
+		void nextReadSegment();
+		void prefetch();
+		uint64_t scan(segment &s, uint64_t off, uint64_t &n);
+		void recoverSegments();
+		void removeSegments();
+
+		segmentHeader* header(const segment &s) {
+			return reinterpret_cast<segmentHeader*>(s.base);
+		}
+		recordHeader* record(const segment &s, uint64_t off) {
+			return reinterpret_cast<recordHeader*>(s.base + off);
+		}
+		// dontNeed releases the whole pages of [from, to) in s.
+		void dontNeed(const segment &s, uint64_t from, uint64_t to) {
+			from = alignUp(from, page_);
+			to = alignDown(to, page_);
+			if (s.base != nullptr && from < to) {
+				madvise(s.base + from, to - from, MADV_DONTNEED);
+			}
+		}
+};
+
+SpillLog::Impl::Impl(const string &dir, uint64_t segmentSize, bool recover) :
+	dir_(dir),
+	page_(sysconf(_SC_PAGESIZE)),
+	window_(kDefaultWindow),
+	maxSegments_(0),
+	keepFree_(2),
+	nextSeq_(0),
+	count_(0),
+	readOff_(kHeaderSize),
+	writeOff_(kHeaderSize),
+	advised_(0),
+	readDropped_(0),
+	writeDropped_(0) {
+	size_ = max(alignUp(segmentSize, page_), 2 * page_);
+	if (recover) {
+		recoverSegments();
+	} else {
+		removeSegments();
+	}
+}
+
+SpillLog::Impl::~Impl() {
+	bool keep = count_ > 0;
+	for (auto &s : segs_) {
+		unmap(s);
+		close(s.fd);
+		if (!keep) {
+			unlink(path(s.seq).c_str());
+		}
+	}
+	for (auto &s : free_) {
+		close(s.fd);
+		unlink(path(s.seq).c_str());
+	}
+}
+
+string SpillLog::Impl::path(uint64_t seq) const {
+	char name[32];
+	snprintf(name, sizeof(name), "spill-%016llx.log", static_cast<unsigned long long>(seq));
+	return dir_ + "/" + name;
+}
+
+void SpillLog::Impl::map(segment &s) {
+	if (s.base != nullptr) {
+		return;
+	}
+	void *p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, s.fd, 0);
+	if (p == MAP_FAILED) {
+		throw system_error(errno, generic_category(), "mmap " + path(s.seq));
+	}
+	s.base = static_cast<char*>(p);
+	madvise(s.base, size_, MADV_SEQUENTIAL);
+}
+
+void SpillLog::Impl::unmap(segment &s) {
+	if (s.base != nullptr) {
+		munmap(s.base, size_);
+		s.base = nullptr;
+	}
+}
+
+// release recycles or removes a segment that has been read through.
+void SpillLog::Impl::release(segment &s) {
+	unmap(s);
+	if (free_.size() < keepFree_) {
+		free_.push_back(s);
+	} else {
+		close(s.fd);
+		unlink(path(s.seq).c_str());
+	}
+}
+
+void SpillLog::Impl::SetKeepFree(uint32_t n) {
+	keepFree_ = n;
+	while (free_.size() > keepFree_) {
+		close(free_.back().fd);
+		unlink(path(free_.back().seq).c_str());
+		free_.pop_back();
+	}
+}
+
+// addSegment starts a new segment for the writer, reusing a free one if
+// there is any.
+bool SpillLog::Impl::addSegment() {
+	segment s = {nextSeq_, -1, nullptr};
+	if (!free_.empty()) {
+		auto old = free_.back();
+		if (rename(path(old.seq).c_str(), path(s.seq).c_str()) == 0) {
+			free_.pop_back();
+			s.fd = old.fd;
+		}
+	}
+	if (s.fd < 0) {
+		s.fd = open(path(s.seq).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (s.fd < 0) {
+			return false;
+		}
+		// Allocate the blocks now: a write fault on a full disk would
+		// raise SIGBUS.
+		if (posix_fallocate(s.fd, 0, size_) != 0) {
+			close(s.fd);
+			unlink(path(s.seq).c_str());
+			return false;
+		}
+	}
+	try {
+		map(s);
+	} catch (const system_error&) {
+		close(s.fd);
+		unlink(path(s.seq).c_str());
+		return false;
+	}
+	++nextSeq_;
+	auto h = header(s);
+	h->magic = kMagic;
+	h->seq = s.seq;
+	h->readOff = kHeaderSize;
+	record(s, kHeaderSize)->len = 0;
+
+	if (!segs_.empty()) {
+		auto &prev = segs_.back();
+		if (segs_.size() > 1) {
+			unmap(prev); // neither read nor written until it is the front
+		} else {
+			dontNeed(prev, writeDropped_, writeOff_);
+		}
+	}
+	segs_.push_back(s);
+	writeOff_ = kHeaderSize;
+	writeDropped_ = 0;
+	if (segs_.size() == 1) {
+		readOff_ = kHeaderSize;
+		advised_ = 0;
+		readDropped_ = 0;
+	}
+	return true;
+}
+
+// rewind starts over at the beginning of the writer's segment once every
+// record has been read, so that short spills keep using the same pages.
+void SpillLog::Impl::rewind() {
+	while (segs_.size() > 1) {
+		auto s = segs_.front();
+		segs_.pop_front();
+		release(s);
+	}
+	auto &s = segs_.back();
+	header(s)->readOff = kHeaderSize;
+	record(s, kHeaderSize)->len = 0;
+	readOff_ = writeOff_ = kHeaderSize;
+	advised_ = readDropped_ = writeDropped_ = 0;
+}
+
+bool SpillLog::Impl::Fits(uint32_t n) const {
+	return kHeaderSize + alignUp(sizeof(recordHeader) + n, kAlign) + sizeof(recordHeader) <= size_;
+}
+
+bool SpillLog::Impl::Append(const void *data, uint32_t n) {
+	if (!Fits(n)) {
+		return false;
+	}
+	if (count_ == 0 && !segs_.empty()) {
+		rewind();
+	}
+	uint64_t need = alignUp(sizeof(recordHeader) + n, kAlign);
+	if (segs_.empty() || writeOff_ + need + sizeof(recordHeader) > size_) {
+		if (maxSegments_ > 0 && segs_.size() >= maxSegments_) {
+			return false;
+		}
+		if (!addSegment()) {
+			return false;
+		}
+	}
+	auto &s = segs_.back();
+	auto r = record(s, writeOff_);
+	memcpy(s.base + writeOff_ + sizeof(recordHeader), data, n);
+	record(s, writeOff_ + need)->len = 0;
+	r->sum = checksum(static_cast<const char*>(data), n);
+	r->len = n;
+	writeOff_ += need;
+	++count_;
+	if (writeOff_ - writeDropped_ >= window_) {
+		// Dirty pages stay in the page cache and are written back from
+		// there; only the mapping is released.
+		dontNeed(s, writeDropped_, writeOff_);
+		writeDropped_ = alignDown(writeOff_, page_);
+	}
+	return true;
+}
+
+// nextReadSegment moves the reader to the next segment.
+void SpillLog::Impl::nextReadSegment() {
+	auto s = segs_.front();
+	segs_.pop_front();
+	release(s);
+	map(segs_.front());
+	readOff_ = header(segs_.front())->readOff;
+	advised_ = 0;
+	readDropped_ = 0;
+}
+
+// prefetch asks for the pages of the next window ahead of the reader once
+// the reader is half way through the previous one.
+void SpillLog::Impl::prefetch() {
+	if (readOff_ + window_ / 2 < advised_) {
+		return;
+	}
+	uint64_t from = alignDown(readOff_, page_);
+	uint64_t to = min(size_, from + window_);
+	if (segs_.size() == 1) {
+		to = min(to, alignUp(writeOff_, page_));
+	}
+	if (from < to) {
+		madvise(segs_.front().base + from, to - from, MADV_WILLNEED);
+	}
+	advised_ = to;
+}
+
+bool SpillLog::Impl::Front(const char *&data, uint32_t &n) {
+	if (count_ == 0) {
+		return false;
+	}
+	while (readOff_ + sizeof(recordHeader) > size_ || record(segs_.front(), readOff_)->len == 0) {
+		nextReadSegment(); // the writer has moved on
+	}
+	prefetch();
+	auto &s = segs_.front();
+	n = record(s, readOff_)->len;
+	data = s.base + readOff_ + sizeof(recordHeader);
+	return true;
+}
+
+void SpillLog::Impl::Pop() {
+	const char *data;
+	uint32_t n;
+	if (!Front(data, n)) {
+		return;
+	}
+	auto &s = segs_.front();
+	readOff_ += alignUp(sizeof(recordHeader) + n, kAlign);
+	header(s)->readOff = readOff_;
+	--count_;
+	if (readOff_ - readDropped_ >= window_) {
+		dontNeed(s, readDropped_, readOff_);
+		readDropped_ = alignDown(readOff_, page_);
+	}
+}
+
+// scan counts the intact records of s from off on into n, and returns the
+// offset after the last one.
+uint64_t SpillLog::Impl::scan(segment &s, uint64_t off, uint64_t &n) {
+	n = 0;
+	while (off + sizeof(recordHeader) <= size_) {
+		auto r = record(s, off);
+		uint64_t next = off + alignUp(sizeof(recordHeader) + r->len, kAlign);
+		if (r->len == 0 || next + sizeof(recordHeader) > size_ ||
+				checksum(s.base + off + sizeof(recordHeader), r->len) != r->sum) {
+			break;
+		}
+		off = next;
+		++n;
+	}
+	return off;
+}
+
+// recoverSegments takes over the segments left in dir_, oldest first.
+void SpillLog::Impl::recoverSegments() {
+	vector<uint64_t> seqs;
+	DIR *d = opendir(dir_.c_str());
+	if (d == nullptr) {
+		throw system_error(errno, generic_category(), "opendir " + dir_);
+	}
+	while (auto e = readdir(d)) {
+		unsigned long long seq;
+		char tail;
+		if (sscanf(e->d_name, "spill-%16llx.lo%c", &seq, &tail) == 2 && tail == 'g') {
+			seqs.push_back(seq);
+		}
+	}
+	closedir(d);
+	sort(seqs.begin(), seqs.end());
+
+	for (auto seq : seqs) {
+		segment s = {seq, open(path(seq).c_str(), O_RDWR), nullptr};
+		if (s.fd < 0) {
+			throw system_error(errno, generic_category(), "open " + path(seq));
+		}
+		struct stat st;
+		if (fstat(s.fd, &st) < 0 || static_cast<uint64_t>(st.st_size) != size_) {
+			close(s.fd);
+			continue;
+		}
+		map(s);
+		auto h = header(s);
+		uint64_t n = 0;
+		uint64_t end = 0;
+		if (h->magic == kMagic && h->seq == seq && h->readOff >= kHeaderSize && h->readOff < size_) {
+			end = scan(s, h->readOff, n);
+		}
+		if (n == 0) {
+			release(s);
+			continue;
+		}
+		if (!segs_.empty()) {
+			// The end of an older segment is also cut short here: its
+			// writer had moved on.
+			record(segs_.back(), writeOff_)->len = 0;
+			if (segs_.size() > 1) {
+				unmap(segs_.back());
+			}
+		}
+		segs_.push_back(s);
+		count_ += n;
+		writeOff_ = end;
+		record(s, end)->len = 0; // cut off a torn record
+		nextSeq_ = seq + 1;
+	}
+	if (!segs_.empty()) {
+		readOff_ = header(segs_.front())->readOff;
+	}
+	if (!seqs.empty()) {
+		nextSeq_ = seqs.back() + 1; // do not reuse the name of an ignored file
+	}
+}
+
+// removeSegments removes the segment files left in dir_.
+void SpillLog::Impl::removeSegments() {
+	DIR *d = opendir(dir_.c_str());
+	if (d == nullptr) {
+		throw system_error(errno, generic_category(), "opendir " + dir_);
+	}
+	while (auto e = readdir(d)) {
+		unsigned long long seq;
+		char tail;
+		if (sscanf(e->d_name, "spill-%16llx.lo%c", &seq, &tail) == 2 && tail == 'g') {
+			unlink(path(seq).c_str());
+		}
+	}
+	closedir(d);
+}
+
+
+SpillLog::SpillLog(const std::string &dir, uint64_t segmentSize, bool recover) {
+	impl_ = std::make_unique<Impl>(dir, segmentSize, recover);
+}
+
+SpillLog::~SpillLog() {}
+
+bool SpillLog::Append(const void *data, uint32_t n) {
+	return impl_->Append(data, n);
+}
+
+bool SpillLog::Fits(uint32_t n) const {
+	return impl_->Fits(n);
+}
+
+bool SpillLog::Front(const char *&data, uint32_t &n) {
+	return impl_->Front(data, n);
+}
+
+void SpillLog::Pop() {
+	impl_->Pop();
+}
+
+uint64_t SpillLog::Count() const {
+	return impl_->Count();
+}
+
+uint32_t SpillLog::Segments() const {
+	return impl_->Segments();
+}
+
+void SpillLog::SetMaxSegments(uint32_t n) {
+	impl_->SetMaxSegments(n);
+}
+
+void SpillLog::SetKeepFree(uint32_t n) {
+	impl_->SetKeepFree(n);
+}
+
+void SpillLog::SetWindow(uint64_t bytes) {
+	impl_->SetWindow(bytes);
+}
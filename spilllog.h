@@ -0,0 +1,81 @@
+//
+// spilllog.h
+//
+// Define SpillLog, an on-disk FIFO of records in memory-mapped segments.
+//
+
+#ifndef __SPILLLOG_H_
+#define __SPILLLOG_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// SpillLog appends opaque records to a log of fixed-size segment files in a
+// directory and hands them back in the same order. Only the segments being
+// written and read are mapped. Pages behind the writer and the reader are
+// released with madvise(MADV_DONTNEED), and pages ahead of the reader are
+// prefetched with MADV_WILLNEED, so memory use does not depend on how many
+// records are held on disk.
+//
+// Segment files are allocated on disk when created, so a full disk fails
+// Append() rather than a later page fault. A segment that has been read
+// through is kept for reuse, up to SetKeepFree() of them, and unlinked
+// otherwise. The read position is stored in the segment, so the records
+// still unread when the process ends can be recovered by the next SpillLog
+// opened on the directory. Not thread-safe.
+class SpillLog {
+	public:
+		static const uint64_t kDefaultSegment = 64 * 1024 * 1024;
+
+		// dir must exist. Unless recover is true, segment files left in dir
+		// by an earlier SpillLog are removed; otherwise their unread
+		// records are kept, and segments of another size are ignored.
+		// Throws std::system_error if a file cannot be created or mapped.
+		explicit SpillLog(const std::string &dir, uint64_t segmentSize = kDefaultSegment, bool recover = false);
+		SpillLog(const SpillLog&) = delete;
+		SpillLog& operator=(const SpillLog&) = delete;
+		// The files of an empty log are removed; those holding records are
+		// left for recovery.
+		~SpillLog();
+
+		// Append adds a record at the end. It fails if the record does not
+		// fit in a segment, if the log holds SetMaxSegments() segments
+		// already, or if a new segment cannot be created.
+		bool Append(const void *data, uint32_t n);
+
+		// Fits tells whether a record of n bytes can ever be appended.
+		bool Fits(uint32_t n) const;
+
+		// Front gives the first record in place; it stays valid until the
+		// next call to Pop() or Append(). It fails if the log is empty.
+		bool Front(const char *&data, uint32_t &n);
+
+		// Pop removes the first record.
+		void Pop();
+
+		uint64_t Count() const;
+		bool Empty() const {
+			return Count() == 0;
+		}
+
+		// Segments returns the number of segments holding records.
+		uint32_t Segments() const;
+
+		// SetMaxSegments caps the disk space of the log; 0 means no cap.
+		void SetMaxSegments(uint32_t n);
+
+		// SetKeepFree sets how many read segments are kept for reuse.
+		void SetKeepFree(uint32_t n);
+
+		// SetWindow sets how far ahead of the reader pages are prefetched,
+		// and how much the reader and writer pass over before releasing
+		// the pages behind them.
+		void SetWindow(uint64_t bytes);
+
+	private:
+		class Impl;
+		std::unique_ptr<Impl> impl_;
+};
+
+#endif // __SPILLLOG_H_
@@ -0,0 +1,82 @@
+//
+// Implement a bounded single-producer single-consumer ring buffer.
+//
+
+#ifndef __SPSCRING_H_
+#define __SPSCRING_H_
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+#include "def.h"
+
+// SpscRing is a lock-free queue for exactly one producer thread and one
+// consumer thread. The producer and consumer indices live on separate cache
+// lines, and each side caches the other's index so that it only touches the
+// shared line when the ring looks full (or empty).
+template<class T>
+class SpscRing {
+	public:
+		explicit SpscRing(uint32_t sz) : 
+			head_(0),
+			tailCache_(0),
+			tail_(0),
+			headCache_(0) {
+			uint32_t cap = 1;
+			while (cap < sz) {
+				cap <<= 1;
+			}
+			mask_ = cap - 1;
+			slots_.resize(cap);
+		}
+		SpscRing(const SpscRing&) = delete;
+		SpscRing& operator=(const SpscRing&) = delete;
+
+		// push is called by the producer only. It returns false if the ring is full.
+		bool push(const T &t) {
+			uint64_t tail = tail_.load(std::memory_order_relaxed);
+			if (tail - headCache_ > mask_) {
+				headCache_ = head_.load(std::memory_order_acquire);
+				if (tail - headCache_ > mask_) {
+					return false;
+				}
+			}
+			slots_[tail & mask_] = t;
+			tail_.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// pop is called by the consumer only. It returns false if the ring is empty.
+		bool pop(T &t) {
+			uint64_t head = head_.load(std::memory_order_relaxed);
+			if (head == tailCache_) {
+				tailCache_ = tail_.load(std::memory_order_acquire);
+				if (head == tailCache_) {
+					return false;
+				}
+			}
+			t = std::move(slots_[head & mask_]);
+			slots_[head & mask_] = T(); // release what the slot refers to
+			head_.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		// empty may be called from any thread; the result is only a hint.
+		bool empty() const {
+			return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+		}
+
+	private:
+		// consumer side
+		alignas(CACHELINE_SIZE) std::atomic<uint64_t> head_;
+		uint64_t tailCache_;
+		// producer side
+		alignas(CACHELINE_SIZE) std::atomic<uint64_t> tail_;
+		uint64_t headCache_;
+		// shared, read-only after construction
+		alignas(CACHELINE_SIZE) uint64_t mask_;
+		std::vector<T> slots_;
+};
+
+#endif // __SPSCRING_H_
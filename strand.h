@@ -0,0 +1,167 @@
+//
+// Implement strands: serial executors on top of a ThreadPool.
+//
+
+#ifndef __STRAND_H_
+#define __STRAND_H_
+
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+
+#include "def.h"
+#include "runnable.h"
+#include "threadpool.h"
+
+// StrandExecutor runs the tasks posted for the same key one at a time, in
+// the order they were posted, while tasks of different keys run in parallel
+// on the pool. Nothing blocks while a strand has work queued: a strand is a
+// queue of tasks plus a single runner task in the pool, which takes up to
+// 'batch' tasks from the queue before it posts itself again so that busy
+// strands do not monopolize workers. A strand exists only while it has
+// tasks, so idle keys take no memory. If the pool discards a runner
+// without running it, e.g. on StopNow() or when its queue manager sheds
+// it, the strand and its pending tasks are dropped with it, and the next
+// task of the key starts a new strand.
+template<class Key, class Hash = std::hash<Key>>
+class StrandExecutor {
+	public:
+		StrandExecutor(std::shared_ptr<ThreadPool> pool, uint32_t batch = 16, uint32_t shards = NUMCORES * 4) :
+			state_(std::make_shared<State>(pool, batch, shards)) {}
+		StrandExecutor(const StrandExecutor&) = delete;
+		StrandExecutor(StrandExecutor&&) = delete;
+		StrandExecutor& operator=(const StrandExecutor&) = delete;
+		StrandExecutor& operator=(StrandExecutor&&) = delete;
+
+		// Post queues task on the strand of key. timeout applies to posting
+		// the strand to the pool when it was idle, see ThreadPool::Post().
+		// It returns false if the pool did not accept the strand; tasks
+		// queued on the strand by others meanwhile are then run by the
+		// caller, as they were accepted.
+		bool Post(const Key &key, const std::shared_ptr<Runnable> &task, int64_t timeout = -1) {
+			auto &shard = state_->shard(key);
+			std::shared_ptr<Strand> s;
+			{
+				std::lock_guard<std::mutex> lck(shard.mtx);
+				auto it = shard.strands.find(key);
+				if (it != shard.strands.end()) {
+					// The runner of the strand will get to it.
+					it->second->tasks.push_back(task);
+					return true;
+				}
+				s = std::make_shared<Strand>();
+				s->tasks.push_back(task);
+				shard.strands.emplace(key, s);
+			}
+			auto r = std::make_shared<Runner>(state_, key, s);
+			if (state_->pool->Post(r, timeout)) {
+				return true;
+			}
+			{
+				// No runner has seen the strand, so task is still first.
+				std::lock_guard<std::mutex> lck(shard.mtx);
+				s->tasks.pop_front();
+			}
+			r->Run(); // removes the strand once it is empty
+			return false;
+		}
+
+		// Strands returns the number of strands with pending tasks.
+		size_t Strands() {
+			size_t n = 0;
+			for (auto &shard : state_->shards) {
+				std::lock_guard<std::mutex> lck(shard.mtx);
+				n += shard.strands.size();
+			}
+			return n;
+		}
+
+	private:
+		struct Strand {
+			std::deque<std::shared_ptr<Runnable>> tasks;
+		};
+
+		struct Shard {
+			std::mutex mtx;
+			std::unordered_map<Key, std::shared_ptr<Strand>, Hash> strands;
+		};
+
+		// State is shared with the runners, so that they may outlive the
+		// executor.
+		struct State {
+			State(std::shared_ptr<ThreadPool> p, uint32_t b, uint32_t n) :
+				pool(p),
+				batch(b > 0 ? b : 1),
+				shards(n > 0 ? n : 1) {}
+			std::shared_ptr<ThreadPool> pool;
+			const uint32_t batch;
+			std::vector<Shard> shards;
+
+			Shard& shard(const Key &key) {
+				return shards[Hash()(key) % shards.size()];
+			}
+		};
+
+		class Runner : public Runnable {
+			public:
+				Runner(const std::shared_ptr<State> &state, const Key &key, const std::shared_ptr<Strand> &s) :
+					state_(state),
+					key_(key),
+					strand_(s),
+					pending_(true) {}
+				~Runner() {
+					if (!pending_) {
+						return;
+					}
+					// Discarded by the pool: nobody else would run the
+					// strand, so it must not stay in the way of the key.
+					auto &shard = state_->shard(key_);
+					std::lock_guard<std::mutex> lck(shard.mtx);
+					auto it = shard.strands.find(key_);
+					if (it != shard.strands.end() && it->second == strand_) {
+						shard.strands.erase(it);
+					}
+				}
+
+				virtual void Run() override {
+					pending_ = false;
+					auto &shard = state_->shard(key_);
+					while (true) {
+						for (uint32_t i = 0; i < state_->batch; ++i) {
+							std::shared_ptr<Runnable> task;
+							{
+								std::lock_guard<std::mutex> lck(shard.mtx);
+								if (strand_->tasks.empty()) {
+									shard.strands.erase(key_);
+									return;
+								}
+								task = strand_->tasks.front();
+								strand_->tasks.pop_front();
+							}
+							task->Run();
+						}
+						// Give other work a chance, then carry on. Never block
+						// on the queue of the pool we are running on; if it is
+						// full, carry on right here.
+						auto next = std::make_shared<Runner>(state_, key_, strand_);
+						if (state_->pool->Post(next, 0)) {
+							return;
+						}
+						next->pending_ = false;
+					}
+				}
+
+			private:
+				std::shared_ptr<State> state_;
+				Key key_;
+				std::shared_ptr<Strand> strand_;
+				bool pending_; // not run yet
+		};
+
+		std::shared_ptr<State> state_;
+};
+
+#endif // __STRAND_H_
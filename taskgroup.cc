@@ -0,0 +1,193 @@
+// 
+// Implementation of TaskGroup.
+//
+
+#include "taskgroup.h"
+
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <chrono>
+
+#include "blocking.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Member is a task of a group. It is run either by the pool or by a thread
+// waiting for the group, whichever claims it first.
+struct Member : public Runnable {
+	Member(const shared_ptr<Runnable> &t, const shared_ptr<TaskGroup::State> &s) :
+		task(t),
+		state(s),
+		claimed(false) {}
+
+	virtual void Run() override;
+
+	bool Claim() {
+		return !claimed.exchange(true, memory_order_acq_rel);
+	}
+
+	shared_ptr<Runnable> task;
+	shared_ptr<TaskGroup::State> state; // members may outlive the group
+	atomic<bool> claimed;
+};
+
+} // namespace
+
+// State is shared by the group and its members. Members that have not
+// started are kept on a stack for waiters to run; members claimed by the
+// pool are left behind and skipped.
+class TaskGroup::State {
+	public:
+		explicit State(const shared_ptr<State> &parent) :
+			parent_(parent),
+			cancelled_(false),
+			outstanding_(0) {}
+
+		void Add(const shared_ptr<Member> &m) {
+			lock_guard<mutex> lck(mtx_);
+			++outstanding_;
+			pending_.push_back(m);
+		}
+
+		// Execute runs a claimed member, unless the group is cancelled.
+		void Execute(Member &m) {
+			if (!Cancelled()) {
+				m.task->Run();
+			}
+			m.task.reset();
+			Finish();
+		}
+
+		void Finish() {
+			lock_guard<mutex> lck(mtx_);
+			if (--outstanding_ == 0) {
+				pending_.clear();
+				done_.notify_all();
+			}
+		}
+
+		// Next claims the member added last that has not started, if any.
+		shared_ptr<Member> Next() {
+			lock_guard<mutex> lck(mtx_);
+			while (!pending_.empty()) {
+				auto m = pending_.back();
+				pending_.pop_back();
+				if (m->Claim()) {
+					return m;
+				}
+			}
+			return nullptr;
+		}
+
+		bool Wait(int64_t timeout) {
+			auto deadline = steady_clock::now() + milliseconds(timeout);
+			while (true) {
+				if (Done()) {
+					return true;
+				}
+				if (auto m = Next()) {
+					Execute(*m);
+					continue;
+				}
+				auto hook = HelpHook::Current();
+				if (hook != nullptr && hook->RunPending()) {
+					continue;
+				}
+				if (timeout == 0) {
+					return Done();
+				}
+				// The remaining members are running on other workers.
+				BlockingScope blocking;
+				unique_lock<mutex> lck(mtx_);
+				auto done = [this] { return outstanding_ == 0; };
+				if (timeout < 0) {
+					done_.wait(lck, done);
+					return true;
+				}
+				return done_.wait_until(lck, deadline, done);
+			}
+		}
+
+		void Cancel() {
+			cancelled_ = true;
+			while (auto m = Next()) {
+				m->task.reset();
+				Finish();
+			}
+		}
+
+		bool Cancelled() const {
+			return cancelled_ || (parent_ != nullptr && parent_->Cancelled());
+		}
+
+		bool Done() {
+			lock_guard<mutex> lck(mtx_);
+			return outstanding_ == 0;
+		}
+
+	private:
+		const shared_ptr<State> parent_;
+		atomic<bool> cancelled_;
+		mutex mtx_;
+		condition_variable done_;
+		uint64_t outstanding_;
+		deque<shared_ptr<Member>> pending_;
+};
+
+void Member::Run() {
+	if (Claim()) {
+		state->Execute(*this);
+	}
+}
+
+
+TaskGroup::TaskGroup(ThreadPool &pool, TaskGroup *parent) :
+	pool_(pool) {
+	state_ = make_shared<State>(parent != nullptr ? parent->state_ : nullptr);
+}
+
+TaskGroup::~TaskGroup() {
+	Wait();
+}
+
+bool TaskGroup::Run(const shared_ptr<Runnable> &task) {
+	if (state_->Cancelled()) {
+		return false;
+	}
+	auto m = make_shared<Member>(task, state_);
+	state_->Add(m);
+	if (HelpHook::Current() != nullptr) {
+		// A worker must not block on a full queue: all workers might, and
+		// nobody would drain it. The member runs right away instead.
+		if (!pool_.Post(m, 0) && m->Claim()) {
+			state_->Execute(*m);
+		}
+		return true;
+	}
+	if (pool_.Post(m)) {
+		return true;
+	}
+	if (!m->Claim()) {
+		return true; // run by a waiter meanwhile
+	}
+	m->task.reset();
+	state_->Finish();
+	return false;
+}
+
+bool TaskGroup::Wait(int64_t timeout) {
+	return state_->Wait(timeout);
+}
+
+void TaskGroup::Cancel() {
+	state_->Cancel();
+}
+
+bool TaskGroup::Cancelled() const {
+	return state_->Cancelled();
+}
@@ -0,0 +1,80 @@
+//
+// taskgroup.h
+//
+// Define TaskGroup, which runs tasks on a pool and joins them.
+//
+
+#ifndef __TASKGROUP_H_
+#define __TASKGROUP_H_
+
+#include <memory>
+
+#include "runnable.h"
+#include "threadpool.h"
+
+// HelpHook lets code running on a worker run tasks queued in the pool of the
+// worker. A pool installs a hook on each worker thread.
+class HelpHook {
+	public:
+		virtual ~HelpHook() {}
+
+		// RunPending takes one task from the queue of the pool and runs it
+		// on the calling thread. It returns false if there is none.
+		virtual bool RunPending() = 0;
+
+		// Current returns the hook of the calling thread, nullptr outside a
+		// worker.
+		static HelpHook*& Current() {
+			static thread_local HelpHook *hook = nullptr;
+			return hook;
+		}
+};
+
+// TaskGroup runs tasks on a pool and waits for all of them, e.g. to fan out
+// subtasks from a task:
+//
+//   TaskGroup group(pool);
+//   group.Run(left);
+//   group.Run(right);
+//   group.Wait();
+//
+// Wait() does not hold a worker idle: it runs the members of the group that
+// have not started yet, then, on a worker, other tasks queued in the pool,
+// and only blocks when there is nothing left to run, inside a BlockingScope
+// so that the pool may start a spare worker. Recursive divide and conquer
+// therefore cannot deadlock by filling all workers with waiting tasks.
+//
+// Cancel() drops the members that have not started and the members of
+// groups created with this group as parent. Running members see it through
+// Cancelled().
+class TaskGroup {
+	public:
+		explicit TaskGroup(ThreadPool &pool, TaskGroup *parent = nullptr);
+		TaskGroup(const TaskGroup&) = delete;
+		TaskGroup& operator=(const TaskGroup&) = delete;
+		// The destructor waits for the members.
+		~TaskGroup();
+
+		// Run posts task to the pool as a member of the group. It returns
+		// false if the group is cancelled or the pool does not accept it.
+		// On a worker, a task the queue has no room for runs right away.
+		bool Run(const std::shared_ptr<Runnable> &task);
+
+		// Wait blocks until all members have finished or been dropped. If
+		// timeout == 0, it only runs what it can without blocking. If
+		// timeout < 0, it blocks indefinitely. If timeout > 0, it blocks for
+		// at most timeout milliseconds. It returns true if all members are
+		// done.
+		bool Wait(int64_t timeout = -1);
+
+		void Cancel();
+		bool Cancelled() const;
+
+		class State;
+
+	private:
+		ThreadPool &pool_;
+		std::shared_ptr<State> state_;
+};
+
+#endif // __TASKGROUP_H_
@@ -0,0 +1,226 @@
+//
+// Implement handles to tasks submitted to a ThreadPool.
+//
+
+#ifndef __TASKHANDLE_H_
+#define __TASKHANDLE_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+class TaskRegistry;
+
+// TaskHandle tracks the life cycle of one submitted task:
+//
+//   PENDING --> RUNNING --> DONE / EXPIRED / DROPPED
+//      |
+//      +--> CANCELLED
+//
+// A task can only be cancelled while it is PENDING. All transitions are
+// atomic, so a task is either run or cancelled, never both.
+class TaskHandle {
+	public:
+		enum class Status {PENDING, RUNNING, DONE, CANCELLED, EXPIRED, DROPPED};
+
+		TaskHandle(std::weak_ptr<TaskRegistry> registry, uint64_t group) :
+			status_(Status::PENDING),
+			group_(group),
+			owner_(nullptr),
+			registry_(registry) {}
+		TaskHandle(const TaskHandle&) = delete;
+		TaskHandle(TaskHandle&&) = delete;
+		TaskHandle& operator=(const TaskHandle&) = delete;
+		TaskHandle& operator=(TaskHandle&&) = delete;
+
+		// Cancel withdraws a pending task and frees its slot in the queue
+		// immediately. It returns false if the task has already started or
+		// finished.
+		inline bool Cancel();
+
+		Status State() const {
+			return status_.load(std::memory_order_acquire);
+		}
+
+		uint64_t Group() const {
+			return group_;
+		}
+
+		// Wait blocks until the task has finished, been cancelled or expired.
+		// If timeout == 0, it only checks the state.
+		// If timeout < 0, it blocks indefinitely.
+		// If timeout > 0, it blocks for at most timeout milliseconds.
+		// It returns true if the task has reached a final state.
+		bool Wait(int64_t timeout = -1) {
+			std::unique_lock<std::mutex> lck(mtx_);
+			auto done = [this] { return isFinal(State()); };
+			if (timeout == 0) {
+				return done();
+			}
+			if (timeout < 0) {
+				cv_.wait(lck, done);
+				return true;
+			}
+			return cv_.wait_for(lck, std::chrono::milliseconds(timeout), done);
+		}
+
+		// The methods below are used by the thread pool and the queue.
+
+		// Transit moves the task from state 'from' to state 'to'; it fails if
+		// the task is not in state 'from'.
+		inline bool Transit(Status from, Status to);
+
+		// Owner identifies the queue (shard) holding the pending task.
+		void SetOwner(const void *owner) {
+			owner_ = owner;
+		}
+		const void* Owner() const {
+			return owner_;
+		}
+
+	private:
+		std::atomic<Status> status_;
+		const uint64_t group_;
+		const void *owner_;
+		std::weak_ptr<TaskRegistry> registry_;
+		std::mutex mtx_;
+		std::condition_variable cv_;
+
+		static bool isFinal(Status s) {
+			return s != Status::PENDING && s != Status::RUNNING;
+		}
+};
+
+// TaskRegistry connects handles to the queue of the pool they were
+// submitted to, and keeps track of handles by group for bulk cancellation.
+// Handles only hold a weak reference, so they may outlive the pool.
+class TaskRegistry {
+	public:
+		// discard must remove the pending task of the handle from the queue,
+		// calling claim() under the queue lock; see Channel::Discard().
+		using Discarder = std::function<bool(TaskHandle*, const std::function<bool()>&)>;
+
+		// cancelled, if set, is called for every pending task cancelled
+		// through a handle.
+		explicit TaskRegistry(Discarder d, std::function<void()> cancelled = nullptr) :
+			discard_(d),
+			cancelled_(cancelled) {}
+		TaskRegistry(const TaskRegistry&) = delete;
+		TaskRegistry& operator=(const TaskRegistry&) = delete;
+
+		// Detach is called by the pool upon destruction; later cancellations
+		// only flip the state of the handle.
+		void Detach() {
+			std::lock_guard<std::mutex> lck(discardMtx_);
+			discard_ = nullptr;
+			cancelled_ = nullptr;
+		}
+
+		bool Discard(TaskHandle *h) {
+			auto claim = [h] {
+				return h->Transit(TaskHandle::Status::PENDING, TaskHandle::Status::CANCELLED);
+			};
+			std::lock_guard<std::mutex> lck(discardMtx_);
+			bool ok;
+			if (discard_ == nullptr || h->Owner() == nullptr) {
+				ok = claim();
+			} else {
+				ok = discard_(h, claim);
+			}
+			if (ok && cancelled_ != nullptr) {
+				cancelled_();
+			}
+			return ok;
+		}
+
+		void Add(const std::shared_ptr<TaskHandle> &h) {
+			if (h->Group() == 0) {
+				return;
+			}
+			std::lock_guard<std::mutex> lck(mtx_);
+			auto s = h->State();
+			if (s != TaskHandle::Status::PENDING && s != TaskHandle::Status::RUNNING) {
+				return; // already finished; Remove() has been called.
+			}
+			groups_[h->Group()][h.get()] = h;
+		}
+
+		void Remove(TaskHandle *h) {
+			if (h->Group() == 0) {
+				return;
+			}
+			std::lock_guard<std::mutex> lck(mtx_);
+			auto it = groups_.find(h->Group());
+			if (it == groups_.end()) {
+				return;
+			}
+			it->second.erase(h);
+			if (it->second.empty()) {
+				groups_.erase(it);
+			}
+		}
+
+		// CancelGroup cancels all pending tasks of a group and returns the
+		// number of tasks cancelled.
+		size_t CancelGroup(uint64_t group) {
+			std::vector<std::shared_ptr<TaskHandle>> handles;
+			{
+				std::lock_guard<std::mutex> lck(mtx_);
+				auto it = groups_.find(group);
+				if (it == groups_.end()) {
+					return 0;
+				}
+				for (auto &kv : it->second) {
+					if (auto h = kv.second.lock()) {
+						handles.push_back(h);
+					}
+				}
+			}
+			size_t n = 0;
+			for (auto &h : handles) {
+				if (h->Cancel()) {
+					++n;
+				}
+			}
+			return n;
+		}
+
+	private:
+		std::mutex discardMtx_; // lock order: discardMtx_ -> queue -> mtx_
+		Discarder discard_;
+		std::function<void()> cancelled_;
+		std::mutex mtx_;
+		std::unordered_map<uint64_t,
+			std::unordered_map<TaskHandle*, std::weak_ptr<TaskHandle>>> groups_;
+};
+
+bool TaskHandle::Cancel() {
+	if (State() != Status::PENDING) {
+		return false;
+	}
+	if (auto r = registry_.lock()) {
+		return r->Discard(this);
+	}
+	return Transit(Status::PENDING, Status::CANCELLED);
+}
+
+bool TaskHandle::Transit(Status from, Status to) {
+	if (!status_.compare_exchange_strong(from, to, std::memory_order_acq_rel)) {
+		return false;
+	}
+	if (isFinal(to)) {
+		if (auto r = registry_.lock()) {
+			r->Remove(this);
+		}
+		std::lock_guard<std::mutex> lck(mtx_);
+		cv_.notify_all();
+	}
+	return true;
+}
+
+#endif // __TASKHANDLE_H_
@@ -0,0 +1,117 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "agingqueue.h"
+
+using namespace std;
+
+struct Item {
+	Item() : p(0), id(0) {}
+	Item(int pri, int i) : p(pri), id(i) {}
+	int GetPriority() const { return p; }
+	int p;
+	int id;
+};
+
+template<>
+struct ChannelTraits<Item> {
+	static void Bind(const Item&, const void*) {}
+	static bool Claim(Item&) { return true; }
+	static const void* Key(const Item &t) { return reinterpret_cast<const void*>(static_cast<intptr_t>(t.id)); }
+};
+
+const void* key(int id) {
+	return reinterpret_cast<const void*>(static_cast<intptr_t>(id));
+}
+
+void testQueue() {
+	AgingPriQueue<Item> q;
+	// Fresh items: by priority, then FIFO.
+	q.push(Item(1, 1));
+	q.push(Item(3, 2));
+	q.push(Item(1, 3));
+	q.push(Item(2, 4));
+	assert(q.size() == 4);
+	assert(q.pop().id == 2);
+	assert(q.pop().id == 4);
+	assert(q.pop().id == 1);
+	assert(q.pop().id == 3);
+	assert(q.size() == 0);
+
+	// An old item overtakes younger ones of higher priority, up to the cap.
+	q.setAging(chrono::milliseconds(10), 5);
+	q.push(Item(0, 10));
+	this_thread::sleep_for(chrono::milliseconds(60));
+	q.push(Item(2, 11));
+	q.push(Item(6, 12));
+	assert(q.pop().id == 12); // 6 > 0 + 5
+	assert(q.pop().id == 10); // 0 + 5 > 2
+	assert(q.pop().id == 11);
+
+	// Without aging the order is strict.
+	q.setAging(chrono::milliseconds(0), 5);
+	q.push(Item(0, 20));
+	this_thread::sleep_for(chrono::milliseconds(20));
+	q.push(Item(1, 21));
+	assert(q.pop().id == 21);
+	assert(q.pop().id == 20);
+
+	// Reprioritize keeps the queueing order within the new level.
+	q.push(Item(1, 30));
+	q.push(Item(5, 31));
+	q.push(Item(1, 32));
+	q.push(Item(5, 33));
+	assert(q.reprioritize(key(32), 5));
+	assert(q.reprioritize(key(30), 5));
+	assert(!q.reprioritize(key(99), 5));
+	assert(q.pop().id == 30);
+	assert(q.pop().id == 31);
+	assert(q.pop().id == 32);
+	assert(q.pop().id == 33);
+	assert(!q.reprioritize(key(30), 1));
+}
+
+mutex orderMtx;
+vector<int> order;
+
+struct Job : public Runnable {
+	Job(int id, int ms) : id_(id), ms_(ms) {}
+	virtual void Run() override {
+		this_thread::sleep_for(chrono::milliseconds(ms_));
+		lock_guard<mutex> lck(orderMtx);
+		order.push_back(id_);
+	}
+	int id_;
+	int ms_;
+};
+
+void testPool() {
+	auto factory = make_shared<StdThreadFactory>();
+	PriThreadPool pool(factory, 1, 10);
+	pool.SetAging(chrono::milliseconds(1000), 2);
+	pool.Start();
+	auto busy = pool.Submit(make_shared<Job>(0, 100));
+	this_thread::sleep_for(chrono::milliseconds(30));
+	auto a = pool.Submit(make_shared<Job>(1, 0), -1, 0, 1);
+	auto b = pool.Submit(make_shared<Job>(2, 0), -1, 0, 3);
+	auto c = pool.Submit(make_shared<Job>(3, 0), -1, 0, 2);
+	assert(pool.Reprioritize(a, 9));
+	assert(!pool.Reprioritize(busy, 9));
+	pool.Stop();
+	assert(order == vector<int>({0, 1, 2, 3}));
+	assert(!pool.Reprioritize(a, 0));
+}
+
+int main() {
+	testQueue();
+	testPool();
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "arena.h"
+
+using namespace std;
+
+atomic<int> ran(0);
+atomic<size_t> usedBefore(0);
+
+// Job fills a vector allocated from the arena of its worker.
+struct Job : public Runnable {
+	explicit Job(int n) : n_(n) {}
+	virtual void Run() override {
+		auto arena = CurrentWorker::Arena();
+		assert(arena != nullptr);
+		usedBefore = arena->Used();
+		vector<int, ArenaAllocator<int>> v{ArenaAllocator<int>(arena)};
+		for (int i = 0; i < n_; ++i) {
+			v.push_back(i);
+		}
+		assert(arena->Used() >= n_ * sizeof(int));
+		++ran;
+	}
+	int n_;
+};
+
+void testArena() {
+	Arena a(1024);
+	assert(a.Reserved() == 0); // blocks are allocated on first use
+	void *p = a.Allocate(10, 1);
+	void *q = a.Allocate(8, 64);
+	assert(reinterpret_cast<uintptr_t>(q) % 64 == 0);
+	assert(static_cast<char*>(q) >= static_cast<char*>(p) + 10);
+	assert(a.Reserved() == 1024);
+
+	a.Allocate(4096); // a block of its own
+	assert(a.Reserved() == 1024 + 4096 + alignof(max_align_t) - 1);
+	a.Reset();
+	assert(a.Used() == 0);
+	assert(a.Allocate(10, 1) == p); // memory is reused
+
+	// Trimming frees the blocks beyond the high-water mark.
+	a.SetTrim(1024);
+	a.Allocate(4096);
+	a.Reset();
+	assert(a.Reserved() == 1024);
+	a.SetTrim(1);
+	a.Allocate(1);
+	a.Reset();
+	assert(a.Reserved() == 0);
+	assert(a.Allocate(1) != nullptr);
+
+	// Empty allocations are valid pointers too, with or without a block.
+	Arena b(64);
+	assert(b.Allocate(0) != nullptr);
+	b.Allocate(64, 1); // fills the block
+	assert(b.Allocate(0) != nullptr);
+	b.SetTrim(1);
+	b.Reset();
+	assert(b.Reserved() == 0 && b.Allocate(0) != nullptr);
+}
+
+#if __cplusplus >= 201703L
+void testResource() {
+	Arena a(1024);
+	ArenaResource r(&a), same(&a);
+	Arena other;
+	ArenaResource r2(&other);
+	assert(r == same && r != r2);
+	std::pmr::vector<int> v(&r);
+	for (int i = 0; i < 100; ++i) {
+		v.push_back(i);
+	}
+	assert(a.Used() >= 100 * sizeof(int));
+	assert(v[99] == 99);
+}
+#endif
+
+// Workers reset their arena after each task.
+void testPool() {
+	auto factory = make_shared<StdThreadFactory>();
+	FifoThreadPool pool(factory, 1, 10);
+	pool.SetArena(256, 1024);
+	pool.Start();
+	for (int i = 0; i < 5; ++i) {
+		assert(pool.Post(make_shared<Job>(1000)));
+	}
+	pool.Stop();
+	assert(ran == 5);
+	assert(usedBefore == 0); // reset after each task
+}
+
+int main() {
+	testArena();
+#if __cplusplus >= 201703L
+	testResource();
+#endif
+	assert(CurrentWorker::Arena() == nullptr);
+	testPool();
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,120 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "blocking.h"
+
+using namespace std;
+
+mutex releaseMtx;
+condition_variable cv;
+bool released = false;
+atomic<int> blocked(0);
+atomic<int> ran(0);
+
+void waitRelease() {
+	++blocked;
+	unique_lock<mutex> lck(releaseMtx);
+	cv.wait(lck, [] { return released; });
+	--blocked;
+}
+
+// Stuck blocks in a syscall-like wait, marked by PostBlocking.
+struct Stuck : public Runnable {
+	virtual void Run() override {
+		waitRelease();
+	}
+};
+
+// Scoped marks only part of its run as blocking.
+struct Scoped : public Runnable {
+	virtual void Run() override {
+		BlockingScope outer;
+		{
+			BlockingScope inner; // nested scopes count once
+			waitRelease();
+		}
+	}
+};
+
+struct Cpu : public Runnable {
+	virtual void Run() override {
+		++ran;
+	}
+};
+
+// Blocked workers are compensated by spare workers, up to a cap.
+void testSpares() {
+	auto factory = make_shared<StdThreadFactory>();
+	FifoThreadPool pool(factory, 2, 50);
+	pool.Start();
+	assert(pool.Threads() == 2);
+
+	// Block more tasks than there are workers.
+	for (int i = 0; i < 2; ++i) {
+		assert(pool.PostBlocking(make_shared<Stuck>()));
+		assert(pool.Post(make_shared<Scoped>()));
+	}
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+	while (blocked < 4 && chrono::steady_clock::now() < deadline) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+	}
+	assert(blocked == 4);
+	assert(pool.Threads() == 6);
+
+	// CPU tasks still run on the spare workers.
+	for (int i = 0; i < 20; ++i) {
+		assert(pool.Post(make_shared<Cpu>()));
+	}
+	while (ran < 20 && chrono::steady_clock::now() < deadline) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+	}
+	assert(ran == 20);
+	assert(blocked == 4);
+
+	// Spare workers retire once the blocked tasks return.
+	{
+		lock_guard<mutex> lck(releaseMtx);
+		released = true;
+		cv.notify_all();
+	}
+	deadline = chrono::steady_clock::now() + chrono::seconds(5);
+	while (pool.Threads() > 2 && chrono::steady_clock::now() < deadline) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+	}
+	assert(pool.Threads() == 2);
+	assert(pool.Post(make_shared<Cpu>()));
+
+	// The cap holds.
+	released = false;
+	pool.SetMaxSpareWorkers(1);
+	for (int i = 0; i < 3; ++i) {
+		assert(pool.PostBlocking(make_shared<Stuck>()));
+	}
+	this_thread::sleep_for(chrono::milliseconds(200));
+	assert(blocked == 3);
+	assert(pool.Threads() == 3);
+	{
+		lock_guard<mutex> lck(releaseMtx);
+		released = true;
+		cv.notify_all();
+	}
+	pool.Stop();
+	assert(ran == 21);
+}
+
+int main() {
+	{
+		BlockingScope noop; // not on a worker: nothing to do
+	}
+	testSpares();
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,142 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "broadcastring.h"
+
+using namespace std;
+
+struct Event {
+	int64_t value;
+	int64_t stage; // written by the first consumer of a chain
+};
+
+// Every consumer sees every event, in order, from handlers on pool threads.
+void testFanOut() {
+	const int C = 3, N = 50000;
+	BroadcastRing<Event> ring(64);
+	vector<int64_t> sums(C, 0);
+	vector<int64_t> last(C, -1);
+	vector<int64_t> batches(C, 0);
+	vector<shared_ptr<BatchConsumer<Event>>> consumers;
+	for (int i = 0; i < C; ++i) {
+		consumers.push_back(make_shared<BatchConsumer<Event>>(ring,
+			[&sums, &last, &batches, i](Event &e, int64_t seq, bool endOfBatch) {
+				assert(seq == last[i] + 1 && e.value == seq);
+				last[i] = seq;
+				sums[i] += e.value;
+				if (endOfBatch) {
+					++batches[i];
+				}
+			}));
+	}
+	FifoThreadPool pool(make_shared<StdThreadFactory>(), C, 10);
+	pool.Start();
+	for (auto &c : consumers) {
+		assert(pool.PostBlocking(c));
+	}
+	for (int i = 0; i < N; ++i) {
+		Event e = {i, 0};
+		assert(ring.Publish(e));
+	}
+	ring.Close();
+	pool.Stop();
+	int64_t want = int64_t(N) * (N - 1) / 2;
+	for (int i = 0; i < C; ++i) {
+		assert(last[i] == N - 1 && sums[i] == want);
+		assert(batches[i] > 0 && batches[i] <= N);
+	}
+	assert(!ring.Publish(Event{0, 0}, 0));
+}
+
+// A consumer that depends on another sees its writes, and the producer
+// never laps the slowest consumer.
+void testDependency() {
+	const int N = 20000;
+	BroadcastRing<Event> ring(16);
+	atomic<int64_t> slowCursor(-1);
+	BatchConsumer<Event> first(ring, [](Event &e, int64_t seq, bool) {
+		e.stage = e.value * 2;
+	});
+	int64_t seen = 0;
+	BatchConsumer<Event> second(ring, [&seen, &slowCursor](Event &e, int64_t seq, bool) {
+		assert(e.stage == e.value * 2);
+		++seen;
+		if (seq % 1000 == 0) {
+			this_thread::sleep_for(chrono::milliseconds(1)); // fall behind
+		}
+		slowCursor = seq;
+	}, {first.Cursor()});
+	{
+		StdThread t1, t2; // joined on destruction
+		t1.Run(shared_ptr<Runnable>(&first, [](Runnable*) {}));
+		t2.Run(shared_ptr<Runnable>(&second, [](Runnable*) {}));
+		for (int i = 0; i < N; ++i) {
+			int64_t seq;
+			assert(ring.Claim(seq));
+			assert(seq == i);
+			assert(seq - slowCursor <= int64_t(ring.Size()));
+			ring.At(seq) = Event{i, 0};
+			ring.Publish(seq);
+		}
+		ring.Close();
+	}
+	assert(seen == N);
+	assert(second.Cursor()->Get() == N - 1);
+}
+
+// A full ring holds producers back; Claim times out and gives up when closed.
+void testBackpressure() {
+	BroadcastRing<Event> ring(4);
+	BatchConsumer<Event> idle(ring, [](Event&, int64_t, bool) {});
+	for (int i = 0; i < 4; ++i) {
+		assert(ring.Publish(Event{i, 0}, 0));
+	}
+	assert(!ring.Publish(Event{4, 0}, 0));
+	auto start = chrono::steady_clock::now();
+	assert(!ring.Publish(Event{4, 0}, 50));
+	assert(chrono::steady_clock::now() - start >= chrono::milliseconds(50));
+	std::thread closer([&ring] {
+		this_thread::sleep_for(chrono::milliseconds(50));
+		ring.Close();
+	});
+	assert(!ring.Publish(Event{4, 0}, -1)); // released by Close
+	closer.join();
+	assert(ring.Cursor() == 3);
+}
+
+// A consumer added later starts at the current cursor, and catches up with
+// all available events in one batch.
+void testBatch() {
+	BroadcastRing<Event> ring(8);
+	for (int i = 0; i < 5; ++i) {
+		assert(ring.Publish(Event{i, 0}, 0));
+	}
+	vector<pair<int64_t, bool>> got;
+	BatchConsumer<Event> c(ring, [&got](Event &e, int64_t seq, bool endOfBatch) {
+		got.push_back(make_pair(seq, endOfBatch));
+	});
+	for (int i = 5; i < 9; ++i) {
+		assert(ring.Publish(Event{i, 0}, 0));
+	}
+	ring.Close();
+	c.Run();
+	assert(got.size() == 4);
+	assert(got[0].first == 5 && got[3].first == 8);
+	assert(!got[0].second && !got[1].second && !got[2].second && got[3].second);
+}
+
+int main() {
+	testFanOut();
+	testDependency();
+	testBackpressure();
+	testBatch();
+	cout << "Exiting..." << endl;
+	return 0;
+}
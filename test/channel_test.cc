@@ -1,7 +1,16 @@
 #include <iostream>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <cassert>
 
 #include "priqueue.h"
 #include "channel.h"
+#include "agingqueue.h"
+#include "fairqueue.h"
+#include "channel_util.h"
 
 using namespace std;
 
@@ -24,6 +33,122 @@ class less<Item> {
 };
 }
 
+// Job can be discarded while queued; it is looked up by its flag.
+struct Job {
+	Job() : id(0) {}
+	explicit Job(int i) : id(i), live(std::make_shared<bool>(true)) {}
+	int GetPriority() const {
+		return id % 3;
+	}
+	int id;
+	std::shared_ptr<bool> live;
+};
+
+template<>
+struct ChannelTraits<Job> {
+	static void Bind(const Job&, const void*) {}
+	static bool Claim(Job &j) { return *j.live; }
+	static const void* Key(const Job &j) { return j.live.get(); }
+};
+
+namespace std{
+template<>
+class less<Job> {
+	public:
+		bool operator() (const Job& x, const Job& y) const {
+			return x.GetPriority() < y.GetPriority() || 
+				(x.GetPriority() == y.GetPriority() && x.id > y.id);
+		}
+};
+}
+
+// Discarded items leave the container at once, whatever its policy.
+template<class Container>
+void testDiscard() {
+	const int N = 4;
+	Channel<Job, Container> chan(N);
+	auto discard = [&chan](const void *owner, const Job &j) {
+		return chan.Discard(owner, j.live.get(), [&j] {
+			bool was = *j.live;
+			*j.live = false;
+			return was;
+		});
+	};
+	auto queued = [&chan] {
+		size_t n = 0;
+		chan.Visit([&n](Container &q) { n = q.size(); });
+		return n;
+	};
+	std::vector<Job> jobs;
+	for (int i = 0; i < N; ++i) {
+		jobs.emplace_back(i);
+		assert(chan.Put(jobs.back(), 0));
+	}
+	assert(!discard(nullptr, jobs[1]) && *jobs[1].live); // not ours
+	assert(discard(&chan, jobs[1]));
+	assert(!discard(&chan, jobs[1]));
+	assert(chan.Size() == N - 1 && queued() == N - 1);
+	// Churn does not pile up cancelled items.
+	for (int i = N; i < 1000; ++i) {
+		Job j(i);
+		assert(chan.Put(j, 0));
+		assert(discard(&chan, j));
+	}
+	assert(chan.Size() == N - 1 && queued() == N - 1);
+	Job j;
+	for (int i = 0; i < N - 1; ++i) {
+		assert(chan.Get(j, 0) && j.id != 1);
+	}
+	assert(!chan.Get(j, 0));
+}
+
+// The consumer that parked last is woken first.
+void testLifoWake() {
+	Channel<int> chan(10);
+	std::atomic<int> got[3];
+	std::vector<std::thread> consumers;
+	for (int i = 0; i < 3; ++i) {
+		got[i] = -1;
+		consumers.emplace_back([&chan, &got, i] {
+			int v;
+			if (chan.Get(v, 2000)) {
+				got[i] = v;
+			}
+		});
+		std::this_thread::sleep_for(std::chrono::milliseconds(50)); // park in order
+	}
+	for (int v = 0; v < 3; ++v) {
+		chan.Put(v, -1);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+	for (auto &t : consumers) {
+		t.join();
+	}
+	assert(got[2] == 0 && got[1] == 1 && got[0] == 2);
+}
+
+// Every item is taken exactly once, and timed-out or closed consumers leave.
+void testStress() {
+	Channel<int> chan(8);
+	pump<int>(chan, 4, 4, 20000, [](int i) { return i; }, [](int v) { return v; }, 1);
+	int v;
+	assert(!chan.Get(v, 100));
+}
+
+// Costs reach the container if it needs them.
+void testFeedback() {
+	Channel<int, Tally<int>> chan(4);
+	for (int i = 0; i < 10; ++i) {
+		assert(chan.Put(i, 0));
+		int v;
+		assert(chan.Get(v, 0) && v == i);
+		chan.Complete(v, 1);
+	}
+	chan.Visit([](Tally<int> &t) {
+		assert(t.pushed == 10 && t.completed == 10);
+	});
+}
+
 int main() {
 	int N = 10;
 	Channel<Item, FifoQueue<Item>> chan(N);
@@ -36,4 +161,13 @@ int main() {
 		auto itm = chan.Get(0);
 		cout << "item  " << itm.GetPriority() << endl;
 	}
+	testLifoWake();
+	testStress();
+	testFeedback();
+	testDiscard<RingQueue<Job>>();
+	testDiscard<FifoQueue<Job>>();
+	testDiscard<PriQueue<Job>>();
+	testDiscard<AgingPriQueue<Job>>();
+	testDiscard<FairQueue<Job>>();
+	cout << "Exiting..." << endl;
 }
@@ -0,0 +1,80 @@
+//
+// Helpers shared by the channel tests.
+//
+
+#ifndef __CHANNEL_UTIL_H_
+#define __CHANNEL_UTIL_H_
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cassert>
+
+#include "channel.h"
+#include "ringqueue.h"
+
+// Tally is a FIFO container that counts the items pushed to it and the costs
+// reported back.
+template<class T>
+class Tally : public RingQueue<T> {
+	public:
+		explicit Tally(uint32_t sz) : RingQueue<T>(sz), pushed(0), completed(0) {}
+		void push(const T &t) {
+			RingQueue<T>::push(t);
+			++pushed;
+		}
+		void complete(const T &t, int64_t cost) {
+			++completed;
+		}
+		int pushed;
+		int completed;
+};
+
+template<class T>
+struct NeedsFeedback<Tally<T>> : std::true_type {};
+
+// pump pushes the values 1..n through chan from each producer, with make(i)
+// building the item of value i and value(item) reading it back, and returns
+// the time until every item has been taken. Consumers alternate between
+// blocking Gets and Gets of timeout ms, which leave once the channel runs
+// dry; timeout < 0 makes them all block. Every item must be taken once.
+template<class T, class Chan, class Make, class Value>
+std::chrono::milliseconds pump(Chan &chan, int producers, int consumers, int n,
+		Make make, Value value, int64_t timeout = -1) {
+	std::atomic<int64_t> sum(0);
+	std::atomic<int> received(0);
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (int p = 0; p < producers; ++p) {
+		threads.emplace_back([&chan, &make, n] {
+			for (int i = 1; i <= n; ++i) {
+				assert(chan.Put(make(i), -1));
+			}
+		});
+	}
+	for (int c = 0; c < consumers; ++c) {
+		threads.emplace_back([&, c] {
+			T item;
+			while (chan.Get(item, c % 2 == 0 ? -1 : timeout)) {
+				sum += value(item);
+				++received;
+			}
+		});
+	}
+	for (int p = 0; p < producers; ++p) {
+		threads[p].join();
+	}
+	while (received < producers * n) {
+		std::this_thread::yield();
+	}
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	chan.Close();
+	for (size_t i = producers; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+	assert(sum == (int64_t)producers * n * (n + 1) / 2);
+	return elapsed;
+}
+
+#endif // __CHANNEL_UTIL_H_
@@ -0,0 +1,69 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cassert>
+
+#include "codel.h"
+#include "stdthread.h"
+#include "threadpool_impl.h"
+
+using namespace std;
+using namespace std::chrono;
+
+struct Job : public Runnable {
+	virtual void Run() override {
+		this_thread::sleep_for(milliseconds(2));
+	}
+};
+
+int main() {
+	// Sojourn time above target for a whole interval triggers dropping, and
+	// dropping stops once the sojourn time is back under target.
+	{
+		CoDel codel(5, 50);
+		auto high = milliseconds(20);
+		assert(!codel.OnDequeue(high, 10));
+		assert(!codel.OnDequeue(high, 10));
+		this_thread::sleep_for(milliseconds(60));
+		assert(codel.OnDequeue(high, 10));
+		assert(codel.Dropping());
+		assert(!codel.OnDequeue(high, 10)); // next drop is one interval away
+		this_thread::sleep_for(milliseconds(60));
+		assert(codel.OnDequeue(high, 10));
+		assert(!codel.OnDequeue(milliseconds(1), 10));
+		assert(!codel.Dropping());
+		assert(codel.Dropped() == 2);
+	}
+
+	// In POST mode, new tasks are rejected instead.
+	{
+		CoDel codel(5, 50, CoDel::Mode::POST);
+		assert(!codel.OnDequeue(milliseconds(20), 10));
+		this_thread::sleep_for(milliseconds(60));
+		assert(!codel.OnDequeue(milliseconds(20), 10));
+		assert(!codel.Admit());
+		assert(codel.Admit());
+		assert(codel.Dropped() == 1);
+	}
+
+	// An overloaded pool sheds tasks and reports them.
+	{
+		atomic<int> shed(0);
+		auto codel = make_shared<CoDel>(5, 20);
+		auto factory = make_shared<StdThreadFactory>();
+		FifoThreadPool pool(factory, 1, 200);
+		pool.SetQueueManager(codel, [&shed](const shared_ptr<Runnable> &) { ++shed; });
+		pool.Start();
+		for (int i = 0; i < 200; ++i) {
+			pool.Post(make_shared<Job>(), 500);
+		}
+		pool.Stop();
+		cout << "shed " << shed << " of 200 tasks" << endl;
+		assert(shed > 0 && (uint64_t)shed == codel->Dropped());
+	}
+
+	cout << "Exiting..." << endl;
+	return 0;
+}
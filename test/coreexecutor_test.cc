@@ -0,0 +1,146 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cassert>
+
+#include "stdthread.h"
+#include "coreexecutor.h"
+#include "taskhandle.h"
+
+using namespace std;
+
+const uint32_t kCores = 4;
+
+atomic<int> ran(0);
+CoreLocal<int> counts(kCores);
+atomic<bool> ok(true);
+
+// Job checks it runs on the expected core, then fans out to the next one.
+struct Job : public Runnable {
+	Job(CoreExecutor *ex, uint32_t core, int hops) : ex_(ex), core_(core), hops_(hops) {}
+	virtual void Run() override {
+		if (CoreExecutor::CurrentCore() != (int)core_) {
+			ok = false;
+		}
+		++counts.Get();
+		++ran;
+		if (hops_ > 0) {
+			uint32_t next = (core_ + 1) % ex_->Cores();
+			if (!ex_->PostTo(next, make_shared<Job>(ex_, next, hops_ - 1))) {
+				ok = false;
+			}
+		}
+	}
+	CoreExecutor *ex_;
+	uint32_t core_;
+	int hops_;
+};
+
+struct Sleep : public Runnable {
+	Sleep(int ms) : ms_(ms) {}
+	virtual void Run() override {
+		this_thread::sleep_for(chrono::milliseconds(ms_));
+		++ran;
+	}
+	int ms_;
+};
+
+int main() {
+	auto factory = make_shared<StdThreadFactory>();
+	{
+		// Work routed by key, posted from outside and between cores.
+		CoreExecutor ex(factory, kCores, 128);
+		assert(CoreExecutor::CurrentCore() == -1);
+		ex.Start();
+		const int N = 100, H = 10;
+		for (int i = 0; i < N; ++i) {
+			assert(ex.PostTo(i, make_shared<Job>(&ex, i % kCores, H)));
+		}
+		ex.Stop(); // runs the tasks posted by the cores as well
+		assert(ok);
+		assert(ran == N * (H + 1));
+		int sum = 0;
+		for (uint32_t c = 0; c < counts.Size(); ++c) {
+			assert(counts.At(c) > 0);
+			sum += counts.At(c);
+		}
+		assert(sum == ran);
+		assert(!ex.Post(make_shared<Sleep>(0)));
+	}
+	{
+		// Handles: cancel a task waiting behind a busy core.
+		ran = 0;
+		CoreExecutor ex(factory, 1, 4, false);
+		ex.Start();
+		auto busy = ex.Submit(make_shared<Sleep>(200));
+		assert(busy != nullptr);
+		this_thread::sleep_for(chrono::milliseconds(50));
+		assert(busy->State() == TaskHandle::Status::RUNNING);
+		vector<shared_ptr<TaskHandle>> handles;
+		for (int i = 0; i < 4; ++i) {
+			handles.push_back(ex.Submit(make_shared<Sleep>(0), 0, 0, 0, i % 2 + 1));
+			assert(handles.back() != nullptr);
+		}
+		assert(ex.Submit(make_shared<Sleep>(0), 0) == nullptr); // inbox full
+		assert(handles[0]->Cancel());
+		assert(ex.CancelGroup(2) == 2);
+		assert(ex.Submit(make_shared<Sleep>(0), 0) != nullptr);
+		auto expired = ex.Submit(make_shared<Sleep>(0), 1000, 10);
+		assert(handles[2]->Wait(1000));
+		assert(handles[2]->State() == TaskHandle::Status::DONE);
+		assert(expired->Wait(1000));
+		assert(expired->State() == TaskHandle::Status::EXPIRED);
+		ex.Stop();
+		assert(ran == 3);
+
+		// Restart after Stop, then drop pending work with StopNow.
+		ex.Start();
+		assert(ex.Post(make_shared<Sleep>(100)));
+		this_thread::sleep_for(chrono::milliseconds(20));
+		for (int i = 0; i < 2; ++i) {
+			assert(ex.Post(make_shared<Sleep>(0)));
+		}
+		vector<shared_ptr<TaskHandle>> dropped;
+		for (int i = 0; i < 2; ++i) {
+			dropped.push_back(ex.Submit(make_shared<Sleep>(0), 0));
+		}
+		ex.StopNow();
+		assert(ran == 4);
+		// The handles of the dropped tasks are not left pending.
+		for (auto &h : dropped) {
+			assert(h != nullptr && h->Wait(0));
+			assert(h->State() == TaskHandle::Status::CANCELLED);
+		}
+
+		// Nothing dropped is run, or waited for, after a restart.
+		ex.Start();
+		assert(ex.Post(make_shared<Sleep>(0)));
+		ex.Stop();
+		assert(ran == 5);
+	}
+	{
+		// Posting races with Stop(): every task accepted is run.
+		for (int round = 0; round < 50; ++round) {
+			ran = 0;
+			CoreExecutor ex(factory, 2, 1024, false);
+			ex.Start();
+			atomic<int> posted(0);
+			thread poster([&] {
+				while (ex.Post(make_shared<Sleep>(0), 0)) {
+					++posted;
+				}
+			});
+			while (posted == 0) {
+				this_thread::yield();
+			}
+			ex.Stop();
+			poster.join();
+			assert(ran == posted);
+		}
+	}
+	cout << "Exiting..." << endl;
+	return 0;
+}
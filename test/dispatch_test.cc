@@ -0,0 +1,89 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "tokenbucket.h"
+
+using namespace std;
+
+atomic<int> ran(0);
+
+struct Job : public Runnable {
+	virtual void Run() override {
+		++ran;
+	}
+};
+
+// Post M tasks that expire after 1s to a pool limited to 'rate' tasks per
+// second, and count how the tasks ended.
+void run(RateLimitMode mode, uint32_t rate, int M) {
+	ran = 0;
+	auto tb = make_shared<TokenBucket>(rate);
+	auto factory = make_shared<StdThreadFactory>();
+	PriThreadPool pool(factory, tb, 4, M);
+	pool.SetRateLimitMode(mode);
+	pool.Start();
+
+	vector<shared_ptr<TaskHandle>> handles;
+	for (int i = 0; i < M; ++i) {
+		handles.push_back(pool.Submit(make_shared<Job>(), 500, 1000, i % 3));
+	}
+	for (auto &h : handles) {
+		assert(h->Wait(5000));
+	}
+	int done = 0, expired = 0;
+	for (auto &h : handles) {
+		done += h->State() == TaskHandle::Status::DONE;
+		expired += h->State() == TaskHandle::Status::EXPIRED;
+	}
+	pool.Stop();
+	cout << (mode == RateLimitMode::DISPATCH ? "dispatch" : "worker")
+		<< ": done " << done << ", expired " << expired << endl;
+	assert(done == ran && done + expired == M);
+	assert(done <= (int)rate * 2);
+}
+
+struct SlowJob : public Runnable {
+	virtual void Run() override {
+		this_thread::sleep_for(chrono::milliseconds(300));
+		++ran;
+	}
+};
+
+// StopNow returns while the dispatcher holds a task for the full ready queue
+// of busy workers, and every task ends.
+void stopNow() {
+	ran = 0;
+	auto tb = make_shared<TokenBucket>(1000, 1000);
+	FifoThreadPool pool(make_shared<StdThreadFactory>(), tb, 2, 100);
+	pool.SetRateLimitMode(RateLimitMode::DISPATCH);
+	pool.Start();
+	vector<shared_ptr<TaskHandle>> handles;
+	for (int i = 0; i < 20; ++i) {
+		handles.push_back(pool.Submit(make_shared<SlowJob>()));
+	}
+	this_thread::sleep_for(chrono::milliseconds(100));
+	pool.StopNow();
+	int done = 0, cancelled = 0;
+	for (auto &h : handles) {
+		assert(h->Wait(0));
+		done += h->State() == TaskHandle::Status::DONE;
+		cancelled += h->State() == TaskHandle::Status::CANCELLED;
+	}
+	assert(done == ran && done + cancelled == 20);
+	assert(done <= 2);
+}
+
+int main() {
+	run(RateLimitMode::WORKER, 5, 20);
+	run(RateLimitMode::DISPATCH, 5, 20);
+	stopNow();
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,93 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cassert>
+
+#include "fairqueue.h"
+#include "stdthread.h"
+#include "threadpool_impl.h"
+
+using namespace std;
+
+struct Item {
+	Item() : cls_(0) {}
+	Item(int c) : cls_(c) {}
+	int GetPriority() const {
+		return cls_;
+	}
+	int cls_;
+};
+
+atomic<int> done[2];
+
+struct Job : public Runnable {
+	virtual void Run() override {
+		this_thread::sleep_for(chrono::milliseconds(ms_));
+		++done[cls_];
+	}
+	Job (int c, int ms) : cls_(c), ms_(ms) {}
+	int cls_, ms_;
+};
+
+int main() {
+	// With equal costs, classes are served in proportion to their weights.
+	{
+		FairQueue<Item> q;
+		q.setWeight(1, 3);
+		for (int i = 0; i < 400; ++i) {
+			q.push(Item(i % 2));
+		}
+		int n[2] = {0, 0};
+		for (int i = 0; i < 200; ++i) {
+			auto itm = q.pop();
+			q.complete(itm, 100);
+			++n[itm.cls_];
+		}
+		cout << "weights 1:3 -> " << n[0] << ":" << n[1] << endl;
+		assert(n[1] > 2 * n[0]);
+		while (q.size() > 0) {
+			q.pop();
+		}
+	}
+
+	// Fairness is by cost: a class with 10x more expensive items gets about
+	// 10x fewer of them served.
+	{
+		FairQueue<Item> q;
+		for (int i = 0; i < 400; ++i) {
+			q.push(Item(i % 2));
+		}
+		int n[2] = {0, 0};
+		for (int i = 0; i < 110; ++i) {
+			auto itm = q.pop();
+			q.complete(itm, itm.cls_ == 0 ? 1000 : 100);
+			++n[itm.cls_];
+		}
+		cout << "costs 10:1 -> " << n[0] << ":" << n[1] << endl;
+		assert(n[1] > 5 * n[0]);
+	}
+
+	// A noisy class cannot starve a quiet one in the pool.
+	{
+		auto factory = make_shared<StdThreadFactory>();
+		FairThreadPool pool(factory, 1, 200);
+		pool.SetWeight(1, 2);
+		pool.Start();
+		for (int i = 0; i < 100; ++i) {
+			pool.Post(make_shared<Job>(0, 2), -1, 0, 0);
+		}
+		for (int i = 0; i < 10; ++i) {
+			pool.Post(make_shared<Job>(1, 2), -1, 0, 1);
+		}
+		this_thread::sleep_for(chrono::milliseconds(100));
+		int quiet = done[1], noisy = done[0];
+		pool.StopNow();
+		cout << "noisy " << noisy << " quiet " << quiet << endl;
+		assert(quiet == 10 && noisy < 100);
+	}
+
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,90 @@
+// Measures what padding the lock-free fields of the pool buys. Channel keeps
+// its size, polled without the lock through Pending(), away from the cache
+// lines of the lock and the queue; the pool and its workers do the same with
+// their states. The bench runs the same load on both layouts of such an
+// object, so the comparison needs no older build:
+//   layout_bench [lockers] [pollers] [ms]
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <cstdlib>
+
+#include "def.h"
+
+using namespace std;
+
+atomic<uint64_t> sink(0); // keeps the polled values alive
+
+// Shared has the fields of a Channel: a lock, the data it protects, and a
+// size that is written under the lock but read without it.
+template<bool Padded>
+struct Shared {
+	mutex mtx;
+	uint64_t items = 0;
+	atomic<uint32_t> size{0};
+};
+
+template<>
+struct Shared<true> {
+	mutex mtx;
+	uint64_t items = 0;
+	char pad0[CACHELINE_SIZE];
+	atomic<uint32_t> size{0};
+	char pad1[CACHELINE_SIZE];
+};
+
+template<bool Padded>
+void bench(const string &name, int lockers, int pollers, int ms) {
+	Shared<Padded> s;
+	atomic<bool> stop(false);
+	atomic<uint64_t> ops(0);
+	atomic<uint64_t> polls(0);
+	vector<thread> threads;
+	for (int i = 0; i < lockers; ++i) {
+		threads.emplace_back([&] {
+			uint64_t n = 0;
+			while (!stop.load(memory_order_relaxed)) {
+				lock_guard<mutex> lck(s.mtx);
+				++s.items;
+				s.size.store(static_cast<uint32_t>(s.items % 1024), memory_order_relaxed);
+				++n;
+			}
+			ops += n;
+		});
+	}
+	for (int i = 0; i < pollers; ++i) {
+		threads.emplace_back([&] {
+			uint64_t n = 0, sum = 0;
+			while (!stop.load(memory_order_relaxed)) {
+				sum += s.size.load(memory_order_relaxed);
+				++n;
+			}
+			polls += n;
+			sink += sum;
+		});
+	}
+	auto start = chrono::steady_clock::now();
+	this_thread::sleep_for(chrono::milliseconds(ms));
+	stop = true;
+	for (auto &t : threads) {
+		t.join();
+	}
+	auto elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cerr << name << lockers << " lockers, " << pollers << " pollers: "
+		<< static_cast<uint64_t>(ops / elapsed) << " locked ops/s, "
+		<< static_cast<uint64_t>(polls / elapsed) << " polls/s" << endl;
+}
+
+int main(int argc, char **argv) {
+	int lockers = argc > 1 ? atoi(argv[1]) : 4;
+	int pollers = argc > 2 ? atoi(argv[2]) : 2;
+	int ms = argc > 3 ? atoi(argv[3]) : 1000;
+	bench<false>("unpadded: ", lockers, pollers, ms);
+	bench<true>("padded:   ", lockers, pollers, ms);
+	return 0;
+}
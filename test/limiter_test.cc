@@ -0,0 +1,135 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "adaptivelimit.h"
+
+using namespace std;
+using namespace std::chrono;
+
+void testAimd() {
+	AimdLimiter l(10, 4, 1, 8);
+	assert(l.Limit() == 4);
+	for (int i = 0; i < 4; ++i) {
+		assert(l.Acquire(0));
+	}
+	assert(!l.Acquire(0));
+	assert(!l.Acquire(10));
+	assert(l.InFlight() == 4);
+	// Fast tasks under load raise the limit, up to the maximum.
+	for (int i = 0; i < 10; ++i) {
+		l.Release(milliseconds(1));
+		assert(l.Acquire(0));
+	}
+	assert(l.Limit() == 8);
+	// Slow tasks back off.
+	l.Release(milliseconds(50));
+	assert(l.Limit() == 7);
+	for (int i = 0; i < 3; ++i) {
+		l.Release(milliseconds(50));
+	}
+	assert(l.InFlight() == 0);
+	assert(l.Limit() < 7);
+}
+
+void testGradient2() {
+	Gradient2Limiter l(10, 1, 100);
+	auto sample = [&](int us) {
+		// Keep the limiter fully used, as under sustained load.
+		while (l.Acquire(0)) {}
+		l.Release(microseconds(us));
+	};
+	for (int i = 0; i < 200; ++i) {
+		sample(1000);
+	}
+	uint32_t grown = l.Limit();
+	assert(grown > 10); // latency steady: probe for more
+	// Latency triples: the limit shrinks, but smoothly.
+	uint32_t prev = grown;
+	for (int i = 0; i < 50; ++i) {
+		sample(3000);
+		assert(l.Limit() * 2 >= prev);
+		prev = l.Limit();
+	}
+	assert(l.Limit() < grown);
+}
+
+// The downstream takes 20ms per query, beyond the threshold of the limiter
+// whatever the scheduling, as sleeps only ever run longer.
+atomic<int> running(0);
+atomic<int> peak(0);
+
+struct Query : public Runnable {
+	virtual void Run() override {
+		int n = ++running;
+		int m = peak;
+		while (n > m && !peak.compare_exchange_weak(m, n)) {}
+		this_thread::sleep_for(milliseconds(20));
+		--running;
+	}
+};
+
+void testPool() {
+	auto factory = make_shared<StdThreadFactory>();
+	auto limiter = make_shared<AimdLimiter>(8, 8, 2, 8);
+	FifoThreadPool pool(factory, 8, 500);
+	pool.SetConcurrencyLimiter(limiter);
+	pool.Start();
+	for (int i = 0; i < 40; ++i) {
+		assert(pool.Post(make_shared<Query>()));
+	}
+	pool.Stop();
+	// Every sample is slow: the limit backs off to its minimum, and never
+	// lets more tasks run than its maximum.
+	assert(limiter->InFlight() == 0);
+	assert(limiter->Limit() == 2);
+	assert(peak <= 8);
+
+	// At the minimum, the pool runs no more tasks at once than the limit,
+	// though it has more workers.
+	peak = 0;
+	pool.Start();
+	for (int i = 0; i < 20; ++i) {
+		assert(pool.Post(make_shared<Query>()));
+	}
+	pool.Stop();
+	assert(limiter->Limit() == 2);
+	assert(peak <= 2);
+}
+
+// Tasks beyond the limit wait in the queue, not in a worker, so they can
+// still be cancelled.
+void testQueued() {
+	auto factory = make_shared<StdThreadFactory>();
+	auto limiter = make_shared<AimdLimiter>(1000, 1, 1, 1);
+	FifoThreadPool pool(factory, 4, 10);
+	pool.SetConcurrencyLimiter(limiter);
+	pool.Start();
+	running = 0;
+	auto first = pool.Submit(make_shared<Query>());
+	while (running == 0) {
+		this_thread::sleep_for(milliseconds(1));
+	}
+	auto second = pool.Submit(make_shared<Query>());
+	this_thread::sleep_for(milliseconds(5)); // idle workers would take it
+	assert(pool.Pending() == 1);
+	assert(second->Cancel());
+	pool.Stop();
+	assert(first->State() == TaskHandle::Status::DONE);
+	assert(second->State() == TaskHandle::Status::CANCELLED);
+	assert(limiter->InFlight() == 0);
+}
+
+int main() {
+	testAimd();
+	testGradient2();
+	testPool();
+	testQueued();
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,46 @@
+// Measures the per-task cost of the pool policies: one producer posts
+// trivial tasks to one worker through pools that differ in one policy.
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <cstdlib>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+
+using namespace std;
+
+struct Nop : public Runnable {
+	virtual void Run() override {}
+};
+
+template<class Pool>
+void bench(const string &name, int n) {
+	auto factory = make_shared<StdThreadFactory>();
+	Pool pool(factory, 1, 1024);
+	pool.Start();
+	auto job = make_shared<Nop>();
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < n; ++i) {
+		pool.Post(job, -1, 1000);
+	}
+	pool.Stop(); // runs the queued tasks
+	auto ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	cerr << name << ": " << ns / n << " ns/task" << endl;
+}
+
+template<class Expiry, class RateLimit, class Stats>
+using Pool = ThreadPoolImpl<Task, Channel<Task>, PoolPolicies<Expiry, RateLimit, Stats, NoLog>>;
+
+int main(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 200000;
+	bench<LeanThreadPool>("lean              ", n);
+	bench<Pool<CheckExpiry, NoRateLimit, NoStats>>("+ expiry          ", n);
+	bench<Pool<NoExpiry, UseRateLimit, NoStats>>("+ rate limit check", n);
+	bench<Pool<NoExpiry, NoRateLimit, CountStats>>("+ stats           ", n);
+	bench<FifoThreadPool>("default           ", n);
+	bench<Pool<CheckExpiry, UseRateLimit, CountStats>>("all               ", n);
+	return 0;
+}
@@ -0,0 +1,67 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+
+using namespace std;
+
+atomic<int> ran(0);
+
+struct Job : public Runnable {
+	Job(int ms) : ms_(ms) {}
+	virtual void Run() override {
+		this_thread::sleep_for(chrono::milliseconds(ms_));
+		++ran;
+	}
+	int ms_;
+};
+
+// Scratch records whether the task got a scratch arena.
+struct Scratch : public Runnable {
+	virtual void Run() override {
+		arena = CurrentWorker::Arena();
+	}
+	Arena *arena = nullptr;
+};
+
+using CountingPool = ThreadPoolImpl<Task, Channel<Task>, PoolPolicies<CheckExpiry, NoRateLimit, CountStats>>;
+
+int main() {
+	auto factory = make_shared<StdThreadFactory>();
+	{
+		// Without expiry, an expiration is ignored.
+		LeanThreadPool pool(factory, 1, 10);
+		pool.Start();
+		assert(pool.Post(make_shared<Job>(50)));
+		auto h = pool.Submit(make_shared<Job>(0), -1, 1);
+		// Nor does it give tasks an arena.
+		auto s = make_shared<Scratch>();
+		assert(pool.Post(s));
+		pool.Stop();
+		assert(h->State() == TaskHandle::Status::DONE);
+		assert(ran == 2);
+		assert(s->arena == nullptr);
+	}
+	{
+		// Stats count the outcome of every task.
+		ran = 0;
+		CountingPool pool(factory, 1, 10);
+		pool.Start();
+		assert(pool.Post(make_shared<Job>(50)));
+		assert(pool.Post(make_shared<Job>(0), -1, 1)); // expires behind the first
+		assert(pool.Post(make_shared<Job>(0)));
+		pool.Stop();
+		auto &stats = pool.GetStats();
+		assert(ran == 2);
+		assert(stats.run == 2);
+		assert(stats.expired == 1);
+		assert(stats.busyNs >= 50 * 1000 * 1000);
+	}
+	cout << "Exiting..." << endl;
+	return 0;
+}
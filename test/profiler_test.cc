@@ -0,0 +1,121 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "tokenbucket.h"
+
+using namespace std;
+
+// Spin burns CPU for ms milliseconds.
+struct Spin : public Runnable {
+	explicit Spin(int ms) : ms_(ms) {}
+	virtual void Run() override {
+		auto end = chrono::steady_clock::now() + chrono::milliseconds(ms_);
+		volatile uint64_t x = 0;
+		while (chrono::steady_clock::now() < end) {
+			++x;
+		}
+	}
+	int ms_;
+};
+
+// Nap sleeps for ms milliseconds.
+struct Nap : public Runnable {
+	explicit Nap(int ms) : ms_(ms) {}
+	virtual void Run() override {
+		this_thread::sleep_for(chrono::milliseconds(ms_));
+	}
+	int ms_;
+};
+
+// Tasks that run inside another one, as TaskGroup::Wait() does, are not
+// counted twice: the outer task is charged its exclusive usage.
+void testNested() {
+	TaskProfiler profiler;
+	auto start = chrono::steady_clock::now();
+	profiler.Begin();
+	Spin(20).Run();
+	for (int i = 0; i < 2; ++i) {
+		profiler.Begin();
+		Spin(30).Run();
+		profiler.End("inner", chrono::nanoseconds(0));
+	}
+	profiler.End("outer", chrono::nanoseconds(0));
+	auto wall = chrono::steady_clock::now() - start;
+
+	auto top = profiler.Top(10);
+	assert(top.size() == 2);
+	assert(top[0].tag == "inner" && top[0].tasks == 2);
+	assert(top[1].tag == "outer" && top[1].tasks == 1);
+	assert(top[0].wall >= chrono::milliseconds(60));
+	assert(top[1].wall >= chrono::milliseconds(20));
+	assert(top[1].wall < top[0].wall);
+	assert(top[0].wall + top[1].wall <= wall);
+}
+
+// In DISPATCH mode the tasks wait for their tokens in the dispatcher; the
+// wait is still reported as throttled.
+void testDispatchThrottle() {
+	auto tb = make_shared<TokenBucket>(10, 1);
+	ProfiledThreadPool pool(make_shared<StdThreadFactory>(), tb, 1, 20);
+	pool.SetRateLimitMode(RateLimitMode::DISPATCH);
+	tb->Start();
+	pool.Start();
+	for (int i = 0; i < 3; ++i) {
+		assert(pool.PostTagged("limited", make_shared<Nap>(0)));
+	}
+	pool.Stop();
+	tb->Stop();
+	auto top = pool.GetProfiler().Top(1);
+	assert(top.size() == 1 && top[0].tag == "limited" && top[0].tasks == 3);
+	// A token every 100ms, starting empty.
+	assert(top[0].throttled >= chrono::milliseconds(250));
+}
+
+// Tasks are accounted to their tags.
+void testTop() {
+	auto factory = make_shared<StdThreadFactory>();
+	ProfiledThreadPool pool(factory, 1, 20);
+	auto &profiler = pool.GetProfiler();
+	profiler.EnableCounters(true); // may not be permitted; tasks are profiled anyway
+	pool.Start();
+	for (int i = 0; i < 3; ++i) {
+		assert(pool.PostTagged("spin", make_shared<Spin>(20)));
+		assert(pool.PostTagged("nap", make_shared<Nap>(20)));
+	}
+	// The same tag at another address counts as the same type.
+	string spin("spin");
+	assert(pool.PostTagged(spin.c_str(), make_shared<Spin>(20)));
+	assert(pool.Post(make_shared<Nap>(1)));
+	pool.Stop();
+
+	auto top = profiler.Top(10);
+	assert(top.size() == 3);
+	assert(top[0].tag == "spin");
+	assert(top[0].tasks == 4);
+	assert(top[0].cpu > top[1].cpu);
+	assert(top[0].wall >= chrono::milliseconds(80));
+
+	auto waiting = profiler.Top(1, TaskProfiler::Order::WAIT);
+	assert(waiting.size() == 1);
+	assert(waiting[0].tag == "nap");
+	assert(waiting[0].tasks == 3);
+	assert(waiting[0].Wait() >= chrono::milliseconds(50));
+	assert(waiting[0].voluntary >= 3);
+
+	cout << profiler.Report(5);
+	profiler.Clear();
+	assert(profiler.Top(10).empty());
+}
+
+int main() {
+	testNested();
+	testDispatchThrottle();
+	testTop();
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,236 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cassert>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "reactor.h"
+
+using namespace std;
+
+const int kPipes = 3;
+
+bool waitFor(const function<bool()> &done) {
+	auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+	while (!done()) {
+		if (chrono::steady_clock::now() > deadline) {
+			return false;
+		}
+		this_thread::sleep_for(chrono::milliseconds(5));
+	}
+	return true;
+}
+
+void test(Reactor::Mode mode) {
+	auto factory = make_shared<StdThreadFactory>();
+	auto pool = make_shared<FifoThreadPool>(factory, 3, 50);
+	pool->Start();
+	Reactor reactor(factory, pool, mode, 2);
+	reactor.Start();
+
+	// Bytes written to pipes are read by the callbacks.
+	int fds[kPipes][2];
+	atomic<int> bytes(0);
+	atomic<int> concurrent(0);
+	atomic<bool> overlap(false);
+	for (int i = 0; i < kPipes; ++i) {
+		assert(pipe(fds[i]) == 0);
+		int rfd = fds[i][0];
+		assert(reactor.Add(rfd, EPOLLIN, [&, rfd](uint32_t events) {
+			assert(events & EPOLLIN);
+			if (concurrent++ != 0) {
+				overlap = true; // one-shot: never two callbacks for a pipe
+			}
+			char buf[16];
+			ssize_t n = read(rfd, buf, 1); // one byte at a time, to need re-arming
+			if (n > 0) {
+				bytes += n;
+			}
+			--concurrent;
+		}));
+		assert(!reactor.Add(rfd, EPOLLIN, nullptr));
+	}
+	for (int round = 0; round < 4; ++round) {
+		for (int i = 0; i < kPipes; ++i) {
+			assert(write(fds[i][1], "ab", 2) == 2);
+		}
+	}
+	assert(waitFor([&] { return bytes == kPipes * 8; }));
+	assert(!overlap);
+
+	// A removed descriptor is no longer watched.
+	assert(reactor.Remove(fds[0][0]));
+	assert(!reactor.Remove(fds[0][0]));
+	assert(write(fds[0][1], "x", 1) == 1);
+	this_thread::sleep_for(chrono::milliseconds(50));
+	assert(bytes == kPipes * 8);
+
+	// Socket pairs work the same.
+	int sv[2];
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	atomic<int> msgs(0);
+	assert(reactor.Add(sv[1], EPOLLIN, [&](uint32_t) {
+		char buf[64];
+		if (read(sv[1], buf, sizeof(buf)) > 0) {
+			++msgs;
+		}
+	}));
+	assert(write(sv[0], "hello", 5) == 5);
+	assert(waitFor([&] { return msgs == 1; }));
+
+	// Timers: one-shot and periodic.
+	atomic<int> once(0), ticks(0);
+	reactor.AddTimer(20, [&] { ++once; });
+	auto id = reactor.AddTimer(10, [&] { ++ticks; }, 10);
+	auto never = reactor.AddTimer(10000, [&] { assert(false); });
+	assert(waitFor([&] { return once == 1 && ticks >= 3; }));
+	assert(reactor.CancelTimer(id));
+	assert(reactor.CancelTimer(never));
+	assert(!reactor.CancelTimer(id));
+	this_thread::sleep_for(chrono::milliseconds(30));
+	int t = ticks;
+	this_thread::sleep_for(chrono::milliseconds(50));
+	assert(ticks == t);
+	assert(once == 1);
+
+	reactor.Stop();
+	pool->Stop();
+	for (int i = 0; i < kPipes; ++i) {
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	close(sv[0]);
+	close(sv[1]);
+}
+
+struct Fn : public Runnable {
+	explicit Fn(function<void()> f) : f_(f) {}
+	virtual void Run() override {
+		f_();
+	}
+	function<void()> f_;
+};
+
+// An event harvested before its descriptor is removed is dropped, even if its
+// callback had not started yet.
+void testRemoveHarvested() {
+	auto factory = make_shared<StdThreadFactory>();
+	auto pool = make_shared<FifoThreadPool>(factory, 1, 50);
+	pool->Start();
+	Reactor reactor(factory, pool);
+	reactor.Start();
+	atomic<bool> release(false), fired(false), drained(false);
+	assert(pool->Post(make_shared<Fn>([&release] {
+		while (!release) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	})));
+	int fds[2];
+	assert(pipe(fds) == 0);
+	assert(reactor.Add(fds[0], EPOLLIN, [&fired](uint32_t) { fired = true; }));
+	assert(write(fds[1], "x", 1) == 1);
+	this_thread::sleep_for(chrono::milliseconds(50)); // queued behind the blocker
+	assert(reactor.Remove(fds[0]));
+	assert(pool->Post(make_shared<Fn>([&drained] { drained = true; })));
+	release = true;
+	assert(waitFor([&] { return drained.load(); }));
+	assert(!fired);
+	reactor.Stop();
+	pool->Stop();
+	close(fds[0]);
+	close(fds[1]);
+}
+
+// A batch the pool discards does not hold up Stop(), and its descriptor is
+// re-armed.
+void testDiscarded() {
+	auto factory = make_shared<StdThreadFactory>();
+	auto pool = make_shared<FifoThreadPool>(factory, 1, 50);
+	pool->Start();
+	Reactor reactor(factory, pool);
+	reactor.Start();
+	atomic<bool> release(false);
+	atomic<int> fired(0);
+	assert(pool->Post(make_shared<Fn>([&release] {
+		while (!release) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	})));
+	int fds[2];
+	assert(pipe(fds) == 0);
+	int rfd = fds[0];
+	assert(reactor.Add(rfd, EPOLLIN, [&fired, rfd](uint32_t) {
+		char c;
+		if (read(rfd, &c, 1) == 1) {
+			++fired;
+		}
+	}));
+	assert(write(fds[1], "x", 1) == 1);
+	this_thread::sleep_for(chrono::milliseconds(50)); // queued behind the blocker
+	thread releaser([&release] {
+		this_thread::sleep_for(chrono::milliseconds(20));
+		release = true;
+	});
+	pool->StopNow(); // discards the batch
+	releaser.join();
+	// Re-armed, the descriptor is reported again; the stopped pool turns
+	// the batch away, so the reactor thread runs it.
+	assert(waitFor([&] { return fired == 1; }));
+	reactor.Stop();
+	pool->Stop();
+	close(fds[0]);
+	close(fds[1]);
+}
+
+// Modify() while a callback runs does not let the next one start before it
+// returns.
+void testModifyWhileRunning() {
+	auto factory = make_shared<StdThreadFactory>();
+	auto pool = make_shared<FifoThreadPool>(factory, 3, 50);
+	pool->Start();
+	Reactor reactor(factory, pool);
+	reactor.Start();
+	int fds[2];
+	assert(pipe(fds) == 0);
+	int rfd = fds[0];
+	atomic<int> concurrent(0), calls(0);
+	atomic<bool> overlap(false), entered(false);
+	assert(reactor.Add(rfd, EPOLLIN, [&, rfd](uint32_t) {
+		if (concurrent++ != 0) {
+			overlap = true;
+		}
+		entered = true;
+		this_thread::sleep_for(chrono::milliseconds(50));
+		char c;
+		if (read(rfd, &c, 1) == 1) { // leaves the second byte ready
+			++calls;
+		}
+		--concurrent;
+	}));
+	assert(write(fds[1], "ab", 2) == 2);
+	assert(waitFor([&] { return entered.load(); }));
+	assert(reactor.Modify(rfd, EPOLLIN));
+	assert(waitFor([&] { return calls == 2; }));
+	assert(!overlap);
+	reactor.Stop();
+	pool->Stop();
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int main() {
+	testRemoveHarvested();
+	testDiscarded();
+	testModifyWhileRunning();
+	test(Reactor::Mode::DISPATCH);
+	test(Reactor::Mode::LEADER_FOLLOWERS);
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,105 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cassert>
+
+#include "ringqueue.h"
+#include "channel.h"
+
+using namespace std;
+
+atomic<size_t> allocations(0);
+
+void* operator new(size_t n) {
+	++allocations;
+	void *p = malloc(n > 0 ? n : 1);
+	if (p == nullptr) {
+		throw bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+int main() {
+	// Capacity is rounded up to a power of two.
+	{
+		RingQueue<int> q(5);
+		assert(q.capacity() == 8);
+		assert(q.size() == 0);
+	}
+
+	// FIFO order across many wrap-arounds, without allocating.
+	{
+		RingQueue<int> q(4);
+		size_t before = allocations;
+		int next = 0, expect = 0;
+		for (int round = 0; round < 1000; ++round) {
+			for (int i = 0; i < 3; ++i) {
+				q.push(next++);
+			}
+			for (int i = 0; i < 3; ++i) {
+				assert(q.pop() == expect++);
+			}
+		}
+		assert(allocations == before);
+		assert(q.capacity() == 4);
+	}
+
+	// Pushing beyond the capacity grows the ring and keeps the order.
+	{
+		RingQueue<string> q(2);
+		q.push("a");
+		q.push("b");
+		assert(q.pop() == "a");
+		q.push("c");
+		q.push("d");
+		q.push("e");
+		assert(q.capacity() == 4);
+		assert(q.size() == 4);
+		assert(q.pop() == "b");
+		assert(q.pop() == "c");
+		assert(q.pop() == "d");
+		assert(q.pop() == "e");
+		q.push("left for the destructor");
+	}
+
+	// Large rings are mapped; items are still constructed in place.
+	{
+		RingQueue<shared_ptr<int>> q(1 << 18); // 4MB of slots
+		auto p = make_shared<int>(7);
+		for (int i = 0; i < 1000; ++i) {
+			q.push(p);
+		}
+		assert(p.use_count() == 1001);
+		for (int i = 0; i < 1000; ++i) {
+			assert(*q.pop() == 7);
+		}
+		assert(p.use_count() == 1);
+	}
+
+	// Channel sizes its default ring from the limit: no allocation on the
+	// Put/Get path.
+	{
+		Channel<int> chan(16);
+		size_t before = allocations;
+		for (int i = 0; i < 10000; ++i) {
+			assert(chan.Put(i, 0));
+			int v;
+			assert(chan.Get(v, 0));
+			assert(v == i);
+		}
+		assert(allocations == before);
+	}
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cassert>
+
+#include "channel.h"
+#include "shardedchannel.h"
+#include "priqueue.h"
+#include "channel_util.h"
+
+using namespace std;
+using namespace std::chrono;
+
+struct Item {
+	Item() : value_(0) {}
+	Item(int p, int v) : priority_(p), value_(v) {}
+	Priority priority_;
+	int value_;
+	int GetPriority() {
+		return priority_.GetPriority();
+	}
+};
+
+namespace std{
+template<>
+class less<Item> {
+	public:
+		bool operator() (const Item& x, const Item& y) const {
+			return std::less<Priority>()(x.priority_, y.priority_);
+		}
+};
+}
+
+int main() {
+	// Ordering within a single shard is preserved.
+	{
+		ShardedChannel<Item, PriQueue<Item>> chan(10, 1);
+		for (int i = 0; i < 10; ++i) {
+			chan.Put(Item(i, i), -1);
+		}
+		for (int i = 9; i >= 0; --i) {
+			assert(chan.Get(0).value_ == i);
+		}
+	}
+
+	// Capacity, nonblocking and timed calls span all shards.
+	{
+		ShardedChannel<Item> chan(8, 4);
+		for (int i = 0; i < 8; ++i) {
+			assert(chan.Put(Item(0, i), 0));
+		}
+		assert(chan.Size() == 8);
+		assert(!chan.Put(Item(0, 8), 0));
+		assert(!chan.Put(Item(0, 8), 10));
+		Item itm;
+		for (int i = 0; i < 8; ++i) {
+			assert(chan.Get(itm, 0));
+		}
+		assert(!chan.Get(itm, 0));
+		assert(!chan.Get(itm, 10));
+	}
+
+	// Capacity that does not divide evenly is not rounded up.
+	{
+		ShardedChannel<Item> chan(10, 4);
+		int n = 0;
+		while (chan.Put(Item(0, n), 0)) {
+			++n;
+		}
+		assert(n == 10);
+	}
+
+	// A blocked Get is woken by a Put into any shard, and by Close().
+	{
+		ShardedChannel<Item> chan(8, 4);
+		thread t([&chan] {
+			this_thread::sleep_for(milliseconds(20));
+			chan.Put(Item(0, 42), -1);
+		});
+		Item itm;
+		assert(chan.Get(itm, -1) && itm.value_ == 42);
+		t.join();
+
+		thread c([&chan] {
+			this_thread::sleep_for(milliseconds(20));
+			chan.Close();
+		});
+		assert(!chan.Get(itm, -1));
+		c.join();
+	}
+
+	// Costs are reported to the shard the item was taken from, not to the
+	// home shard of the consumer.
+	{
+		ShardedChannel<Item, Tally<Item>> chan(64, 4);
+		for (int round = 0; round < 100; ++round) {
+			chan.Put(Item(0, round), -1);
+			Item itm;
+			assert(chan.Get(itm, 0) && itm.value_ == round);
+			chan.Complete(itm, 1);
+		}
+		int shards = 0;
+		chan.Visit([&shards](Tally<Item> &t) {
+			assert(t.completed == t.pushed);
+			shards += t.pushed > 0;
+		});
+		assert(shards > 1);
+	}
+
+	// Every item is taken once by blocking and timed consumers.
+	{
+		ShardedChannel<Item> chan(8, 4);
+		pump<Item>(chan, 4, 4, 20000, [](int i) { return Item(0, i); }, 
+				[](const Item &itm) { return itm.value_; }, 1);
+	}
+
+	// See shardedchannel.h for when sharding pays off.
+	const int P = 4, C = 4, N = 100000;
+	auto make = [](int i) { return Item(0, i); };
+	auto value = [](const Item &itm) { return itm.value_; };
+	{
+		Channel<Item> chan(1000);
+		cout << "Channel:        " << pump<Item>(chan, P, C, N, make, value).count() << " ms" << endl;
+	}
+	{
+		ShardedChannel<Item> chan(1000, 4);
+		cout << "ShardedChannel: " << pump<Item>(chan, P, C, N, make, value).count() << " ms" << endl;
+	}
+
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,290 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <cassert>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "stdthread.h"
+#include "tokenbucket.h"
+#include "sharedexecutor.h"
+#include "taskgroup.h"
+
+using namespace std;
+using namespace std::chrono;
+
+atomic<int> created(0);
+
+class CountingFactory : public ThreadFactory {
+	public:
+		virtual std::unique_ptr<Thread> NewThread() override {
+			++created;
+			return make_unique<StdThread>(StdThread::DtorAction::join);
+		}
+};
+
+struct Fn : public Runnable {
+	explicit Fn(function<void()> f) : f_(f) {}
+	virtual void Run() override {
+		f_();
+	}
+	function<void()> f_;
+};
+
+// Gauge records the highest number of tasks running at once.
+struct Gauge {
+	Gauge() : now(0), max(0) {}
+	void Enter() {
+		int n = ++now;
+		int m = max;
+		while (n > m && !max.compare_exchange_weak(m, n)) {}
+	}
+	void Leave() {
+		--now;
+	}
+	atomic<int> now;
+	atomic<int> max;
+};
+
+shared_ptr<Runnable> work(Gauge &all, Gauge &pool, atomic<int> &ran) {
+	return make_shared<Fn>([&] {
+		all.Enter();
+		pool.Enter();
+		this_thread::sleep_for(milliseconds(2));
+		pool.Leave();
+		all.Leave();
+		++ran;
+	});
+}
+
+void testShared() {
+	SharedExecutor ex(make_shared<CountingFactory>(), 3);
+	LogicalFifoPool a(ex, 100);
+	LogicalPriPool b(ex, 100);
+	LogicalFifoPool capped(ex, 100, 0, 1);
+	a.Start();
+	b.Start();
+	capped.Start();
+	Gauge all, ga, gb, gc;
+	atomic<int> ran(0);
+	for (int i = 0; i < 30; ++i) {
+		assert(a.Post(work(all, ga, ran)));
+		assert(b.Post(work(all, gb, ran), -1, 0, i % 3));
+		assert(capped.Post(work(all, gc, ran)));
+	}
+	assert(a.WaitIdle());
+	assert(b.WaitIdle());
+	capped.Stop();
+	assert(ran == 90);
+	assert(created == 3); // the pools have no threads of their own
+	assert(all.max <= 3);
+	assert(gc.max == 1);
+	a.Stop();
+	b.Stop();
+	assert(!a.Post(work(all, ga, ran)));
+}
+
+void testPriority() {
+	SharedExecutor ex(make_shared<StdThreadFactory>(), 1);
+	LogicalFifoPool low(ex, 100, 0);
+	LogicalFifoPool high(ex, 100, 1);
+	low.Start();
+	high.Start();
+	atomic<bool> release(false);
+	mutex mtx;
+	vector<int> order;
+	auto record = [&](int v) {
+		return make_shared<Fn>([&, v] {
+			lock_guard<mutex> lck(mtx);
+			order.push_back(v);
+		});
+	};
+	// Hold the only thread.
+	assert(low.Post(make_shared<Fn>([&] { while (!release) { this_thread::yield(); } })));
+	this_thread::sleep_for(milliseconds(20));
+	for (int i = 0; i < 5; ++i) {
+		assert(low.Post(record(0)));
+		assert(high.Post(record(1)));
+	}
+	release = true;
+	low.Stop();
+	high.Stop();
+	assert(order.size() == 10);
+	for (int i = 0; i < 5; ++i) {
+		assert(order[i] == 1);
+	}
+}
+
+void testRateLimit() {
+	// A throttled pool does not hold the thread it would run on.
+	SharedExecutor ex(make_shared<StdThreadFactory>(), 1);
+	auto tb = make_shared<TokenBucket>(20, 1);
+	LogicalFifoPool slow(ex, 100, 1, 0, tb);
+	LogicalFifoPool fast(ex, 100, 0);
+	slow.Start();
+	fast.Start();
+	atomic<int> ran(0);
+	auto start = steady_clock::now();
+	for (int i = 0; i < 10; ++i) {
+		assert(slow.Post(make_shared<Fn>([] {})));
+	}
+	for (int i = 0; i < 10; ++i) {
+		assert(fast.Post(make_shared<Fn>([&] { ++ran; })));
+	}
+	assert(fast.WaitIdle());
+	auto fastDone = steady_clock::now() - start;
+	assert(slow.WaitIdle());
+	auto slowDone = steady_clock::now() - start;
+	assert(ran == 10);
+	assert(fastDone < milliseconds(200));
+	assert(slowDone >= milliseconds(350));
+	slow.Stop();
+	fast.Stop();
+}
+
+// Counter grants every token and counts them.
+class Counter : public RateLimiter {
+	public:
+		Counter() : tokens(0) {}
+		virtual bool GetToken(int64_t timeout) override {
+			++tokens;
+			return true;
+		}
+		virtual uint32_t GetRate() override {
+			return 0;
+		}
+		virtual void Start() override {}
+		virtual void Stop() override {}
+		atomic<int> tokens;
+};
+
+void testTokens() {
+	// A token is only taken for a task that is there to run, even when
+	// several threads go for the last queued one.
+	SharedExecutor ex(make_shared<StdThreadFactory>(), 4);
+	auto counter = make_shared<Counter>();
+	LogicalFifoPool pool(ex, 100, 0, 0, counter);
+	pool.Start();
+	atomic<int> ran(0);
+	vector<thread> producers;
+	for (int p = 0; p < 2; ++p) {
+		producers.emplace_back([&] {
+			for (int i = 0; i < 2000; ++i) {
+				assert(pool.Post(make_shared<Fn>([&] { ++ran; })));
+			}
+		});
+	}
+	for (auto &t : producers) {
+		t.join();
+	}
+	assert(pool.WaitIdle());
+	assert(ran == 4000);
+	assert(counter->tokens == 4000);
+	pool.Stop();
+}
+
+void sum(ThreadPool &pool, int lo, int hi, atomic<int64_t> &total) {
+	if (hi - lo <= 4) {
+		for (int i = lo; i < hi; ++i) {
+			total += i;
+		}
+		return;
+	}
+	int mid = lo + (hi - lo) / 2;
+	TaskGroup group(pool);
+	group.Run(make_shared<Fn>([&pool, lo, mid, &total] { sum(pool, lo, mid, total); }));
+	group.Run(make_shared<Fn>([&pool, mid, hi, &total] { sum(pool, mid, hi, total); }));
+	group.Wait();
+}
+
+void testTaskGroup() {
+	// Nested fan-out within a pool capped at one task.
+	SharedExecutor ex(make_shared<StdThreadFactory>(), 2);
+	LogicalFifoPool pool(ex, 8, 0, 1);
+	pool.Start();
+	atomic<int64_t> total(0);
+	TaskGroup group(pool);
+	assert(group.Run(make_shared<Fn>([&] { sum(pool, 0, 1024, total); })));
+	assert(group.Wait());
+	assert(total == 1024 * 1023 / 2);
+	pool.Stop();
+}
+
+// A task waiting in a TaskGroup does not run tasks of another pool beyond
+// that pool's cap.
+void testHelpCap() {
+	SharedExecutor ex(make_shared<StdThreadFactory>(), 3);
+	LogicalFifoPool a(ex, 100, 0, 1);
+	LogicalFifoPool b(ex, 100);
+	a.Start();
+	b.Start();
+	Gauge all, ga;
+	atomic<int> ran(0);
+	atomic<bool> release(false);
+	// Hold the slot of a, with more tasks of a queued behind it.
+	assert(a.Post(make_shared<Fn>([&] {
+		ga.Enter();
+		while (!release) {
+			this_thread::sleep_for(milliseconds(1));
+		}
+		ga.Leave();
+	})));
+	this_thread::sleep_for(milliseconds(20));
+	for (int i = 0; i < 5; ++i) {
+		assert(a.Post(work(all, ga, ran)));
+	}
+	atomic<bool> waited(false);
+	assert(b.Post(make_shared<Fn>([&] {
+		TaskGroup group(b);
+		atomic<bool> started(false);
+		group.Run(make_shared<Fn>([&] {
+			started = true;
+			while (!release) {
+				this_thread::sleep_for(milliseconds(1));
+			}
+		}));
+		while (!started) {
+			this_thread::sleep_for(milliseconds(1)); // taken by the third thread
+		}
+		group.Wait(); // helps, but not with a
+		waited = true;
+	})));
+	this_thread::sleep_for(milliseconds(50));
+	release = true;
+	assert(b.WaitIdle());
+	assert(a.WaitIdle());
+	assert(waited && ran == 5);
+	assert(ga.max == 1);
+	a.Stop();
+	b.Stop();
+}
+
+// The global executor has a thread per core. It lives until exit, so it is
+// made in a child process, which leaves without destroying it.
+void testGlobal() {
+	pid_t pid = fork();
+	if (pid == 0) {
+		_exit(SharedExecutor::Global().Threads() == NumCores() ? 0 : 1);
+	}
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main() {
+	testGlobal();
+	testShared();
+	testPriority();
+	testRateLimit();
+	testTokens();
+	testTaskGroup();
+	testHelpCap();
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <cassert>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "shmtokenbucket.h"
+
+using namespace std;
+using namespace std::chrono;
+
+const char *name = "/threadpool_shmtb_test";
+const uint32_t rate = 100;
+const uint32_t burst = 10;
+const int P = 4;
+
+// Take tokens as fast as possible for one second, report the count.
+int worker() {
+	ShmTokenBucket tb(name, rate, burst);
+	tb.Start();
+	auto end = steady_clock::now() + seconds(1);
+	int n = 0;
+	while (steady_clock::now() < end) {
+		if (tb.GetToken(10)) {
+			++n;
+		}
+	}
+	return n;
+}
+
+// A segment left half initialized, by a process whose pid now belongs to a
+// live one, is initialized again instead of waited for.
+void testStaleInit() {
+	ShmTokenBucket::Unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+	assert(fd >= 0);
+	assert(ftruncate(fd, 4096) == 0);
+	uint32_t initing = static_cast<uint32_t>(getpid()) << 2 | 1; // as older builds marked it
+	assert(pwrite(fd, &initing, sizeof(initing), 0) == sizeof(initing));
+	close(fd);
+	ShmTokenBucket tb(name, 600000);
+	assert(tb.GetRate() == 600000); // not rounded through the interval
+	tb.SetRate(300001);
+	assert(tb.GetRate() == 300001);
+	ShmTokenBucket::Unlink(name);
+}
+
+int main() {
+	testStaleInit();
+	ShmTokenBucket::Unlink(name);
+
+	int fds[2];
+	assert(pipe(fds) == 0);
+	vector<pid_t> pids;
+	for (int i = 0; i < P; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			int n = worker();
+			assert(write(fds[1], &n, sizeof(n)) == sizeof(n));
+			_exit(0);
+		}
+		pids.push_back(pid);
+	}
+	int total = 0;
+	for (int i = 0; i < P; ++i) {
+		int n;
+		assert(read(fds[0], &n, sizeof(n)) == sizeof(n));
+		cout << "process " << i << " got " << n << " tokens" << endl;
+		total += n;
+	}
+	for (auto pid : pids) {
+		waitpid(pid, nullptr, 0);
+	}
+	cout << P << " processes got " << total << " tokens in 1s at " 
+		<< rate << "/s, burst " << burst << endl;
+	// The limit holds across processes, not per process.
+	// Windows of the processes are slightly staggered.
+	assert(total >= (int)rate && total <= (int)(rate + burst + rate / 5));
+
+	{
+		ShmTokenBucket tb(name, 1);
+		assert(tb.GetRate() == rate); // joined the existing bucket
+		tb.Start();
+		assert(!tb.GetTokens(burst + 1, 0));
+		tb.Stop();
+		assert(!tb.GetToken(0));
+	}
+
+	ShmTokenBucket::Unlink(name);
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,218 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <cstdlib>
+#include <cassert>
+
+#include <unistd.h>
+#include <dirent.h>
+
+#include "spilllog.h"
+#include "spillchannel.h"
+
+using namespace std;
+
+const uint64_t kSegment = 64 * 1024;
+
+string tempDir() {
+	char tmpl[] = "/tmp/spilltestXXXXXX";
+	assert(mkdtemp(tmpl) != nullptr);
+	return tmpl;
+}
+
+int countFiles(const string &dir) {
+	int n = 0;
+	DIR *d = opendir(dir.c_str());
+	while (auto e = readdir(d)) {
+		if (e->d_name[0] != '.') {
+			++n;
+		}
+	}
+	closedir(d);
+	return n;
+}
+
+// Records come back in order across segments, and read segments are reused
+// rather than piling up.
+void testLog(const string &dir) {
+	SpillLog log(dir, kSegment);
+	assert(log.Empty());
+	assert(!log.Fits(kSegment));
+	string rec(1000, 'x');
+	for (int round = 0; round < 3; ++round) {
+		for (int i = 0; i < 500; ++i) {
+			rec[0] = static_cast<char>(i);
+			assert(log.Append(rec.data(), 100 + i % 900));
+		}
+		assert(log.Count() == 500);
+		assert(log.Segments() > 1);
+		for (int i = 0; i < 500; ++i) {
+			const char *data;
+			uint32_t n;
+			assert(log.Front(data, n));
+			assert(n == uint32_t(100 + i % 900) && data[0] == static_cast<char>(i));
+			log.Pop();
+		}
+		assert(log.Empty());
+		assert(countFiles(dir) <= int(log.Segments()) + 2);
+	}
+	const char *data;
+	uint32_t n;
+	assert(!log.Front(data, n));
+
+	log.SetMaxSegments(2);
+	int appended = 0;
+	while (log.Append(rec.data(), rec.size())) {
+		++appended;
+	}
+	assert(appended > 0 && log.Segments() == 2);
+}
+
+// A stalled consumer does not make Put fail: the overflow goes to disk and
+// comes back in FIFO order, with a constant number of items in memory.
+void testOverflow(const string &dir) {
+	const int N = 20000;
+	SpillChannel<int> chan(16, dir, false, kSegment);
+	for (int i = 0; i < N; ++i) {
+		assert(chan.Put(i, 0));
+	}
+	assert(chan.Size() == N);
+	assert(chan.Spilled() == N - 16);
+	for (int i = 0; i < N; ++i) {
+		int v = -1;
+		assert(chan.Get(v, 0));
+		assert(v == i);
+	}
+	assert(chan.Spilled() == 0);
+	int v;
+	assert(!chan.Get(v, 0));
+	for (int i = 0; i < 100; ++i) {
+		assert(chan.Put(i, 0));
+	}
+	assert(chan.Spilled() == 84);
+	chan.Close();
+	assert(!chan.Put(0, 0));
+	for (int i = 0; i < 100; ++i) {
+		assert(chan.Get(v, -1) && v == i); // a closed channel is drained
+	}
+	assert(!chan.Get(v, -1));
+}
+
+// Producers and consumers racing with a stall in between: every item is
+// taken once, and in order for each producer.
+void testConcurrent(const string &dir) {
+	const int P = 3, C = 2, N = 20000;
+	SpillChannel<int> chan(64, dir, false, kSegment);
+	atomic<bool> stalled(true);
+	atomic<int> taken(0);
+	vector<vector<int>> last(C, vector<int>(P, -1));
+	vector<thread> threads;
+	for (int c = 0; c < C; ++c) {
+		threads.emplace_back([&, c] {
+			while (stalled) {
+				this_thread::sleep_for(chrono::milliseconds(1));
+			}
+			int v;
+			while (chan.Get(v, -1)) {
+				int p = v / N, i = v % N;
+				assert(i > last[c][p]);
+				last[c][p] = i;
+				++taken;
+			}
+		});
+	}
+	vector<thread> producers;
+	for (int p = 0; p < P; ++p) {
+		producers.emplace_back([&, p] {
+			for (int i = 0; i < N; ++i) {
+				assert(chan.Put(p * N + i, -1));
+				if (i == N / 2) {
+					stalled = false;
+				}
+			}
+		});
+	}
+	for (auto &t : producers) {
+		t.join();
+	}
+	chan.Close();
+	for (auto &t : threads) {
+		t.join();
+	}
+	assert(taken == P * N);
+	assert(chan.Size() == 0);
+}
+
+// The items spilled to disk are recovered by the next channel on the same
+// directory; the items in memory are not.
+void testRecover(const string &dir) {
+	{
+		SpillChannel<string> chan(10, dir, false, kSegment);
+		for (int i = 0; i < 1000; ++i) {
+			assert(chan.Put("item" + to_string(i), 0));
+		}
+		string s;
+		for (int i = 0; i < 100; ++i) {
+			assert(chan.Get(s, 0) && s == "item" + to_string(i));
+		}
+		assert(chan.Spilled() == 890);
+	}
+	{
+		SpillChannel<string> chan(10, dir, true, kSegment);
+		assert(chan.Size() == 890);
+		string s;
+		for (int i = 110; i < 1000; ++i) {
+			assert(chan.Get(s, 0) && s == "item" + to_string(i));
+		}
+		assert(!chan.Get(s, 0));
+	}
+	{
+		// Without recover, leftovers are removed.
+		SpillChannel<string> chan(10, dir, false, kSegment);
+		assert(chan.Size() == 0);
+	}
+	assert(countFiles(dir) == 0);
+}
+
+// At the disk cap Put fails on timeout, or waits until consumers have made
+// room on disk.
+void testCap(const string &dir) {
+	SpillChannel<int> chan(4, dir, false, kSegment);
+	chan.SetMaxSegments(1);
+	int n = 0;
+	while (chan.Put(n, 0)) {
+		++n;
+	}
+	assert(n > 4);
+	auto start = chrono::steady_clock::now();
+	assert(!chan.Put(n, 20));
+	assert(chrono::steady_clock::now() - start >= chrono::milliseconds(20));
+
+	atomic<bool> put(false);
+	thread producer([&] {
+		assert(chan.Put(n, -1));
+		put = true;
+	});
+	int v;
+	for (int i = 0; i < n; ++i) {
+		assert(chan.Get(v, -1) && v == i);
+	}
+	assert(chan.Get(v, -1) && v == n);
+	producer.join();
+	assert(put);
+}
+
+int main() {
+	string dir = tempDir();
+	testLog(dir);
+	testOverflow(dir);
+	testConcurrent(dir);
+	testRecover(dir);
+	testCap(dir);
+	rmdir(dir.c_str());
+	cout << "Exiting..." << endl;
+	return 0;
+}
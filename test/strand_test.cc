@@ -0,0 +1,144 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "strand.h"
+
+using namespace std;
+
+const int K = 50;   // keys
+const int N = 40;   // tasks per key
+
+atomic<int> running[K];
+int last[K];
+atomic<int> done(0);
+atomic<bool> ok(true);
+
+struct Job : public Runnable {
+	virtual void Run() override {
+		if (running[key_]++ != 0) {
+			ok = false; // two tasks of a key overlap
+		}
+		if (last[key_] != seq_ - 1) {
+			ok = false; // out of order
+		}
+		last[key_] = seq_;
+		this_thread::yield();
+		--running[key_];
+		++done;
+	}
+	Job (int k, int s) : key_(k), seq_(s) {}
+	int key_, seq_;
+};
+
+struct Fn : public Runnable {
+	explicit Fn(function<void()> f) : f_(f) {}
+	virtual void Run() override {
+		f_();
+	}
+	function<void()> f_;
+};
+
+// blockPool keeps the only worker of pool busy until release is set and
+// fills its queue.
+void blockPool(ThreadPool &pool, atomic<bool> &release) {
+	atomic<bool> started(false);
+	assert(pool.Post(make_shared<Fn>([&release, &started] {
+		started = true;
+		while (!release) {
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+	})));
+	while (!started) {
+		this_thread::yield();
+	}
+	assert(pool.Post(make_shared<Fn>([] {})));
+}
+
+// A strand the pool rejects still runs the tasks that were queued on it
+// while it was being posted; only the rejected task is dropped.
+void testRejected() {
+	auto pool = make_shared<FifoThreadPool>(make_shared<StdThreadFactory>(), 1, 1);
+	pool->Start();
+	atomic<bool> release(false);
+	blockPool(*pool, release);
+
+	StrandExecutor<int> strands(pool);
+	atomic<bool> ranA(false), ranB(false), postedB(false);
+	thread other([&] {
+		this_thread::sleep_for(chrono::milliseconds(20));
+		// Joins the strand whose runner is still being posted.
+		postedB = strands.Post(7, make_shared<Fn>([&ranB] { ranB = true; }));
+	});
+	assert(!strands.Post(7, make_shared<Fn>([&ranA] { ranA = true; }), 300));
+	other.join();
+	assert(postedB && ranB && !ranA);
+	assert(strands.Strands() == 0);
+	release = true;
+	pool->Stop();
+}
+
+// A runner discarded by the pool does not leave its key stuck behind it.
+void testDiscarded() {
+	auto pool = make_shared<FifoThreadPool>(make_shared<StdThreadFactory>(), 1, 2);
+	pool->Start();
+	atomic<bool> release(false);
+	blockPool(*pool, release);
+
+	StrandExecutor<int> strands(pool);
+	atomic<int> ran(0);
+	assert(strands.Post(7, make_shared<Fn>([&ran] { ++ran; })));
+	assert(strands.Strands() == 1);
+	thread releaser([&release] {
+		this_thread::sleep_for(chrono::milliseconds(20));
+		release = true;
+	});
+	pool->StopNow(); // cancels the queued runner
+	releaser.join();
+	assert(ran == 0 && strands.Strands() == 0);
+
+	pool->Start();
+	assert(strands.Post(7, make_shared<Fn>([&ran] { ++ran; })));
+	pool->Stop();
+	assert(ran == 1);
+}
+
+// Tasks of a key run one at a time, in posting order.
+void testOrder() {
+	auto factory = make_shared<StdThreadFactory>();
+	auto pool = make_shared<FifoThreadPool>(factory, 8, 100);
+	pool->Start();
+	for (int k = 0; k < K; ++k) {
+		last[k] = -1;
+	}
+
+	StrandExecutor<int> strands(pool, 4);
+	for (int s = 0; s < N; ++s) {
+		for (int k = 0; k < K; ++k) {
+			assert(strands.Post(k, make_shared<Job>(k, s)));
+		}
+	}
+	while (done < K * N) {
+		this_thread::sleep_for(chrono::milliseconds(10));
+	}
+	assert(ok);
+	// Idle strands are reclaimed.
+	this_thread::sleep_for(chrono::milliseconds(10));
+	assert(strands.Strands() == 0);
+	pool->Stop();
+}
+
+int main() {
+	testRejected();
+	testDiscarded();
+	testOrder();
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,98 @@
+// Races Start, Stop, StopNow, Post, Submit and Cancel against each other.
+// Build with the tsan_stress target to run it under ThreadSanitizer.
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+
+using namespace std;
+
+atomic<int> ran(0);
+
+struct Job : public Runnable {
+	virtual void Run() override {
+		++ran;
+	}
+};
+
+template<class Pool>
+void stress(int rounds) {
+	auto factory = make_shared<StdThreadFactory>();
+	for (int r = 0; r < rounds; ++r) {
+		Pool pool(factory, 3, 16);
+		atomic<bool> go(false);
+		atomic<int> posted(0);
+		vector<shared_ptr<TaskHandle>> handles[2];
+		vector<thread> threads;
+		// Two threads race to start the pool.
+		for (int i = 0; i < 2; ++i) {
+			threads.emplace_back([&] {
+				while (!go) {}
+				pool.Start();
+			});
+		}
+		// Producers post while the pool starts and stops.
+		for (int i = 0; i < 2; ++i) {
+			threads.emplace_back([&, i] {
+				while (!go) {}
+				for (int j = 0; j < 200; ++j) {
+					if (j % 2 == 0) {
+						if (pool.Post(make_shared<Job>(), 1)) {
+							++posted;
+						}
+					} else {
+						auto h = pool.Submit(make_shared<Job>(), 1);
+						if (h != nullptr) {
+							++posted;
+							h->Cancel();
+							handles[i].push_back(h);
+						}
+					}
+				}
+			});
+		}
+		// Two threads race to stop it, one of them now, possibly before
+		// or between the Start() calls.
+		threads.emplace_back([&] {
+			while (!go) {}
+			this_thread::sleep_for(chrono::microseconds(200));
+			pool.Stop();
+		});
+		threads.emplace_back([&, r] {
+			while (!go) {}
+			this_thread::sleep_for(chrono::microseconds(200));
+			if (r % 2 == 0) {
+				pool.StopNow();
+			} else {
+				pool.Stop();
+			}
+		});
+		go = true;
+		for (auto &t : threads) {
+			t.join();
+		}
+		pool.Stop();
+		assert(pool.WaitIdle(0));
+		// Every accepted task has reached a final state.
+		for (auto &v : handles) {
+			for (auto &h : v) {
+				assert(h->Wait(0));
+			}
+		}
+	}
+}
+
+int main() {
+	stress<FifoThreadPool>(20);
+	stress<PriThreadPool>(20);
+	stress<ShardedFifoThreadPool>(20);
+	cout << "ran " << ran << " tasks" << endl;
+	cout << "Exiting..." << endl;
+	return 0;
+}
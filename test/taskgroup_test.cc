@@ -0,0 +1,108 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+#include "taskgroup.h"
+
+using namespace std;
+
+atomic<int> ran(0);
+
+struct Fn : public Runnable {
+	explicit Fn(function<void()> f) : f_(f) {}
+	virtual void Run() override {
+		f_();
+	}
+	function<void()> f_;
+};
+
+// sum adds up [lo, hi) by splitting the range into subtasks that wait for
+// their halves, many more levels deep than there are workers.
+void sum(ThreadPool &pool, int lo, int hi, atomic<int64_t> &total) {
+	if (hi - lo <= 8) {
+		for (int i = lo; i < hi; ++i) {
+			total += i;
+		}
+		return;
+	}
+	int mid = lo + (hi - lo) / 2;
+	TaskGroup group(pool);
+	assert(group.Run(make_shared<Fn>([&pool, lo, mid, &total] { sum(pool, lo, mid, total); })));
+	assert(group.Run(make_shared<Fn>([&pool, mid, hi, &total] { sum(pool, mid, hi, total); })));
+	assert(group.Wait());
+}
+
+void testRecursive() {
+	auto factory = make_shared<StdThreadFactory>();
+	FifoThreadPool pool(factory, 2, 16);
+	pool.Start();
+	atomic<int64_t> total(0);
+	TaskGroup group(pool);
+	assert(group.Run(make_shared<Fn>([&] { sum(pool, 0, 4096, total); })));
+	assert(group.Wait());
+	assert(total == 4096 * 4095 / 2);
+	pool.Stop();
+}
+
+void testCancel() {
+	auto factory = make_shared<StdThreadFactory>();
+	FifoThreadPool pool(factory, 1, 16);
+	pool.Start();
+	atomic<bool> release(false);
+	// Occupy the only worker.
+	TaskGroup blocker(pool);
+	assert(blocker.Run(make_shared<Fn>([&] { while (!release) { this_thread::yield(); } })));
+	this_thread::sleep_for(chrono::milliseconds(20));
+
+	TaskGroup group(pool);
+	TaskGroup child(pool, &group);
+	for (int i = 0; i < 5; ++i) {
+		assert(group.Run(make_shared<Fn>([] { ++ran; })));
+		assert(child.Run(make_shared<Fn>([] { ++ran; })));
+	}
+	group.Cancel();
+	assert(group.Cancelled() && child.Cancelled());
+	assert(!group.Run(make_shared<Fn>([] { ++ran; })));
+	assert(group.Wait(0));
+	release = true;
+	assert(child.Wait());
+	assert(blocker.Wait());
+	assert(ran == 0);
+	pool.Stop();
+}
+
+void testTimeout() {
+	auto factory = make_shared<StdThreadFactory>();
+	FifoThreadPool pool(factory, 1, 16);
+	pool.Start();
+	TaskGroup group(pool);
+	assert(group.Run(make_shared<Fn>([] { this_thread::sleep_for(chrono::milliseconds(100)); ++ran; })));
+	this_thread::sleep_for(chrono::milliseconds(20));
+	assert(!group.Wait(10)); // the member is running on the worker
+	assert(group.Wait());
+	assert(ran == 1);
+
+	// Members that have not started are run by the waiting thread.
+	assert(group.Run(make_shared<Fn>([] { this_thread::sleep_for(chrono::milliseconds(100)); })));
+	this_thread::sleep_for(chrono::milliseconds(20));
+	auto caller = this_thread::get_id();
+	thread::id runner;
+	assert(group.Run(make_shared<Fn>([&] { runner = this_thread::get_id(); })));
+	assert(group.Wait());
+	assert(runner == caller);
+	pool.Stop();
+}
+
+int main() {
+	testRecursive();
+	testCancel();
+	testTimeout();
+	cout << "Exiting..." << endl;
+	return 0;
+}
@@ -0,0 +1,70 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+
+using namespace std;
+
+atomic<int> ran(0);
+
+struct Job : public Runnable {
+	virtual void Run() override {
+		this_thread::sleep_for(chrono::milliseconds(ms_));
+		++ran;
+	}
+	Job (int ms) : ms_(ms) {}
+	int ms_;
+};
+
+template<class Pool>
+void test() {
+	ran = 0;
+	auto factory = make_shared<StdThreadFactory>();
+	Pool pool(factory, 1, 4);
+	pool.Start();
+
+	// Occupy the only worker, then fill the queue.
+	auto busy = pool.Submit(make_shared<Job>(200));
+	assert(busy != nullptr);
+	this_thread::sleep_for(chrono::milliseconds(50));
+	assert(busy->State() == TaskHandle::Status::RUNNING);
+	assert(!busy->Cancel());
+
+	vector<shared_ptr<TaskHandle>> handles;
+	for (int i = 0; i < 4; ++i) {
+		handles.push_back(pool.Submit(make_shared<Job>(0), 0, 0, 0, i % 2 + 1));
+		assert(handles.back() != nullptr);
+	}
+	// The queue is full ...
+	assert(pool.Submit(make_shared<Job>(0), 0) == nullptr);
+	// ... until a task is cancelled.
+	assert(handles[0]->Cancel());
+	assert(!handles[0]->Cancel());
+	assert(handles[0]->State() == TaskHandle::Status::CANCELLED);
+	auto extra = pool.Submit(make_shared<Job>(0), 0);
+	assert(extra != nullptr);
+
+	// Cancel the remaining task of group 1 in bulk.
+	assert(pool.CancelGroup(1) == 1);
+	assert(handles[2]->State() == TaskHandle::Status::CANCELLED);
+
+	assert(busy->Wait(-1));
+	assert(extra->Wait(1000));
+	assert(handles[1]->Wait(1000) && handles[3]->Wait(1000));
+	assert(handles[1]->State() == TaskHandle::Status::DONE);
+	pool.Stop();
+	assert(ran == 4);
+}
+
+int main() {
+	test<FifoThreadPool>();
+	test<PriThreadPool>();
+	test<ShardedFifoThreadPool>();
+	cout << "Exiting..." << endl;
+	return 0;
+}
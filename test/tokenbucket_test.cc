@@ -1,6 +1,9 @@
 #include <iostream>
 #include <chrono>
 #include <ctime>
+#include <thread>
+#include <atomic>
+#include <cassert>
 
 #include "tokenbucket.h"
 
@@ -30,8 +33,102 @@ int main() {
 		}
 	}
 
-	cout << "Exiting..." << endl;
 	tb.Stop();
 
+	// Waiters are served by priority, not by arrival.
+	{
+		TokenBucket tb(rate);
+		atomic<int> order(0), low(0), high(0);
+		thread t1([&] { tb.GetToken(-1, 0); low = ++order; });
+		this_thread::sleep_for(milliseconds(20));
+		thread t2([&] { tb.GetToken(-1, 5); high = ++order; });
+		this_thread::sleep_for(milliseconds(20));
+		tb.Start();
+		t1.join();
+		t2.join();
+		assert(high == 1 && low == 2);
+		tb.Stop();
+	}
+
+	// Reserved tokens are only given to higher priorities.
+	{
+		TokenBucket tb(rate);
+		tb.SetReserved(5, 2);
+		tb.Start();
+		this_thread::sleep_for(milliseconds(250)); // about 2 tokens
+		assert(!tb.GetToken(0, 0));
+		assert(tb.GetToken(0, 5));
+		tb.Stop();
+		assert(!tb.GetToken(0, 5));
+	}
+
+	// Burst and weighted acquisition.
+	{
+		TokenBucket tb(10, 5);
+		tb.Start();
+		this_thread::sleep_for(milliseconds(1000)); // full, whatever the delay
+		assert(!tb.GetTokens(6, 0)); // more than the burst size
+		auto start = steady_clock::now();
+		assert(tb.GetTokens(5, 0)); // empties the bucket
+		assert(tb.GetTokens(3, -1));
+		// 3 tokens take 300ms to accrue; only the lower bound is certain.
+		auto waited = duration_cast<milliseconds>(steady_clock::now() - start).count();
+		assert(waited >= 290);
+		tb.Stop();
+	}
+
+	// A request that does not fit next to the reservations above it fails
+	// at once, and does not hold up the waiters behind it.
+	{
+		TokenBucket tb(1000, 5);
+		tb.SetReserved(5, 1);
+		atomic<bool> failed(false), got(false);
+		thread t1([&] { failed = !tb.GetTokens(4, -1, 0); });
+		this_thread::sleep_for(milliseconds(20));
+		thread t2([&] { got = tb.GetTokens(2, -1, 0); });
+		this_thread::sleep_for(milliseconds(20));
+		tb.SetReserved(5, 3); // t1 cannot succeed any more
+		t1.join();
+		assert(failed);
+		assert(!tb.GetTokens(3, -1, 0));
+		tb.Start();
+		t2.join();
+		assert(got);
+		assert(tb.GetTokens(5, -1, 5));
+		tb.Stop();
+	}
+
+	// Reserve goes into debt and tells how long to wait. At 1 token/s the
+	// debt of 50 tokens takes close to 50s to pay off, however long the
+	// caller is descheduled.
+	{
+		TokenBucket tb(1);
+		tb.Start();
+		auto wait = tb.Reserve(50);
+		assert(wait > seconds(40) && wait <= seconds(50));
+		assert(!tb.GetToken(0));
+		auto later = tb.Reserve(1);
+		assert(later > wait && later <= wait + seconds(1));
+		tb.Stop();
+	}
+
+	// High rates are exact, and can be changed at runtime.
+	{
+		TokenBucket tb(300000, 1000);
+		tb.Start();
+		auto start = steady_clock::now();
+		for (int i = 0; i < 30; ++i) {
+			assert(tb.GetTokens(1000, -1));
+		}
+		auto ms = duration_cast<milliseconds>(steady_clock::now() - start).count();
+		cout << "30000 tokens at 300k/s in " << ms << " ms" << endl;
+		assert(ms >= 90); // never faster than the rate
+		tb.SetRate(0.5);
+		assert(tb.GetRate() == 1); // rounded
+		assert(!tb.GetTokens(1000, 100));
+		tb.Stop();
+	}
+
+	cout << "Exiting..." << endl;
 	return 0;
 }
@@ -0,0 +1,102 @@
+#include <iostream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cassert>
+
+#include "stdthread.h"
+#include "threadpool_impl.h"
+
+using namespace std;
+
+atomic<int> ran(0);
+atomic<int> created(0);
+
+struct Job : public Runnable {
+	explicit Job(int ms) : ms_(ms) {}
+	virtual void Run() override {
+		this_thread::sleep_for(chrono::milliseconds(ms_));
+		++ran;
+	}
+	int ms_;
+};
+
+// CountingFactory counts the threads created.
+class CountingFactory : public ThreadFactory {
+	public:
+		virtual std::unique_ptr<Thread> NewThread() override {
+			++created;
+			return make_unique<StdThread>(StdThread::DtorAction::join);
+		}
+};
+
+int main() {
+	auto factory = make_shared<CountingFactory>();
+	{
+		// WaitIdle returns once all tasks have run, without stopping.
+		FifoThreadPool pool(factory, 2, 100);
+		pool.Start();
+		assert(pool.WaitIdle(0));
+		for (int i = 0; i < 20; ++i) {
+			assert(pool.Post(make_shared<Job>(5)));
+		}
+		assert(!pool.WaitIdle(0));
+		assert(pool.WaitIdle());
+		assert(ran == 20);
+		assert(pool.Post(make_shared<Job>(0))); // still running
+		assert(pool.WaitIdle(1000));
+
+		// A long task makes WaitIdle time out.
+		assert(pool.Post(make_shared<Job>(200)));
+		assert(!pool.WaitIdle(20));
+		assert(pool.WaitIdle());
+
+		// Cancelled and expired tasks count as finished.
+		ran = 0;
+		assert(pool.Post(make_shared<Job>(100)));
+		assert(pool.Post(make_shared<Job>(100)));
+		auto h = pool.Submit(make_shared<Job>(0));
+		assert(pool.Post(make_shared<Job>(0), -1, 1));
+		assert(h->Cancel());
+		assert(pool.WaitIdle(2000));
+		assert(ran == 2);
+		pool.Stop();
+	}
+	{
+		// Threads are created once and reused across Start/Stop cycles.
+		created = 0;
+		ran = 0;
+		FifoThreadPool pool(factory, 3, 100);
+		for (int round = 0; round < 50; ++round) {
+			pool.Start();
+			for (int i = 0; i < 10; ++i) {
+				assert(pool.Post(make_shared<Job>(0)));
+			}
+			if (round % 2 == 0) {
+				assert(pool.WaitIdle());
+				assert(ran == (round + 1) * 10);
+			}
+			pool.Stop();
+			assert(ran == (round + 1) * 10);
+		}
+		assert(created == 3);
+		assert(pool.Threads() == 3);
+
+		// StopNow leaves the pool restartable, too.
+		pool.Start();
+		assert(pool.Post(make_shared<Job>(50)));
+		for (int i = 0; i < 10; ++i) {
+			pool.Post(make_shared<Job>(0));
+		}
+		pool.StopNow();
+		assert(pool.WaitIdle(0));
+		pool.Start();
+		assert(pool.Post(make_shared<Job>(0)));
+		assert(pool.WaitIdle());
+		pool.Stop();
+		assert(created == 3);
+	}
+	cout << "Exiting..." << endl;
+	return 0;
+}
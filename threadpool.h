@@ -15,6 +15,7 @@
 #include <exception>
 
 #include "thread.h"
+#include "taskhandle.h"
 
 
 const uint32_t MaxWorkers = 50;
@@ -36,6 +37,14 @@ class ThreadPool {
 		//   pirority = 0: lowest priority
 		virtual bool Post(const std::shared_ptr<Runnable> &task, 
 				int64_t timeout=-1, int64_t expiration=0, int priority=0) = 0;
+		// Submit is the same as Post, but returns a handle to cancel or wait
+		// for the task, or nullptr if the task is not accepted. A non-zero
+		// group tags the task for CancelGroup().
+		virtual std::shared_ptr<TaskHandle> Submit(const std::shared_ptr<Runnable> &task, 
+				int64_t timeout=-1, int64_t expiration=0, int priority=0, uint64_t group=0) = 0;
+		// CancelGroup cancels all pending tasks submitted with the given group
+		// and returns the number of tasks cancelled.
+		virtual size_t CancelGroup(uint64_t group) = 0;
 		// int pendingTasks();
 };
 
@@ -16,21 +16,36 @@
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <atomic>
+#include <algorithm>
+#include <functional>
 //#include <chrono>
 
 #include "thread.h"
 #include "runnable.h"
 #include "channel.h"
+#include "shardedchannel.h"
 #include "def.h"
 #include "semaphore.h"
 #include "tokenbucket.h"
 #include "priqueue.h"
+#include "agingqueue.h"
+#include "fairqueue.h"
+#include "taskhandle.h"
+#include "queuemanager.h"
+#include "concurrencylimiter.h"
+#include "blocking.h"
+#include "policies.h"
+#include "arena.h"
+#include "profiler.h"
+#include "taskgroup.h"
 
 
 #define MAX_THREADS (NUMCORES * 10)
 
 const TPException kWrongCntEcp("number of threads cannot exceed NUMCORES*10");
 static const int64_t kBlockingFlag = -1;
+static const int64_t kRetirePoll = 100; // ms between retirement checks of idle compensation workers
 
 using namespace std;
 using namespace std::chrono;
@@ -38,13 +53,22 @@ using namespace std::chrono;
 
 class Task : public Runnable {
 	public:
-		Task() {}
-		Task(const std::shared_ptr<Runnable> &t, int64_t e, int p) : 
+		Task() : tag_(nullptr), throttled_(0) {}
+		// An unstamped task has neither its post time nor a sequence number,
+		// see AllFeatures::kStamp.
+		Task(const std::shared_ptr<Runnable> &t, int64_t e, int p, 
+				const std::shared_ptr<TaskHandle> &h = nullptr, const char *tag = nullptr,
+				bool stamped = true) : 
 			task_(t),
-			expiration_(e),
-			priority_(p)
+			expiration_(stamped ? e : 0), // no post time to expire from
+			priority_(p, stamped),
+			handle_(h),
+			tag_(tag),
+			throttled_(0)
 		{
-			start_ = system_clock::now();
+			if (stamped) {
+				start_ = system_clock::now();
+			}
 		}
 		Task(const Task&) = default; // allow copy
 		Task(Task &&) = default; // allow move
@@ -70,6 +94,45 @@ class Task : public Runnable {
 			return false;
 		}
 
+		// Sojourn returns the time the task has spent since it was posted.
+		std::chrono::microseconds Sojourn() {
+			return duration_cast<microseconds>(system_clock::now() - start_);
+		}
+
+		int GetPriority() const {
+			return priority_.GetPriority();
+		}
+
+		// Remaining returns the milliseconds left until the task expires, or -1
+		// if it never expires.
+		int64_t Remaining() {
+			if (expiration_.count() <= 0) {
+				return -1;
+			}
+			// rounded up, so that the task has expired once the time is up
+			auto left = duration_cast<microseconds>(start_ + expiration_ - system_clock::now());
+			return left.count() > 0 ? (left.count() + 999) / 1000 : 0;
+		}
+
+		// Tag returns the type of the task for profiling, or nullptr.
+		const char* Tag() const {
+			return tag_;
+		}
+
+		// Throttled returns the time the task has waited for a rate limiter
+		// token before it reached a worker, see Dispatcher.
+		nanoseconds Throttled() const {
+			return throttled_;
+		}
+
+		void AddThrottled(nanoseconds d) {
+			throttled_ += d;
+		}
+
+		const std::shared_ptr<Runnable>& Inner() const {
+			return task_;
+		}
+
 		bool IsEmpty() {
 			if (task_ == nullptr) {
 				return true;
@@ -77,12 +140,45 @@ class Task : public Runnable {
 			return false;
 		}
 
+		// Finish moves the handle, if any, from RUNNING to its final state.
+		void Finish(TaskHandle::Status s) {
+			if (handle_ != nullptr) {
+				handle_->Transit(TaskHandle::Status::RUNNING, s);
+			}
+		}
+
 	private:
 		std::shared_ptr<Runnable> task_;
 		std::chrono::system_clock::time_point start_; // start time
 		std::chrono::milliseconds expiration_;
 		Priority priority_;
+		std::shared_ptr<TaskHandle> handle_;
+		const char *tag_;
+		nanoseconds throttled_;
 		friend std::less<Task>;
+		friend ChannelTraits<Task>;
+};
+
+// Cancelled tasks are erased from queues that can look them up by key, and
+// skipped when they reach the head of the others.
+template<>
+struct ChannelTraits<Task> {
+	static void Bind(const Task &t, const void *owner) {
+		if (t.handle_ != nullptr) {
+			t.handle_->SetOwner(owner);
+		}
+	}
+	// A task passing through a second queue (see Dispatcher) has been
+	// claimed already.
+	static bool Claim(Task &t) {
+		return t.handle_ == nullptr || 
+			t.handle_->Transit(TaskHandle::Status::PENDING, TaskHandle::Status::RUNNING) ||
+			t.handle_->State() == TaskHandle::Status::RUNNING;
+	}
+	// Tasks are looked up by their handle.
+	static const void* Key(const Task &t) {
+		return t.handle_.get();
+	}
 };
 
 // specialize less<> for Task
@@ -96,21 +192,163 @@ class less<Task> {
 };
 }
 
+// ShedHandler is called for each task shed by a QueueManager.
+using ShedHandler = std::function<void(const std::shared_ptr<Runnable>&)>;
+
+// RateLimitMode selects where a pool with a RateLimiter waits for tokens.
+//   WORKER:   each worker takes a token after dequeuing a task; a worker
+//             waiting for a token holds its task and its thread.
+//   DISPATCH: a single dispatcher takes tokens in queue order and hands
+//             only tasks cleared to run to the workers; tasks expire in the
+//             queue, and idle workers stay free.
+enum class RateLimitMode {WORKER, DISPATCH};
+
+// InFlight counts the tasks accepted by a pool that have not finished, i.e.
+// been run, expired, dropped or cancelled, so that callers can wait for the
+// pool to go idle without polling.
+class InFlight {
+	public:
+		InFlight() : n_(0) {}
+		InFlight(const InFlight&) = delete;
+		InFlight& operator=(const InFlight&) = delete;
+
+		void Add() {
+			n_.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void Done() {
+			if (n_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				// Waiters check the count under the lock, so taking it
+				// after the decrement is enough not to miss one.
+				std::lock_guard<std::mutex> lck(mtx_);
+				idle_.notify_all();
+			}
+		}
+
+		// Wait blocks until the count drops to 0, with the same timeout
+		// semantics as Channel::Get(). It returns true if the count is 0.
+		bool Wait(int64_t timeout) {
+			std::unique_lock<std::mutex> lck(mtx_);
+			auto idle = [this] { return n_.load(std::memory_order_acquire) == 0; };
+			if (timeout < 0) {
+				idle_.wait(lck, idle);
+				return true;
+			}
+			return idle_.wait_for(lck, std::chrono::milliseconds(timeout), idle);
+		}
+
+		uint64_t Count() const {
+			return n_.load(std::memory_order_relaxed);
+		}
+
+		// Guard calls Done() upon destruction, unless released.
+		class Guard {
+			public:
+				explicit Guard(InFlight *f) : f_(f) {}
+				Guard(const Guard&) = delete;
+				Guard& operator=(const Guard&) = delete;
+				~Guard() {
+					if (f_ != nullptr) {
+						f_->Done();
+					}
+				}
+				void Release() {
+					f_ = nullptr;
+				}
+			private:
+				InFlight *f_;
+		};
+
+	private:
+		std::atomic<uint64_t> n_;
+		std::mutex mtx_;
+		std::condition_variable idle_;
+};
+
+// Carrier keeps a pool thread alive across Start/Stop cycles: it runs the
+// runnables assigned to it one after another, and waits in between.
+class Carrier : public Runnable {
+	public:
+		Carrier() : exit_(false) {}
+
+		// Assign hands r to the thread, once the runnable assigned before
+		// has returned.
+		void Assign(std::shared_ptr<Runnable> r) {
+			std::unique_lock<std::mutex> lck(mtx_);
+			cv_.wait(lck, [this] { return job_ == nullptr; });
+			job_ = std::move(r);
+			cv_.notify_all();
+		}
+
+		// Exit makes the thread return once it has nothing left to run.
+		void Exit() {
+			std::lock_guard<std::mutex> lck(mtx_);
+			exit_ = true;
+			cv_.notify_all();
+		}
+
+		virtual void Run() override {
+			std::unique_lock<std::mutex> lck(mtx_);
+			while (true) {
+				cv_.wait(lck, [this] { return job_ != nullptr || exit_; });
+				if (job_ == nullptr) {
+					break;
+				}
+				auto job = job_;
+				lck.unlock();
+				job->Run();
+				job.reset();
+				lck.lock();
+				job_ = nullptr;
+				cv_.notify_all();
+			}
+		}
+
+	private:
+		std::mutex mtx_;
+		std::condition_variable cv_;
+		std::shared_ptr<Runnable> job_;
+		bool exit_;
+};
+
 // Worker is the consumer of the task queue. 
-template<class Container>
-class Worker : public Runnable {
+template<class Container, class Policies = DefaultPolicies>
+class Worker : public Runnable, public HelpHook {
+	using Expiry = typename Policies::ExpiryPolicy;
+	using RateLimit = typename Policies::RateLimitPolicy;
+	using Stats = typename Policies::StatsPolicy;
+	using Log = typename Policies::LogPolicy;
+	using Profile = typename Policies::ProfilePolicy;
+	using Features = typename Policies::FeaturePolicy;
 	public:
-		Worker(Container &tasks, std::shared_ptr<RateLimiter> rl=nullptr) : 
+		// owner is the queue to report task costs to, if other than tasks.
+		Worker(Container &tasks, std::shared_ptr<RateLimiter> rl=nullptr,
+				std::shared_ptr<QueueManager> qm=nullptr, ShedHandler shed=nullptr,
+				Container *owner=nullptr) : 
 			tasks_(tasks),
+			owner_(owner != nullptr ? *owner : tasks),
 			ratelimiter_(rl),
+			qm_(qm),
+			shed_(shed),
+			hook_(nullptr),
+			retire_(nullptr),
+			stats_(nullptr),
+			profile_(nullptr),
+			inflight_(nullptr),
+			limiter_(nullptr),
+			depth_(0),
 			quit_(false),
 			sem_(0),
-			status_(Status::STOPPED)
+			status_(Status::IDLE)
 		{
+#ifdef VERBOSE
 			std::cout << "New worker " << std::endl;
+#endif
 		}
 		~Worker() {
+#ifdef VERBOSE
 			std::cout << "Worker DTOR" << std::endl;
+#endif
 			if (!quit_) {
 				stop();
 				wait();
@@ -119,63 +357,348 @@ class Worker : public Runnable {
 
 		// stop stops the worker when all pending tasks in the queue are processed.
 		void stop() {
-			quit_ = true;
-			status_ = Status::STOPPING;
+			quit_.store(true, std::memory_order_relaxed);
+			// Only a worker that has not been stopped yet may drain the queue.
+			auto s = Status::IDLE;
+			if (!status_.compare_exchange_strong(s, Status::STOPPING, std::memory_order_acq_rel)) {
+				s = Status::RUNNING;
+				status_.compare_exchange_strong(s, Status::STOPPING, std::memory_order_acq_rel);
+			}
 		}
 
-		// stopNow stops the worker immediately and discard any pending tasks in the queue.
+		// stopNow stops the worker after its current task, leaving any pending tasks in the queue.
 		void stopNow() {
-			quit_ = true;
-			status_ = Status::STOPPED;
+			quit_.store(true, std::memory_order_relaxed);
+			status_.store(Status::STOPPED, std::memory_order_release);
 		}
 
 		void wait() {
 			sem_.Wait();
-			status_ = Status::STOPPED;
+			status_.store(Status::STOPPED, std::memory_order_release);
+		}
+
+		// tryWait returns true if the worker has exited, without blocking.
+		bool tryWait() {
+			if (!sem_.TryWait()) {
+				return false;
+			}
+			status_.store(Status::STOPPED, std::memory_order_release);
+			return true;
+		}
+
+		// setBlockingHook installs the hook BlockingScope reports to on the
+		// worker thread. It must be called before the worker runs.
+		void setBlockingHook(BlockingHook *hook) {
+			hook_ = hook;
+		}
+
+		// setStats sets the stats the worker reports to. It must be called
+		// before the worker runs.
+		void setStats(Stats *stats) {
+			stats_ = stats;
+		}
+
+		// setInFlight sets the count of tasks the worker marks as done. It
+		// must be called before the worker runs.
+		void setInFlight(InFlight *inflight) {
+			inflight_ = inflight;
+		}
+
+		// setLimiter sets the concurrency limiter the worker takes a slot of
+		// for each task. It must be called before the worker runs.
+		void setLimiter(std::shared_ptr<ConcurrencyLimiter> limiter) {
+			limiter_ = limiter;
+		}
+
+		// setProfile sets the profiler the worker reports to. It must be
+		// called before the worker runs.
+		void setProfile(Profile *profile) {
+			profile_ = profile;
+		}
+
+		// setArena sizes the scratch arena of the worker, see
+		// ThreadPoolImpl::SetArena(). It must be called before the worker runs.
+		void setArena(size_t blockSize, size_t trim) {
+			arena_.SetBlockSize(blockSize);
+			arena_.SetTrim(trim);
+		}
+
+		// setRetire makes the worker exit as soon as retire() returns true,
+		// which it checks between tasks and while idle.
+		void setRetire(std::function<bool()> retire) {
+			retire_ = retire;
 		}
 
 		virtual void Run() override {
-			status_ = Status::RUNNING;
-			while(status_ == Status::RUNNING || status_ == Status::STOPPING) {
-				auto task = tasks_.Get(kBlockingFlag); // blocking get
-				if (task.IsEmpty()) {
-				//if (false) {
-					std::cout << "Worker no task available\n";// << std::endl;
-					if (status_ == Status::STOPPING) { // queue exhausted, break out of the loop
-						break;
-					}
-					continue;
+			// stop() may have been called before the thread got to run.
+			auto s = Status::IDLE;
+			status_.compare_exchange_strong(s, Status::RUNNING, std::memory_order_acq_rel);
+			BlockingHook::Current() = hook_;
+			HelpHook::Current() = this;
+			CurrentWorker::SetArena(Features::kArena ? &arena_ : nullptr);
+			while(active()) {
+				if (retire_ != nullptr && retire_()) {
+					quit_.store(true, std::memory_order_relaxed); // nobody waits for a retired worker
+					break;
 				}
-				std::cout << "Worker got a task \n";// << std::endl;
-				if (task.IsExpired()) {
-					std::cout << "Worker task expired \n";
+				int64_t timeout = retire_ != nullptr ? kRetirePoll : kBlockingFlag;
+				// The concurrency slot is taken before the task, so that tasks
+				// beyond the limit wait in the queue, where they can still be
+				// cancelled, shed or expire, rather than in a worker.
+				if (limiting() && !limiter_->Acquire(timeout)) {
 					continue;
 				}
-				if (ratelimiter_ != nullptr && !ratelimiter_->GetToken(kBlockingFlag)) {
-					std::cout << "Worker no token \n";
+				auto task = tasks_.Get(timeout);
+				if (task.IsEmpty()) {
+					if (limiting()) {
+						limiter_->Cancel();
+					}
+					Log::Event("Worker no task available");
+					if (status_.load(std::memory_order_acquire) == Status::STOPPING) { // queue exhausted, break out of the loop
+						break;
+					}
 					continue;
 				}
-				if (task.IsExpired()) { // check expiry again as GetToken may take time
-					std::cout << "Worker task expired 2\n";
-					continue;
+				if (!process(task)) {
+					break;
 				}
-				task.Run();
 			}
+			CurrentWorker::SetArena(nullptr);
+			HelpHook::Current() = nullptr;
+			BlockingHook::Current() = nullptr;
 			sem_.Notify();
 			return; 
 		}
+
+		// RunPending runs a queued task on behalf of the running task, which
+		// waits for other tasks, e.g. in TaskGroup::Wait().
+		virtual bool RunPending() override {
+			if (status_.load(std::memory_order_acquire) == Status::STOPPED) {
+				return false;
+			}
+			auto task = tasks_.Get(0);
+			if (task.IsEmpty()) {
+				return false;
+			}
+			++depth_;
+			process(task);
+			--depth_;
+			return true;
+		}
 		
 		virtual void Print() {
 		}
 
 	private:
 		Container &tasks_;
+		Container &owner_;
 		std::shared_ptr<RateLimiter> ratelimiter_;
-		bool quit_;
+		std::shared_ptr<QueueManager> qm_;
+		ShedHandler shed_;
+		BlockingHook *hook_;
+		std::function<bool()> retire_;
+		Stats *stats_;
+		Profile *profile_;
+		InFlight *inflight_;
+		std::shared_ptr<ConcurrencyLimiter> limiter_;
+		Arena arena_; // scratch memory of the running task
+		int depth_;   // tasks run by RunPending() within the running task
+		std::atomic<bool> quit_;
 		Semaphore sem_; // for sync upen destruction
 		
-		enum class Status { STOPPED, RUNNING, STOPPING};
-		Status status_;
+		//   IDLE --Run()--> RUNNING --stop()--> STOPPING --queue drained--> exit
+		//     |                |                   |
+		//     +----------------+-----stopNow()-----+--> STOPPED --> exit
+		// stop() before Run() goes from IDLE to STOPPING. The state is read
+		// by the worker every task and written by the pool, so it sits on a
+		// cache line of its own.
+		enum class Status { IDLE, RUNNING, STOPPING, STOPPED};
+		char pad0_[CACHELINE_SIZE];
+		std::atomic<Status> status_;
+		char pad1_[CACHELINE_SIZE];
+
+		bool active() {
+			auto s = status_.load(std::memory_order_acquire);
+			return s == Status::RUNNING || s == Status::STOPPING;
+		}
+
+		bool limiting() {
+			return Features::kAdmission && limiter_ != nullptr;
+		}
+
+		// Slot returns the concurrency slot taken for a task unused, unless
+		// the task ran and released it.
+		struct Slot {
+			ConcurrencyLimiter *limiter;
+			~Slot() {
+				if (limiter != nullptr) {
+					limiter->Cancel();
+				}
+			}
+		};
+
+		// process handles a task taken from the queue. It returns false if
+		// the worker has been stopped now, and the task cancelled. Unless
+		// the task is run while the running task waits for it, and uses the
+		// slot of the waiting task, the worker holds a concurrency slot.
+		template<class Item>
+		bool process(Item &task) {
+			InFlight::Guard done(Features::kInFlight ? inflight_ : nullptr); // after Finish()
+			bool limited = limiting() && depth_ == 0;
+			Slot slot{limited ? limiter_.get() : nullptr};
+			if (status_.load(std::memory_order_acquire) == Status::STOPPED) {
+				task.Finish(TaskHandle::Status::CANCELLED); // stopNow() raced with Get()
+				return false;
+			}
+			Log::Event("Worker got a task");
+			if (Features::kAdmission && qm_ != nullptr && qm_->OnDequeue(task.Sojourn(), tasks_.Size())) {
+				Log::Event("Worker task dropped");
+				task.Finish(TaskHandle::Status::DROPPED);
+				stat([](Stats &s) { s.OnDropped(); });
+				if (shed_ != nullptr) {
+					shed_(task.Inner());
+				}
+				return true;
+			}
+			if (Expiry::Expired(task)) {
+				Log::Event("Worker task expired");
+				task.Finish(TaskHandle::Status::EXPIRED);
+				stat([](Stats &s) { s.OnExpired(); });
+				return true;
+			}
+			nanoseconds throttled = task.Throttled(); // by the dispatcher
+			if (RateLimit::kEnabled && ratelimiter_ != nullptr) {
+				auto waitStart = Profile::kEnabled ? steady_clock::now() : steady_clock::time_point();
+				if (!ratelimiter_->GetToken(kBlockingFlag, task.GetPriority())) {
+					Log::Event("Worker no token");
+					task.Finish(TaskHandle::Status::CANCELLED);
+					stat([](Stats &s) { s.OnCancelled(); });
+					return true;
+				}
+				if (Profile::kEnabled) {
+					throttled += steady_clock::now() - waitStart;
+				}
+				if (Expiry::Expired(task)) { // check expiry again as GetToken may take time
+					Log::Event("Worker task expired 2");
+					task.Finish(TaskHandle::Status::EXPIRED);
+					stat([](Stats &s) { s.OnExpired(); });
+					return true;
+				}
+			}
+			// Expiry has been checked above; Task::Run() would check it again.
+			profile([](Profile &p) { p.Begin(); });
+			if (Container::kFeedback || Stats::kTimed || limited) {
+				auto start = steady_clock::now();
+				task.Inner()->Run();
+				auto cost = steady_clock::now() - start;
+				if (limited) {
+					slot.limiter = nullptr;
+					limiter_->Release(duration_cast<microseconds>(cost));
+				}
+				if (Container::kFeedback) {
+					owner_.Complete(task, duration_cast<microseconds>(cost).count());
+				}
+				stat([&](Stats &s) { s.OnRun(duration_cast<nanoseconds>(cost)); });
+			} else {
+				task.Inner()->Run();
+			}
+			profile([&](Profile &p) { p.End(task.Tag(), throttled); });
+			if (Features::kArena && depth_ == 0) {
+				arena_.Reset(); // scratch memory does not outlive the task
+			}
+			task.Finish(TaskHandle::Status::DONE);
+			return true;
+		}
+
+		template<class F>
+		void stat(F f) {
+			if (Stats::kEnabled && stats_ != nullptr) {
+				f(*stats_);
+			}
+		}
+
+		template<class F>
+		void profile(F f) {
+			if (Profile::kEnabled && profile_ != nullptr) {
+				f(*profile_);
+			}
+		}
+};
+
+// Dispatcher moves tasks from the task queue to the ready queue of the
+// workers as the rate limiter clears them, in RateLimitMode::DISPATCH. If
+// Timed, the time each task waits for its token is stamped into the task for
+// the profiler.
+template<class Container, bool Timed = false>
+class Dispatcher : public Runnable {
+	public:
+		Dispatcher(Container &tasks, Container &ready, std::shared_ptr<RateLimiter> rl,
+				std::shared_ptr<QueueManager> qm=nullptr, ShedHandler shed=nullptr,
+				InFlight *inflight=nullptr) : 
+			tasks_(tasks),
+			ready_(ready),
+			ratelimiter_(rl),
+			qm_(qm),
+			shed_(shed),
+			inflight_(inflight),
+			stopping_(false),
+			sem_(0) {}
+
+		// stop stops the dispatcher once the closed task queue is drained.
+		void stop() {
+			stopping_ = true;
+		}
+
+		void wait() {
+			sem_.Wait();
+		}
+
+		virtual void Run() override {
+			while (true) {
+				auto task = tasks_.Get(kBlockingFlag); // blocking get
+				// Tasks handed to the workers are marked done by them.
+				InFlight::Guard done(task.IsEmpty() ? nullptr : inflight_);
+				if (task.IsEmpty()) {
+					if (stopping_) { // queue exhausted
+						break;
+					}
+					continue;
+				}
+				if (qm_ != nullptr && qm_->OnDequeue(task.Sojourn(), tasks_.Size())) {
+					task.Finish(TaskHandle::Status::DROPPED);
+					if (shed_ != nullptr) {
+						shed_(task.Inner());
+					}
+					continue;
+				}
+				// Wait for a token no longer than the task may live.
+				auto left = task.Remaining();
+				auto waitStart = Timed ? steady_clock::now() : steady_clock::time_point();
+				if (left == 0 || !ratelimiter_->GetToken(left, task.GetPriority())) {
+					task.Finish(task.IsExpired() ? TaskHandle::Status::EXPIRED : TaskHandle::Status::CANCELLED);
+					continue;
+				}
+				if (Timed) {
+					task.AddThrottled(steady_clock::now() - waitStart);
+				}
+				if (ready_.Put(task, kBlockingFlag)) {
+					done.Release();
+				} else {
+					task.Finish(TaskHandle::Status::CANCELLED);
+				}
+			}
+			sem_.Notify();
+		}
+
+	private:
+		Container &tasks_;
+		Container &ready_;
+		std::shared_ptr<RateLimiter> ratelimiter_;
+		std::shared_ptr<QueueManager> qm_;
+		ShedHandler shed_;
+		InFlight *inflight_;
+		std::atomic<bool> stopping_;
+		Semaphore sem_;
 };
 
 
@@ -188,9 +711,20 @@ class RateLimiter;
 // - Put()
 // - Close()
 // Importantly, these methods must be thread-safe.
-template<class T, class Container>
-class ThreadPoolImpl : public ThreadPool {
-	using WorkerType = Worker<Container>;
+//
+// A task that blocks in a BlockingScope, or posted with PostBlocking, does not
+// count against the threads of the pool: a spare worker is started through
+// the ThreadFactory for every worker blocked beyond the spares running, and
+// retires once the blocked workers return.
+//
+// Policies selects the optional features of the pool at compile time, see
+// policies.h.
+template<class T, class Container, class Policies = DefaultPolicies>
+class ThreadPoolImpl : public ThreadPool, public BlockingHook {
+	using WorkerType = Worker<Container, Policies>;
+	using Stats = typename Policies::StatsPolicy;
+	using Profile = typename Policies::ProfilePolicy;
+	using Features = typename Policies::FeaturePolicy;
 	public: 
 		//friend class Task;
 		ThreadPoolImpl(std::shared_ptr<ThreadFactory> factory, uint32_t threads, uint32_t maxTasks) : 
@@ -198,117 +732,516 @@ class ThreadPoolImpl : public ThreadPool {
 			numThreads_(threads),
 			tasks_(maxTasks),
 			ratelimiter_(nullptr),
+			mode_(RateLimitMode::WORKER),
+			blocked_(0),
+			spares_(0),
+			maxSpares_(MAX_THREADS - threads),
+			arenaBlock_(Arena::kDefaultBlock),
+			arenaTrim_(0),
 			status_(Status::STOPPED){
 			if (threads > MAX_THREADS) {
 				throw kWrongCntEcp; 
 			}
+			initRegistry();
 		}
 		ThreadPoolImpl(std::shared_ptr<ThreadFactory> factory, std::shared_ptr<RateLimiter> rl, uint32_t threads, uint32_t maxTasks) : 
 			factory_(factory),
 			numThreads_(threads),
 			tasks_(maxTasks),
 			ratelimiter_(rl),
+			mode_(RateLimitMode::WORKER),
+			blocked_(0),
+			spares_(0),
+			maxSpares_(MAX_THREADS - threads),
+			arenaBlock_(Arena::kDefaultBlock),
+			arenaTrim_(0),
 			status_(Status::STOPPED){
+			static_assert(Policies::RateLimitPolicy::kEnabled, "the pool is built without rate limiting");
 			if (threads > MAX_THREADS) {
 				throw kWrongCntEcp; 
 			}
+			initRegistry();
 		}
 		~ThreadPoolImpl() {
 			Stop();
+			registry_->Detach();
+			for (auto &c : carriers_) {
+				c->Exit();
+			}
+			if (dispatchCarrier_ != nullptr) {
+				dispatchCarrier_->Exit();
+			}
+			threads_.clear(); // join
+			dispatchThread_.reset();
 		}
 
 		virtual void Start() override {
-			// TODO: guard status
-			if (status_ != Status::STOPPED) {
+			auto s = Status::STOPPED;
+			if (!status_.compare_exchange_strong(s, Status::STARTING, std::memory_order_acq_rel)) {
 				return;
 			}
-			// create threads
-			threads_.reserve(numThreads_);
-			for (uint32_t i = 0; i < numThreads_; ++i) {
-				threads_.push_back(std::move(factory_->NewThread()));
+			tasks_.Reopen(); // after a Stop()
+
+			// Threads are only created by the first Start(); later cycles
+			// hand new workers to the same threads.
+			if (threads_.empty()) {
+				threads_.reserve(numThreads_);
+				for (uint32_t i = 0; i < numThreads_; ++i) {
+					carriers_.push_back(std::make_shared<Carrier>());
+					threads_.push_back(factory_->NewThread());
+					threads_[i]->Run(carriers_[i]);
+				}
 			}
 
 			// create workers
+			if (dispatching()) {
+				// Workers only see tasks that are cleared to run, so a few
+				// slots per worker are enough.
+				ready_ = std::make_unique<Container>(numThreads_);
+				dispatcher_ = std::make_shared<Dispatcher<Container, Profile::kEnabled>>(tasks_, *ready_, ratelimiter_, qm_, shed_, 
+						Features::kInFlight ? &inflight_ : nullptr);
+			}
+			workers_.clear(); // stopped in the previous cycle
 			for (uint32_t i = 0; i < numThreads_; ++i) {
-				workers_.push_back(std::make_shared<WorkerType>(tasks_, ratelimiter_));	
+				workers_.push_back(newWorker());
 			}
 
-			// start threads
+			// start workers
 			for (uint32_t i = 0; i < numThreads_; ++i) {
-				threads_[i]->Run(workers_[i]);
+				carriers_[i]->Assign(workers_[i]);
+			}
+			if (dispatching()) {
+				if (dispatchThread_ == nullptr) {
+					dispatchCarrier_ = std::make_shared<Carrier>();
+					dispatchThread_ = factory_->NewThread();
+					dispatchThread_->Run(dispatchCarrier_);
+				}
+				dispatchCarrier_->Assign(dispatcher_);
 			}
 			
 			if (ratelimiter_ != nullptr) {
 				ratelimiter_->Start();
 			}
 
-			status_ = Status::RUNNING;
+			status_.store(Status::RUNNING, std::memory_order_release);
 		}
 
 		// stop accepting new tasks, process pending tasks and shutdown the workers.
 		virtual void Stop() override {
-			if (status_ == Status::STOPPED || status_ == Status::STOPPING) {
+			auto s = Status::RUNNING;
+			if (!status_.compare_exchange_strong(s, Status::STOPPING, std::memory_order_acq_rel)) {
 				return;
 			}
-			status_ = Status::STOPPING;
 
 			tasks_.Close(); // close the queue so that blocking Get can return.
+			stopDispatcher();
 			for (uint32_t i = 0; i < numThreads_; ++i) {
 				workers_[i]->stop();
 			}
 			for (uint32_t i = 0; i < numThreads_; ++i) {
 				workers_[i]->wait();
 			}
+			stopSpares(false);
 			// only stop the rate limiter after all pending tasks are processed.
 			if (ratelimiter_ != nullptr) {
 				ratelimiter_->Stop(); // stop the rate limiter to avoid blocking
 			}
-			status_ = Status::STOPPED;
+			status_.store(Status::STOPPED, std::memory_order_release);
 		}
 
-		// stop all workers and discard any pending tasks.
+		// stop all workers after their current task and cancel any pending tasks.
 		virtual void StopNow() override {
-			if (status_ == Status::STOPPED || status_ == Status::STOPPING) {
+			auto s = Status::RUNNING;
+			if (!status_.compare_exchange_strong(s, Status::STOPPING, std::memory_order_acq_rel)) {
 				return;
 			}
-			status_ = Status::STOPPING;
 
+			for (uint32_t i = 0; i < numThreads_; ++i) {
+				workers_[i]->stopNow();
+			}
 			tasks_.Close(); // close the queue so that blocking Get can return.
+			if (ready_ != nullptr) {
+				// The workers no longer drain it, so the dispatcher must not
+				// block on a full ready queue.
+				ready_->Close();
+			}
 			if (ratelimiter_ != nullptr) {
 				ratelimiter_->Stop(); // stop the rate limiter to avoid blocking
 			}
-			for (uint32_t i = 0; i < numThreads_; ++i) {
-				workers_[i]->stop();
-			}
+			stopDispatcher();
 			for (uint32_t i = 0; i < numThreads_; ++i) {
 				workers_[i]->wait();
 			}
-			status_ = Status::STOPPED;
+			stopSpares(true);
+			cancelPending(tasks_);
+			if (ready_ != nullptr) {
+				cancelPending(*ready_);
+			}
+			status_.store(Status::STOPPED, std::memory_order_release);
+		}
+
+		// SetQueueManager installs an active queue management policy, e.g.
+		// CoDel, and an optional handler for the tasks it sheds. It must be
+		// called before Start().
+		void SetQueueManager(std::shared_ptr<QueueManager> qm, ShedHandler shed = nullptr) {
+			static_assert(Features::kAdmission, "the pool is built without admission control");
+			qm_ = qm;
+			shed_ = shed;
+		}
+
+		// SetConcurrencyLimiter caps the number of tasks running at once,
+		// e.g. with a Gradient2Limiter that finds the limit from the latency
+		// of the tasks; workers beyond the limit wait for a slot before they
+		// take a task, so that the others stay queued. It must be called
+		// before Start().
+		void SetConcurrencyLimiter(std::shared_ptr<ConcurrencyLimiter> limiter) {
+			static_assert(Features::kAdmission, "the pool is built without admission control");
+			limiter_ = limiter;
+		}
+
+		// SetRateLimitMode selects where workers wait for rate limiter tokens.
+		// It must be called before Start().
+		void SetRateLimitMode(RateLimitMode mode) {
+			mode_ = mode;
+		}
+
+		// SetWeight sets the share of worker time of a task class, for pools
+		// whose queue schedules by class, e.g. FairThreadPool.
+		void SetWeight(int cls, uint32_t weight) {
+			tasks_.Visit([=](auto &q) { q.setWeight(cls, weight); });
+		}
+
+		// GetStats returns the stats of the pool, for pools with a stats
+		// policy such as CountStats.
+		const Stats& GetStats() const {
+			return stats_;
+		}
+
+		// GetProfiler returns the profiler of the pool, for pools with a
+		// profile policy such as TaskProfiler.
+		Profile& GetProfiler() {
+			return profile_;
+		}
+
+		// WaitIdle blocks until every task accepted so far has finished, i.e.
+		// the queue is empty and no task is running, without stopping the
+		// pool. timeout has the same meaning as for Channel::Get(). It
+		// returns true if the pool is idle. Tasks posted meanwhile, including
+		// Posts blocked on a full queue, are waited for as well.
+		bool WaitIdle(int64_t timeout = -1) {
+			static_assert(Features::kInFlight, "the pool is built without counting tasks in flight");
+			return inflight_.Wait(timeout);
+		}
+
+		// Pending returns the approximate number of queued tasks, without
+		// taking the lock of the queue.
+		uint32_t Pending() const {
+			return tasks_.Size();
+		}
+
+		// SetMaxSpareWorkers caps the number of spare workers started for
+		// blocked workers; by default the pool may grow to MAX_THREADS.
+		void SetMaxSpareWorkers(uint32_t n) {
+			maxSpares_ = std::min<uint32_t>(n, MAX_THREADS - numThreads_);
+		}
+
+		// SetArena sizes the scratch arena of each worker, see
+		// CurrentWorker::Arena(): the arena grows by blocks of blockSize
+		// bytes, and keeps up to trim bytes of blocks between tasks (0 keeps
+		// them all), so that one large task does not pin its memory for good.
+		// It must be called before Start().
+		void SetArena(size_t blockSize, size_t trim) {
+			static_assert(Features::kArena, "the pool is built without arenas");
+			arenaBlock_ = blockSize;
+			arenaTrim_ = trim;
+		}
+
+		// Threads returns the number of workers, including spare workers.
+		uint32_t Threads() const {
+			return numThreads_ + spares_;
+		}
+
+		// PostBlocking posts a task that blocks for its whole run.
+		bool PostBlocking(const std::shared_ptr<Runnable> &task, int64_t timeout = -1, int64_t expiration = 0, int priority = 0) {
+			return Post(std::make_shared<BlockingRunnable>(task), timeout, expiration, priority);
+		}
+
+		virtual void BeginBlocking() override {
+			if (++blocked_ <= spares_) {
+				return;
+			}
+			std::lock_guard<std::mutex> lck(spareMtx_);
+			if (status_.load(std::memory_order_acquire) != Status::RUNNING) {
+				return;
+			}
+			reapSpares();
+			while (spares_ < blocked_ && spares_ < maxSpares_) {
+				startSpare();
+			}
+		}
+
+		virtual void EndBlocking() override {
+			--blocked_; // spare workers retire by themselves
+		}
+
+		// PostTagged posts a task of the given type; a profiling pool accounts
+		// its resource usage to tag, which must outlive the pool, e.g. a
+		// string literal.
+		bool PostTagged(const char *tag, const std::shared_ptr<Runnable> &task, int64_t timeout = -1, int64_t expiration = 0, int priority = 0) {
+			if (status_.load(std::memory_order_acquire) != Status::RUNNING) {
+				return false;
+			}
+			if (!admit(task)) {
+				return false;
+			}
+			auto t  = T(task, expiration, priority, nullptr, tag, Features::kStamp); 
+			return put(t, timeout);
+		}
+
+		// SetAging sets how fast waiting tasks gain priority, for pools whose
+		// queue ages tasks, e.g. PriThreadPool; see AgingPriQueue.
+		void SetAging(std::chrono::milliseconds step, int maxBoost) {
+			tasks_.Visit([=](auto &q) { q.setAging(step, maxBoost); });
+		}
+
+		// Reprioritize moves a pending task to another priority level, for
+		// pools whose queue supports it, e.g. PriThreadPool. It returns false
+		// if the task is no longer pending.
+		bool Reprioritize(const std::shared_ptr<TaskHandle> &h, int priority) {
+			bool ok = false;
+			tasks_.Visit([&](auto &q) { ok = q.reprioritize(h.get(), priority) || ok; });
+			return ok && h->State() == TaskHandle::Status::PENDING;
 		}
 
 		// post is the producer of the task queue.
 		virtual bool Post(const std::shared_ptr<Runnable> &task, int64_t timeout = -1, int64_t expiration = 0, int priority = 0) override {
-			if (status_ != Status::RUNNING) {
+			if (status_.load(std::memory_order_acquire) != Status::RUNNING) {
+				return false;
+			}
+			if (!admit(task)) {
 				return false;
 			}
-			auto t  = T(task, expiration, priority); 
-			return tasks_.Put(t, timeout);
+			auto t  = T(task, expiration, priority, nullptr, nullptr, Features::kStamp); 
+			return put(t, timeout);
+		}
+
+		virtual std::shared_ptr<TaskHandle> Submit(const std::shared_ptr<Runnable> &task, int64_t timeout = -1, int64_t expiration = 0, int priority = 0, uint64_t group = 0) override {
+			if (status_.load(std::memory_order_acquire) != Status::RUNNING) {
+				return nullptr;
+			}
+			if (!admit(task)) {
+				return nullptr;
+			}
+			auto h = std::make_shared<TaskHandle>(registry_, group);
+			auto t  = T(task, expiration, priority, h, nullptr, Features::kStamp); 
+			if (!put(t, timeout)) {
+				return nullptr;
+			}
+			// Registered after Put, so that a concurrent CancelGroup never
+			// sees a task that is not in the queue yet.
+			registry_->Add(h);
+			return h;
+		}
+
+		virtual size_t CancelGroup(uint64_t group) override {
+			return registry_->CancelGroup(group);
 		}
 	private:
 		std::shared_ptr<ThreadFactory> factory_;
 		uint32_t numThreads_; 
 		std::vector<std::shared_ptr<WorkerType>> workers_;
 		std::vector<std::shared_ptr<Thread>> threads_;
+		std::vector<std::shared_ptr<Carrier>> carriers_; // one per thread
 		Container tasks_;
 		std::shared_ptr<RateLimiter> ratelimiter_;
+		std::shared_ptr<TaskRegistry> registry_;
+		std::shared_ptr<QueueManager> qm_;
+		ShedHandler shed_;
+		std::shared_ptr<ConcurrencyLimiter> limiter_;
+		RateLimitMode mode_;
+		std::unique_ptr<Container> ready_; // tasks cleared by the dispatcher
+		std::shared_ptr<Dispatcher<Container, Profile::kEnabled>> dispatcher_;
+		std::unique_ptr<Thread> dispatchThread_;
+		std::shared_ptr<Carrier> dispatchCarrier_;
+		InFlight inflight_;
+		Stats stats_;
+		Profile profile_;
+
+		struct Spare {
+			std::unique_ptr<Thread> thread;
+			std::shared_ptr<WorkerType> worker;
+		};
+		std::mutex spareMtx_;
+		std::vector<Spare> spareWorkers_; // including retired ones not reaped yet
+		std::atomic<uint32_t> blocked_; // workers in a blocking region
+		std::atomic<uint32_t> spares_;  // spare workers not retired
+		uint32_t maxSpares_;
+		size_t arenaBlock_;
+		size_t arenaTrim_;
+
+		//   STOPPED --Start()--> STARTING --> RUNNING --Stop()/StopNow()--> STOPPING --> STOPPED
+		// Only the caller that wins the transition out of STOPPED or RUNNING
+		// goes on, so concurrent calls are safe. Producers read the state on
+		// every Post, so it sits on a cache line of its own, away from the
+		// lock of the queue.
+		enum class Status { STOPPED, STARTING, RUNNING, STOPPING};
+		char pad0_[CACHELINE_SIZE];
+		std::atomic<Status> status_;
+		char pad1_[CACHELINE_SIZE];
 
-		enum class Status { STOPPED, RUNNING, STOPPING};
-		Status status_;
+		std::shared_ptr<WorkerType> newWorker() {
+			std::shared_ptr<WorkerType> w;
+			if (dispatching()) {
+				w = std::make_shared<WorkerType>(*ready_, nullptr, nullptr, nullptr, &tasks_);
+			} else {
+				w = std::make_shared<WorkerType>(tasks_, ratelimiter_, qm_, shed_);
+			}
+			w->setBlockingHook(this);
+			w->setStats(&stats_);
+			w->setProfile(&profile_);
+			w->setInFlight(&inflight_);
+			w->setLimiter(limiter_);
+			w->setArena(arenaBlock_, arenaTrim_);
+			return w;
+		}
+
+		// startSpare starts a spare worker. The caller holds spareMtx_.
+		void startSpare() {
+			Spare s;
+			s.worker = newWorker();
+			s.worker->setRetire([this] { return retire(); });
+			s.thread = factory_->NewThread();
+			++spares_;
+			s.thread->Run(s.worker);
+			spareWorkers_.push_back(std::move(s));
+		}
+
+		// retire is called by spare workers; one retires for each spare
+		// worker beyond the blocked workers.
+		bool retire() {
+			auto n = spares_.load();
+			while (n > blocked_) {
+				if (spares_.compare_exchange_weak(n, n - 1)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// reapSpares joins retired spare workers. The caller holds spareMtx_.
+		void reapSpares() {
+			auto it = std::remove_if(spareWorkers_.begin(), spareWorkers_.end(), 
+					[](Spare &s) { return s.worker->tryWait(); });
+			spareWorkers_.erase(it, spareWorkers_.end());
+		}
+
+		// stopSpares stops the spare workers along with the others. The
+		// lock is not held while waiting, as a blocked task may still call
+		// BeginBlocking().
+		void stopSpares(bool now) {
+			std::vector<Spare> spares;
+			{
+				std::lock_guard<std::mutex> lck(spareMtx_);
+				spares.swap(spareWorkers_);
+			}
+			for (auto &s : spares) {
+				if (now) {
+					s.worker->stopNow();
+				} else {
+					s.worker->stop();
+				}
+			}
+			for (auto &s : spares) {
+				s.worker->wait();
+			}
+			spares_ = 0;
+		}
+
+		bool dispatching() {
+			return Policies::RateLimitPolicy::kEnabled && 
+				ratelimiter_ != nullptr && mode_ == RateLimitMode::DISPATCH;
+		}
+
+		// cancelPending empties a closed queue after the workers have
+		// stopped, so that no handle is left waiting.
+		void cancelPending(Container &q) {
+			T t;
+			while (q.Get(t, 0)) {
+				t.Finish(TaskHandle::Status::CANCELLED);
+				if (Features::kInFlight) {
+					inflight_.Done();
+				}
+			}
+		}
+
+		// stopDispatcher waits for the dispatcher to drain the closed task
+		// queue, then closes the ready queue for the workers.
+		void stopDispatcher() {
+			if (dispatcher_ == nullptr) {
+				return;
+			}
+			dispatcher_->stop();
+			dispatcher_->wait();
+			ready_->Close();
+		}
+
+		// put queues an accepted task, counting it in flight.
+		bool put(const T &t, int64_t timeout) {
+			if (!Features::kInFlight) {
+				return tasks_.Put(t, timeout);
+			}
+			inflight_.Add();
+			if (!tasks_.Put(t, timeout)) {
+				inflight_.Done();
+				return false;
+			}
+			return true;
+		}
+
+		bool admit(const std::shared_ptr<Runnable> &task) {
+			if (!Features::kAdmission || qm_ == nullptr || qm_->Admit()) {
+				return true;
+			}
+			if (shed_ != nullptr) {
+				shed_(task);
+			}
+			return false;
+		}
+
+		void initRegistry() {
+			registry_ = std::make_shared<TaskRegistry>(
+				[this](TaskHandle *h, const std::function<bool()> &claim) {
+					return tasks_.Discard(h->Owner(), h, claim);
+				},
+				[this] {
+					if (Features::kInFlight) {
+						inflight_.Done();
+					}
+				});
+		}
 };
 
 
 using FifoThreadPool = ThreadPoolImpl<Task, Channel<Task>>;
-using PriThreadPool = ThreadPoolImpl<Task, Channel<Task, PriQueue<Task>>>;
+// LeanThreadPool is a FIFO pool without expiration, rate limiting, stats,
+// logging or the features of AllFeatures: workers only take tasks and run
+// them.
+using LeanThreadPool = ThreadPoolImpl<Task, Channel<Task>, LeanPolicies>;
+// ProfiledThreadPool is a FIFO pool that accounts the resources of tasks by
+// type, see PostTagged and GetProfiler.
+using ProfiledThreadPool = ThreadPoolImpl<Task, Channel<Task>,
+	PoolPolicies<CheckExpiry, UseRateLimit, NoStats, DefaultLog, TaskProfiler>>;
+// PriThreadPool ages waiting tasks, so that low priorities are not starved;
+// StrictPriThreadPool always runs the highest priority first.
+using PriThreadPool = ThreadPoolImpl<Task, Channel<Task, AgingPriQueue<Task>>>;
+using StrictPriThreadPool = ThreadPoolImpl<Task, Channel<Task, PriQueue<Task>>>;
+// FairThreadPool shares worker time among task classes by weight; the
+// priority argument of Post selects the class of a task.
+using FairThreadPool = ThreadPoolImpl<Task, Channel<Task, FairQueue<Task>>>;
+// Sharded variants trade strict ordering for lower lock contention at high
+// core counts; priority ordering only holds within each shard.
+using ShardedFifoThreadPool = ThreadPoolImpl<Task, ShardedChannel<Task>>;
+using ShardedPriThreadPool = ThreadPoolImpl<Task, ShardedChannel<Task, AgingPriQueue<Task>>>;
 //FifoThreadPool dummy(nullptr, 1, 1);
 //PriThreadPool dummy2(nullptr, 1, 1);
 
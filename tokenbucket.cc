@@ -4,83 +4,78 @@
 #include <thread>         // std::this_thread::sleep_until
 #include <chrono>         // std::chrono::system_clock
 #include <mutex>
+#include <condition_variable>
 #include <memory>
+#include <map>
 #include <ctime>
+#include <functional>
 
-#include "runnable.h"
-#include "thread.h"
-#include "stdthread.h"
-#include "channel.h"
-#include "priqueue.h"
-
-struct token {
-	token() : tick_(0) {}
-	explicit token(uint64_t t, int p) : tick_(t), priority(p) {}
-	uint64_t tick_;
-	inline bool isEmpty() {
-		return tick_ == 0;
-	}
-	void Print() {}
-	int GetPriority() {
-		return priority.GetPriority();
-	}
-	Priority priority;
-};
-
+using namespace std;
+using namespace std::chrono;
 
-// specialize less<> for Task
-namespace std {
-template<>
-class less<token> {
-	public:
-		bool operator() (const token& x, const token& y) const {
-			return std::less<Priority>()(x.priority, y.priority);
-		}
+// A caller of GetToken waiting for tokens.
+struct waiter {
+	waiter(int p, double n) : priority(p), tokens(n) {}
+	int priority;
+	double tokens;
+	std::condition_variable cv;
 };
-}
 
-class TokenBucket::Impl : public Runnable, std::enable_shared_from_this<TokenBucket::Impl> {
+// Waiters are served by descending priority, then in arrival order.
+using waiterKey = std::pair<int, uint64_t>; // (-priority, sequence number)
+
+// Tokens are not generated by a timer; the bucket is refilled from the
+// elapsed time whenever it is looked at. Only the first waiter sleeps for
+// the time it takes to refill its tokens, the others wait for their turn.
+class TokenBucket::Impl {
 	public:
-		explicit Impl(uint32_t rate);
+		Impl(double rate, double burst);
 		Impl(const Impl&) = delete;
 		~Impl();
 		void Start();
 		void Stop();
-		uint32_t GetRate();
-		bool GetToken(int64_t timeout);
-
-		virtual void Run() override; // Runnable interface
-		virtual void Print() {}
+		double GetRate();
+		void SetRate(double rate);
+		bool GetTokens(double n, int64_t timeout, int priority);
+		microseconds Reserve(double n);
+		void SetReserved(int priority, uint32_t tokens);
 
 	private:
-		using PToken = token;
-		using PQueue = PriQueue<PToken>;
-		using Container = Channel<PToken, PQueue>;
+		using Clock = steady_clock;
 
-		uint32_t rate_;
-		std::chrono::system_clock::time_point start_; // start time
-		std::chrono::microseconds interval_;
+		double rate_;   // tokens per second
+		double burst_;  // capacity of the bucket
+		double tokens_; // may be negative after Reserve()
+		Clock::time_point last_; // time of the last refill
+		bool started_;
 		bool stop_;
-		std::shared_ptr<std::thread> thread_;
-		std::unique_ptr<Container> tokens_;
+
+		std::mutex mtx_;
+		uint64_t seq_;
+		std::map<waiterKey, waiter*> waiters_;
+		std::map<int, uint32_t> reserved_; // tokens kept for each priority level
+
+		void refill(Clock::time_point now);
+		double keep(int priority);
+		void wakeFirst();
 };
 
-using namespace std;
-using namespace std::chrono;
 const uint32_t ONE_MILLION = 1000000;
 
 
-TokenBucket::Impl::Impl(uint32_t rate) : 
-	rate_(rate), 
-	stop_(false) {
-	if (rate_ == 0) {
+TokenBucket::Impl::Impl(double rate, double burst) :
+	rate_(rate),
+	burst_(burst),
+	tokens_(0),
+	started_(false),
+	stop_(false),
+	seq_(0) {
+	if (rate_ <= 0) {
 		rate_ = 1;
-	} else if (rate_ > ONE_MILLION) {
-		rate_ = ONE_MILLION;
 	}
-
-	interval_ = microseconds(ONE_MILLION / rate_);
-	tokens_ = std::make_unique<Container>(rate_);
+	if (burst_ < 1) {
+		burst_ = rate_ < 1 ? 1 : rate_;
+	}
 }
 
 TokenBucket::Impl::~Impl() {
@@ -88,59 +83,146 @@ TokenBucket::Impl::~Impl() {
 }
 
 void TokenBucket::Impl::Start() {
-	thread_ = make_unique<std::thread>(std::bind(&TokenBucket::Impl::Run, this));
+	lock_guard<mutex> lck(mtx_);
+	stop_ = false;
+	started_ = true;
+	last_ = Clock::now();
+	wakeFirst();
+}
+
+void TokenBucket::Impl::Stop() {
+	lock_guard<mutex> lck(mtx_);
+	stop_ = true;
+	started_ = false;
+	for (auto &w : waiters_) {
+		w.second->cv.notify_one();
+	}
 }
 
-inline void PrintTime(const system_clock::time_point &t) {
-	time_t tt = system_clock::to_time_t (t);
-    std::cout << ctime(&tt) << endl;
+double TokenBucket::Impl::GetRate() {
+	lock_guard<mutex> lck(mtx_);
+	return rate_;
 }
 
-void TokenBucket::Impl::Run() {
-	start_ = system_clock::now();
-	auto next = start_ + interval_;
-	uint64_t ticks = 1;
-	while( !stop_) {
-		//PrintTime(next);
-		std::this_thread::sleep_until(next);
+void TokenBucket::Impl::SetRate(double rate) {
+	lock_guard<mutex> lck(mtx_);
+	refill(Clock::now()); // tokens so far accrue at the old rate
+	rate_ = rate > 0 ? rate : rate_;
+	wakeFirst(); // to recompute its sleep time
+}
 
-		// do not wait
-		token t(ticks, 1);
-		//PToken elm(t, 1);
-		tokens_->Put(t, -1);
-		++ticks;
-		next = start_ + interval_*ticks;
+void TokenBucket::Impl::SetReserved(int priority, uint32_t tokens) {
+	lock_guard<mutex> lck(mtx_);
+	if (tokens == 0) {
+		reserved_.erase(priority);
+	} else {
+		reserved_[priority] = tokens;
 	}
+	wakeFirst();
 }
 
-void TokenBucket::Impl::Stop() {
-	stop_ = true;
-	tokens_->Close();
-	if (thread_ != nullptr && thread_->joinable()) {
-		// wait for thread to finish
-		thread_->join();
+// refill adds the tokens accrued since the last refill. The caller holds mtx_.
+void TokenBucket::Impl::refill(Clock::time_point now) {
+	if (!started_) {
+		return;
+	}
+	double elapsed = duration<double>(now - last_).count();
+	last_ = now;
+	tokens_ += elapsed * rate_;
+	if (tokens_ > burst_) {
+		tokens_ = burst_;
 	}
 }
 
-uint32_t TokenBucket::Impl::GetRate() {
-	return rate_;
+// keep returns the number of tokens reserved for the levels above the given
+// priority. The caller holds mtx_.
+double TokenBucket::Impl::keep(int priority) {
+	uint32_t n = 0;
+	for (auto it = reserved_.upper_bound(priority); it != reserved_.end(); ++it) {
+		n += it->second;
+	}
+	return n;
+}
+
+void TokenBucket::Impl::wakeFirst() {
+	if (!waiters_.empty()) {
+		waiters_.begin()->second->cv.notify_one();
+	}
 }
 
-bool TokenBucket::Impl::GetToken(int64_t timeout) {
-	if (stop_) {
+bool TokenBucket::Impl::GetTokens(double n, int64_t timeout, int priority) {
+	unique_lock<mutex> lck(mtx_);
+	// The bucket never holds more than burst_ tokens, so a request that
+	// does not fit next to the reservations above it would never succeed,
+	// and would hold up every waiter behind it.
+	if (stop_ || n + keep(priority) > burst_) {
 		return false;
 	}
-	auto t = tokens_->Get(timeout);
-	if (0 == t.GetPriority()) {
+	auto now = Clock::now();
+	refill(now);
+	// Do not overtake waiters of the same or higher priority.
+	bool ahead = !waiters_.empty() && -waiters_.begin()->first.first >= priority;
+	if (!ahead && started_ && tokens_ - keep(priority) >= n) {
+		tokens_ -= n;
+		return true;
+	}
+	if (timeout == 0) {
 		return false;
 	}
 
-	return true;
+	waiter w(priority, n);
+	auto key = waiterKey(-priority, seq_++);
+	waiters_[key] = &w;
+	auto deadline = now + milliseconds(timeout);
+	bool ok = false;
+	while (!stop_) {
+		now = Clock::now();
+		if (timeout > 0 && now >= deadline) {
+			break;
+		}
+		if (n + keep(priority) > burst_) {
+			break; // reservations have grown since
+		}
+		if (waiters_.begin()->second != &w || !started_) {
+			// Not our turn yet.
+			if (timeout < 0) {
+				w.cv.wait(lck);
+			} else {
+				w.cv.wait_until(lck, deadline);
+			}
+			continue;
+		}
+		refill(now);
+		double missing = n + keep(priority) - tokens_;
+		if (missing <= 0) {
+			tokens_ -= n;
+			ok = true;
+			break;
+		}
+		auto wakeup = now + duration_cast<Clock::duration>(duration<double>(missing / rate_));
+		if (timeout > 0 && wakeup > deadline) {
+			wakeup = deadline;
+		}
+		w.cv.wait_until(lck, wakeup);
+	}
+	waiters_.erase(key);
+	wakeFirst(); // the next waiter, if any, is first now
+	return ok;
+}
+
+microseconds TokenBucket::Impl::Reserve(double n) {
+	lock_guard<mutex> lck(mtx_);
+	refill(Clock::now());
+	tokens_ -= n;
+	if (tokens_ >= 0) {
+		return microseconds(0);
+	}
+	return microseconds(static_cast<int64_t>(-tokens_ / rate_ * ONE_MILLION + 0.5));
 }
 
 
-TokenBucket::TokenBucket(uint32_t rate) {
-	impl_ = std::make_unique<Impl>(rate);
+TokenBucket::TokenBucket(uint32_t rate, uint32_t burst) {
+	impl_ = std::make_unique<Impl>(rate, burst);
 }
 
 TokenBucket::~TokenBucket() {}
@@ -154,11 +236,29 @@ void TokenBucket::Stop() {
 }
 
 uint32_t TokenBucket::GetRate() {
-	return impl_->GetRate();
+	return static_cast<uint32_t>(impl_->GetRate() + 0.5);
+}
+
+void TokenBucket::SetRate(double rate) {
+	impl_->SetRate(rate);
 }
 
 bool TokenBucket::GetToken(int64_t timeout) {
-	return impl_->GetToken(timeout);
+	return impl_->GetTokens(1, timeout, 0);
 }
 
+bool TokenBucket::GetToken(int64_t timeout, int priority) {
+	return impl_->GetTokens(1, timeout, priority);
+}
+
+bool TokenBucket::GetTokens(uint32_t n, int64_t timeout, int priority) {
+	return impl_->GetTokens(n, timeout, priority);
+}
 
+std::chrono::microseconds TokenBucket::Reserve(uint32_t n) {
+	return impl_->Reserve(n);
+}
+
+void TokenBucket::SetReserved(int priority, uint32_t tokens) {
+	impl_->SetReserved(priority, tokens);
+}
@@ -4,11 +4,15 @@
 #include "ratelimiter.h"
 
 #include <memory>
+#include <chrono>
 
 // TokenBucket implements a token bucket algorithm according to the  RateLimiter interface.
+// The bucket is refilled continuously at 'rate' tokens per second, with
+// exact fractional accounting, up to 'burst' tokens. It starts empty.
 class TokenBucket : public RateLimiter {
 	public:
-		explicit TokenBucket(uint32_t rate);
+		// burst == 0 sizes the bucket to one second worth of tokens.
+		explicit TokenBucket(uint32_t rate, uint32_t burst = 0);
 		TokenBucket(const TokenBucket&) = delete;
 		TokenBucket(TokenBucket&&) = delete;
 		TokenBucket& operator+(const TokenBucket&) = delete;
@@ -19,12 +23,37 @@ class TokenBucket : public RateLimiter {
 		virtual void Stop() override;
 		virtual uint32_t GetRate() override;
 
+		// SetRate changes the rate at runtime; tokens accrued so far are kept.
+		// Fractional rates, e.g. 0.5 tokens per second, are allowed.
+		void SetRate(double rate);
+
 		// GetToken may be blocking or nonblocking, depending on the value of timeout.
 		// If timeout == 0, it returns immediately indicating if a token is obtained.
 		// If timeout < 0, it blocks until a token is obtained.
 		// If timeout > 0, it waits for a maximum of timeout milliseconds to obtain a token.
 		virtual bool GetToken(int64_t timeout = -1) override;
 
+		// Same as GetToken(timeout), but waiters are served by descending
+		// priority, and in arrival order within a priority. GetToken(timeout)
+		// has priority 0.
+		virtual bool GetToken(int64_t timeout, int priority) override;
+
+		// GetTokens takes n tokens at once, for work of weighted cost. It fails
+		// immediately if n exceeds the burst size less the tokens reserved for
+		// higher priorities, as the bucket could never hold enough tokens.
+		bool GetTokens(uint32_t n, int64_t timeout = -1, int priority = 0);
+
+		// Reserve takes n tokens without blocking, going into debt if needed,
+		// and returns how long the caller should wait before using them.
+		// Later callers wait until the debt is paid off.
+		std::chrono::microseconds Reserve(uint32_t n);
+
+		// SetReserved keeps the last 'tokens' tokens in the bucket for callers
+		// of priority 'priority' or higher, so that critical traffic keeps its
+		// share when the bucket is saturated. Reservations of several levels
+		// add up. tokens == 0 removes the reservation.
+		void SetReserved(int priority, uint32_t tokens);
+
 	private:
 		class Impl;
 		std::unique_ptr<Impl> impl_;